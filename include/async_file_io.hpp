@@ -0,0 +1,102 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bounded_queue.hpp"
+
+struct AVIOContext;
+
+// Output file behind a custom AVIOContext. The muxer's writes are gathered
+// into large page-aligned buffers that a writer thread puts on disk, so the
+// encode thread only waits on storage once every buffer is in flight. A
+// buffer is handed over when full, when the muxer seeks, or once it has held
+// data for FLUSH_INTERVAL, which keeps a growing file readable by others.
+// The file is synced once, on close.
+class AsyncFileWriter {
+public:
+    AsyncFileWriter();
+    ~AsyncFileWriter();
+    
+    AsyncFileWriter(const AsyncFileWriter&) = delete;
+    AsyncFileWriter& operator=(const AsyncFileWriter&) = delete;
+    
+    // Creates or truncates path
+    bool open(const std::string& path);
+    bool isOpen() const { return fd >= 0; }
+    // For AVFormatContext::pb; owned by the writer
+    AVIOContext* context() const { return ioContext; }
+    
+    // Flushes everything, waits for the writer thread and syncs the file.
+    // Returns false if any write failed.
+    bool close();
+    
+    static constexpr size_t BUFFER_SIZE = 4 * 1024 * 1024;
+    static constexpr size_t BUFFER_COUNT = 4;
+    static constexpr std::chrono::milliseconds FLUSH_INTERVAL{1000};
+    // What the muxer fills before calling back; it flushes after every packet anyway
+    static constexpr int IO_BUFFER_SIZE = 64 * 1024;
+
+private:
+    struct Block {
+        uint8_t* data = nullptr;
+        size_t size = 0;
+        int64_t offset = 0;
+    };
+    
+    static int writePacket(void* opaque, const uint8_t* data, int size);
+    static int64_t seek(void* opaque, int64_t offset, int whence);
+    
+    bool append(const uint8_t* data, size_t size);
+    void handOver();
+    void writerLoop();
+    
+    int fd = -1;
+    AVIOContext* ioContext = nullptr;
+    std::thread writer;
+    std::vector<uint8_t*> blocks;
+    // New per file: a closed queue cannot be reopened
+    std::unique_ptr<BoundedQueue<Block>> freeBlocks;
+    std::unique_ptr<BoundedQueue<Block>> pendingBlocks;
+    Block current;
+    std::chrono::steady_clock::time_point currentSince;
+    int64_t position = 0;   // where the muxer writes next
+    int64_t fileSize = 0;   // end of everything written so far
+    std::atomic<bool> failed{false};
+};
+
+// Input file behind a custom AVIOContext with a large buffer. Reads ask the
+// kernel to prefetch the window after them, so slow or network volumes
+// fetch ahead of the demuxer instead of one small read at a time.
+class ReadAheadFile {
+public:
+    ReadAheadFile() = default;
+    ~ReadAheadFile();
+    
+    ReadAheadFile(const ReadAheadFile&) = delete;
+    ReadAheadFile& operator=(const ReadAheadFile&) = delete;
+    
+    bool open(const std::string& path);
+    // For AVFormatContext::pb; owned by the reader
+    AVIOContext* context() const { return ioContext; }
+    // Only after avformat_close_input, which leaves custom IO alone
+    void close();
+    
+    static constexpr int BUFFER_SIZE = 1024 * 1024;
+    static constexpr int64_t READ_AHEAD_BYTES = 16 * 1024 * 1024;
+
+private:
+    static int readPacket(void* opaque, uint8_t* buffer, int size);
+    static int64_t seek(void* opaque, int64_t offset, int whence);
+    
+    int fd = -1;
+    AVIOContext* ioContext = nullptr;
+    int64_t position = 0;
+    int64_t fileSize = 0;
+    int64_t prefetchedTo = 0;
+};
@@ -0,0 +1,85 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "bounded_queue.hpp"
+
+struct AVAudioFifo;
+struct AVCodecContext;
+struct AVFrame;
+struct AVPacket;
+struct AVRational;
+struct SwrContext;
+
+// Transcodes one audio stream on a thread of its own, so audio costs the
+// video loop only a packet reference. Decoded samples are converted to the
+// encoder's format, rate and layout with libswresample and gathered in an
+// AVAudioFifo until there is a whole encoder frame (1024 samples for AAC).
+// Encoded packets wait in dts order for the muxer to take them next to the
+// video packets.
+class AudioTranscoder {
+public:
+    AudioTranscoder() = default;
+    ~AudioTranscoder();
+    
+    AudioTranscoder(const AudioTranscoder&) = delete;
+    AudioTranscoder& operator=(const AudioTranscoder&) = delete;
+    
+    // decoder and encoder are opened by the caller and must outlive the
+    // transcode. Packets come in inputTimeBase, encoded ones leave in the
+    // encoder's.
+    bool start(AVCodecContext* decoder, AVCodecContext* encoder, AVRational inputTimeBase);
+    bool active() const { return worker.joinable(); }
+    
+    // Hands a reference to the packet to the audio thread. Blocks while
+    // QUEUE_DEPTH packets are waiting; false once the thread has failed.
+    bool push(const AVPacket* packet);
+    
+    // Moves the next encoded packet into packet if its dts is at or before
+    // dts (in timeBase), or if dts is AV_NOPTS_VALUE. False when none is ready.
+    bool pop(AVPacket* packet, int64_t dts, AVRational timeBase);
+    
+    // Drains decoder, resampler, FIFO and encoder and waits for the thread.
+    // What is left to pop afterwards is the rest of the stream.
+    bool finish();
+    
+    // Stops the thread and drops everything, ready for the next job
+    void reset();
+    
+    // Packets of compressed audio in flight to the audio thread
+    static constexpr size_t QUEUE_DEPTH = 64;
+
+private:
+    void run();
+    bool decode(const AVPacket* packet);
+    // frame is null to flush the resampler
+    bool resample(const AVFrame* frame);
+    // Encodes whole frames from the FIFO; flush also sends the partial last one and drains the encoder
+    bool encodeFifo(bool flush);
+    bool receivePackets();
+    
+    AVCodecContext* decoder = nullptr;
+    AVCodecContext* encoder = nullptr;
+    int inputTimeBaseNum = 0;
+    int inputTimeBaseDen = 1;
+    
+    std::unique_ptr<BoundedQueue<AVPacket*>> packets;
+    std::thread worker;
+    std::atomic<bool> failed{false};
+    
+    // Used by the audio thread only
+    SwrContext* resampler = nullptr;
+    AVAudioFifo* fifo = nullptr;
+    AVFrame* decoded = nullptr;
+    AVFrame* converted = nullptr;
+    AVFrame* batch = nullptr;
+    int64_t nextPts = 0;   // of the next encoder frame, in the encoder's time base
+    
+    std::mutex encodedMutex;
+    std::deque<AVPacket*> encoded;
+};
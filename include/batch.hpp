@@ -0,0 +1,33 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+class Coordinator;
+class VideoProcessor;
+
+// One transcode of a batch run
+struct BatchItem {
+    std::string inputPath;
+    std::string outputPath;
+    uint64_t inputBytes = 0;
+};
+
+// Gather inputs from a directory (its regular files), a glob pattern, or a
+// JSONL manifest with one {"input": "...", "output": "..."} object per line.
+// Inputs without an explicit output go to outputDirectory as <name>.mp4.
+bool collectBatchItems(const std::string& source, const std::string& outputDirectory,
+                       std::vector<BatchItem>& items);
+
+// Transcode every item on workerCount in-process workers, largest input
+// first so the pool drains evenly. Outputs that already exist are skipped;
+// each job writes <name>.part.<ext> and renames it once complete, so an
+// interrupted run resumes where it stopped. configure is applied to a
+// worker's processor before each job. With a coordinator, jobs go to its
+// cluster workers, with the configured processor's settings, and only run
+// in-process while none is connected; workerCount is then the number of
+// jobs in flight. Returns the number of failed items.
+int runBatch(std::vector<BatchItem> items, int workerCount,
+             const std::function<void(VideoProcessor& processor)>& configure,
+             Coordinator* coordinator = nullptr);
@@ -0,0 +1,114 @@
+#pragma once
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+
+// Bounded blocking FIFO used to hand work from one thread to another.
+// push() blocks while the queue is full (backpressure) and pop() blocks while
+// it is empty. close() marks the end of the stream: the consumer drains what
+// is left and then pop() returns false. abort() wakes every waiter and drops
+// the queued items through the disposer, which is how errors propagate.
+template <typename T>
+class BoundedQueue {
+public:
+    using Disposer = std::function<void(T&)>;
+    
+    explicit BoundedQueue(size_t capacity, Disposer dispose = nullptr)
+        : capacity(capacity > 0 ? capacity : 1), dispose(std::move(dispose)) {}
+    
+    ~BoundedQueue() {
+        abort();
+    }
+    
+    BoundedQueue(const BoundedQueue&) = delete;
+    BoundedQueue& operator=(const BoundedQueue&) = delete;
+    
+    // Blocks until there is room. Returns false (and disposes the item) if the
+    // queue was closed or aborted in the meantime.
+    bool push(T item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        notFull.wait(lock, [this] { return items.size() < capacity || closed || isAborted; });
+        if (closed || isAborted) {
+            lock.unlock();
+            disposeItem(item);
+            return false;
+        }
+        items.push_back(std::move(item));
+        notEmpty.notify_one();
+        return true;
+    }
+    
+    // Non-blocking push. Leaves the item with the caller when it returns false.
+    bool tryPush(T& item) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (closed || isAborted || items.size() >= capacity) {
+            return false;
+        }
+        items.push_back(std::move(item));
+        notEmpty.notify_one();
+        return true;
+    }
+    
+    // Blocks until an item is available. Returns false once the queue is
+    // closed and drained, or as soon as it is aborted.
+    bool pop(T& out) {
+        std::unique_lock<std::mutex> lock(mutex);
+        notEmpty.wait(lock, [this] { return !items.empty() || closed || isAborted; });
+        if (isAborted || items.empty()) {
+            return false;
+        }
+        out = std::move(items.front());
+        items.pop_front();
+        notFull.notify_one();
+        return true;
+    }
+    
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        notEmpty.notify_all();
+        notFull.notify_all();
+    }
+    
+    void abort() {
+        std::deque<T> dropped;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            isAborted = true;
+            dropped.swap(items);
+            notEmpty.notify_all();
+            notFull.notify_all();
+        }
+        for (auto& item : dropped) {
+            disposeItem(item);
+        }
+    }
+    
+    bool aborted() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return isAborted;
+    }
+    
+    size_t size() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return items.size();
+    }
+
+private:
+    void disposeItem(T& item) {
+        if (dispose) {
+            dispose(item);
+        }
+    }
+    
+    const size_t capacity;
+    Disposer dispose;
+    mutable std::mutex mutex;
+    std::condition_variable notEmpty;
+    std::condition_variable notFull;
+    std::deque<T> items;
+    bool closed = false;
+    bool isAborted = false;
+};
@@ -0,0 +1,138 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "video_processor.hpp"
+
+// Work for other processes, possibly on other hosts. Coordinator and
+// workers speak a line protocol over TCP, one message per line with
+// tab-separated, escaped fields:
+//
+//   worker -> coordinator   HELLO <name> <slots> <token>
+//                           HEARTBEAT <running> <load average>
+//                           DONE <task> <1|0>
+//   coordinator -> worker   RUN <task> job <input> <output> <settings>
+//                           RUN <task> segment <input> <spool> <start pts> <end pts> <settings>
+//                           CANCEL <task>
+//
+// Paths are sent as absolute paths and must name the same files on every
+// worker: one host, or storage mounted at the same place everywhere.
+// Settings come from VideoProcessor::exportSettings().
+//
+// The coordinator listens on loopback unless given a host. A coordinator
+// with a token drops any connection whose first message is not a HELLO
+// carrying it; without one it only listens on loopback addresses.
+
+// Where coordinator and workers take the shared token from, rather than
+// from the command line, where other users of the host could read it
+constexpr const char* CLUSTER_TOKEN_VARIABLE = "VIDEO_CLUSTER_TOKEN";
+std::string clusterToken();
+
+// Hands whole jobs and segments of segmented transcodes to registered
+// workers: the least loaded worker with a free slot gets the next one.
+// Work of a worker that disconnects or misses HEARTBEAT_TIMEOUT is given to
+// another, up to MAX_ATTEMPTS times. Every attempt writes to a path of its
+// own that is renamed into place once it succeeds, so a worker presumed
+// dead cannot overwrite the output of the attempt after it.
+class Coordinator {
+public:
+    Coordinator() = default;
+    ~Coordinator();
+    
+    Coordinator(const Coordinator&) = delete;
+    Coordinator& operator=(const Coordinator&) = delete;
+    
+    // Listens for workers on listenAddress, [host:]port. Workers must send
+    // token, if it is not empty.
+    bool start(const std::string& listenAddress, const std::string& token);
+    
+    // Slots of the workers connected now
+    int capacity() const;
+    // Until a worker has joined or timeout has passed; false if none did
+    bool waitForWorkers(std::chrono::seconds timeout);
+    
+    // Blocks until a worker has transcoded inputPath into outputPath.
+    // Unavailable when no worker is connected, or all of them went away and
+    // none came back within WORKER_WAIT, so the caller can run it itself.
+    RemoteResult runJob(const std::string& inputPath, const std::string& outputPath,
+                        const std::string& settings, const std::atomic<bool>* cancelFlag);
+    RemoteResult runSegment(const SegmentTask& task, const std::atomic<bool>* cancelFlag);
+    
+    // For VideoProcessor::setSegmentRunner; the coordinator must outlive it
+    SegmentRunner segmentRunner();
+    
+    static constexpr std::chrono::seconds HEARTBEAT_TIMEOUT{10};
+    static constexpr std::chrono::seconds WORKER_WAIT{30};
+    static constexpr int MAX_ATTEMPTS = 3;
+
+private:
+    struct Worker {
+        int id = 0;
+        int fd = -1;
+        std::string name;
+        int slots = 0;          // 0 until its HELLO
+        int running = 0;
+        double load = 0.0;
+        std::chrono::steady_clock::time_point lastSeen;
+        bool alive = true;
+        std::thread reader;
+    };
+    
+    struct Task {
+        uint64_t id = 0;
+        std::string kind;           // "job" or "segment"
+        std::string inputPath;
+        std::string outputPath;
+        int64_t startPts = 0;       // segments only
+        int64_t endPts = 0;
+        std::string settings;
+        std::vector<std::string> attemptPaths;
+        int workerId = 0;           // 0 while queued
+        bool finished = false;
+        RemoteResult result = RemoteResult::Failed;
+        std::chrono::steady_clock::time_point idleSince;   // queued, or lost its worker
+    };
+    
+    RemoteResult run(std::shared_ptr<Task> task, const std::atomic<bool>* cancelFlag);
+    void acceptLoop();
+    void readLoop(Worker* worker);
+    void monitorLoop();
+    // Callers hold mutex
+    void assignTasks();
+    // Requeues the worker's tasks; its reader and socket are reaped by the monitor
+    void dropWorker(Worker* worker);
+    // Renames the last attempt into place on success and removes the others
+    void finishTask(const std::shared_ptr<Task>& task, RemoteResult result);
+    bool hasCapacity() const;
+    
+    int listenFd = -1;
+    std::string token;
+    std::thread acceptor;
+    std::thread monitor;
+    std::atomic<bool> stopping{false};
+    
+    mutable std::mutex mutex;
+    std::condition_variable changed;
+    std::map<int, std::unique_ptr<Worker>> workers;
+    std::deque<std::shared_ptr<Task>> queued;
+    std::map<uint64_t, std::shared_ptr<Task>> assigned;
+    int nextWorkerId = 1;
+    uint64_t nextTaskId = 1;
+};
+
+// Registers with the coordinator at address (host:port) offering slots
+// concurrent tasks and the coordinator's token, runs what it is given, and
+// reconnects whenever the connection drops. configure is applied to each task's processor before
+// the task's own settings. Returns only if address cannot be resolved.
+int runClusterWorker(const std::string& address, int slots, const std::string& token,
+                     const std::function<void(VideoProcessor& processor)>& configure);
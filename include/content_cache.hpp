@@ -0,0 +1,80 @@
+#pragma once
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+
+struct AVHashContext;
+
+// Incremental SHA-256 of an input as it is ingested
+class ContentHasher {
+public:
+    ContentHasher();
+    ~ContentHasher();
+    
+    ContentHasher(const ContentHasher&) = delete;
+    ContentHasher& operator=(const ContentHasher&) = delete;
+    
+    void update(const char* data, size_t size);
+    std::string finishHex();
+    
+    static std::string hashHex(const std::string& data);
+
+private:
+    AVHashContext* context = nullptr;
+};
+
+// Content-addressed store of finished outputs. Entries are keyed by the hash
+// of the input plus the output parameters, live as <directory>/<key>.mp4 and
+// are evicted least recently used first once the total size passes maxBytes.
+// The index is rewritten when entries are added or evicted so it survives
+// restarts. Hits only reorder entries, so their recency is written with the
+// next change, at most INDEX_SAVE_INTERVAL later, or on destruction; a crash
+// loses no more than that much of the eviction order.
+class ResultCache {
+public:
+    ResultCache(std::string directory, std::string indexPath, uint64_t maxBytes);
+    ~ResultCache();
+    
+    ResultCache(const ResultCache&) = delete;
+    ResultCache& operator=(const ResultCache&) = delete;
+    
+    static std::string makeKey(const std::string& contentHash, const std::string& outputSignature);
+    
+    // Where the output for a key lives once cached
+    std::string pathFor(const std::string& key) const;
+    
+    // Marks the entry as used and returns its path if it is cached
+    bool lookup(const std::string& key, std::string& outputPath);
+    
+    // Moves a finished output into the cache and evicts old entries as needed
+    bool insert(const std::string& key, const std::string& finishedPath);
+    
+    uint64_t totalBytes() const;
+    
+    static constexpr std::chrono::seconds INDEX_SAVE_INTERVAL{60};
+
+private:
+    struct Entry {
+        uint64_t size = 0;
+        uint64_t lastUsed = 0;   // sequence number, higher is more recent
+    };
+    
+    void load();
+    // Callers hold mutex
+    void save();
+    void evict();
+    
+    const std::string directory;
+    const std::string indexPath;
+    const uint64_t maxBytes;
+    
+    mutable std::mutex mutex;
+    std::map<std::string, Entry> entries;
+    uint64_t usedBytes = 0;
+    uint64_t nextUse = 1;
+    bool indexDirty = false;   // recency changed since the last save
+    std::chrono::steady_clock::time_point lastSave;
+};
@@ -0,0 +1,62 @@
+#pragma once
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct AVCodecContext;
+
+// Encoder and rate settings for the video stream
+struct EncoderSettings {
+    std::string codec = "libx264";   // libx264, libx265 or libsvtav1
+    std::string preset = "ultrafast";
+    std::string tune = "zerolatency";
+    int crf = 38;
+};
+
+// Whether FFmpeg was built with the encoder
+bool encoderAvailable(const std::string& codec);
+
+// Sets preset, tune and CRF through the encoder's private options, which
+// differ between x264/x265 and SVT-AV1. Call before avcodec_open2.
+void applyEncoderSettings(AVCodecContext* context, const EncoderSettings& settings);
+
+// Presets the auto-tuner tries, fastest first. referenceCrf is on the x264
+// scale and is mapped to a similar quality on the other codecs' scales.
+std::vector<EncoderSettings> tuningCandidates(const std::string& codec, int referenceCrf);
+
+// What the auto-tuner must sustain. The deadline, when set, is converted
+// into the realtime factor it implies for the input's duration and the
+// stricter of the two wins; set realtimeFactor to 0 to go by the deadline
+// alone.
+struct AutotuneTarget {
+    double realtimeFactor = 1.0;
+    double deadlineSeconds = 0.0;
+};
+
+// Settings the auto-tuner picked, keyed by codec, source and output
+// resolution class, frame rate, thread share and target speed. Persisted
+// as a small TSV file so the sample encodes are paid once per class, not
+// once per job.
+class EncoderTuningCache {
+public:
+    // Empty indexPath keeps the results in memory only
+    explicit EncoderTuningCache(std::string indexPath = "");
+    
+    EncoderTuningCache(const EncoderTuningCache&) = delete;
+    EncoderTuningCache& operator=(const EncoderTuningCache&) = delete;
+    
+    static std::string makeKey(const std::string& codec, int referenceCrf, int sourceHeight, int outputHeight,
+                               double frameRate, int encoderThreads, double realtimeFactor);
+    
+    bool lookup(const std::string& key, EncoderSettings& settings) const;
+    void store(const std::string& key, const EncoderSettings& settings);
+
+private:
+    void load();
+    void save() const;
+    
+    const std::string indexPath;
+    mutable std::mutex mutex;
+    std::map<std::string, EncoderSettings> entries;
+};
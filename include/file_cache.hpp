@@ -0,0 +1,65 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+// Read-only mapping of a whole file. The mapping stays valid after the file is
+// replaced or deleted, so a download in flight is never cut short by eviction.
+class MappedFile {
+public:
+    ~MappedFile();
+    
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    
+    const char* data() const { return mapping; }
+    size_t size() const { return length; }
+    
+    // Strong validator built from inode, size and modification time
+    const std::string& etag() const { return entityTag; }
+    int64_t modifiedTime() const { return mtime; }
+
+private:
+    friend class MappedFileCache;
+    MappedFile() = default;
+    
+    const char* mapping = nullptr;
+    size_t length = 0;
+    uint64_t inode = 0;
+    int64_t mtime = 0;
+    int64_t mtimeNanos = 0;
+    std::string entityTag;
+};
+
+// Keeps recently served files mapped so repeated downloads and range requests
+// skip the open/read/copy per request. Entries are checked against the file
+// on every lookup and remapped when it has changed.
+class MappedFileCache {
+public:
+    explicit MappedFileCache(size_t maxEntries = DEFAULT_MAX_ENTRIES);
+    
+    MappedFileCache(const MappedFileCache&) = delete;
+    MappedFileCache& operator=(const MappedFileCache&) = delete;
+    
+    // Returns nullptr if the file does not exist or cannot be mapped
+    std::shared_ptr<const MappedFile> open(const std::string& path);
+    
+    static constexpr size_t DEFAULT_MAX_ENTRIES = 64;
+
+private:
+    static std::shared_ptr<MappedFile> mapFile(const std::string& path);
+    
+    const size_t maxEntries;
+    
+    std::mutex mutex;
+    std::list<std::string> recent;   // most recently used first
+    struct Entry {
+        std::shared_ptr<MappedFile> file;
+        std::list<std::string>::iterator position;
+    };
+    std::unordered_map<std::string, Entry> entries;
+};
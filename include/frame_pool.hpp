@@ -0,0 +1,76 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+struct AVBufferPool;
+struct AVBufferRef;
+struct AVFrame;
+struct AVPacket;
+
+// Allocation counters of a pool, zeroed each time they are collected
+struct PoolStats {
+    uint64_t requests = 0;      // objects or buffers handed out
+    uint64_t allocations = 0;   // of those, how many had to be allocated
+    uint64_t bytes = 0;         // bytes allocated for them
+};
+
+// Recycles AVPacket structs. Packets come back unreferenced; their payload
+// buffers belong to whoever produced them.
+class PacketPool {
+public:
+    PacketPool() = default;
+    ~PacketPool();
+    
+    PacketPool(const PacketPool&) = delete;
+    PacketPool& operator=(const PacketPool&) = delete;
+    
+    AVPacket* acquire();
+    void release(AVPacket*& packet);
+    
+    PoolStats collectStats();
+
+private:
+    std::mutex mutex;
+    std::vector<AVPacket*> idle;
+    PoolStats stats;
+};
+
+// Recycles AVFrame structs and hands out pictures of one size and format
+// whose planes live in a single 64-byte aligned buffer from an AVBufferPool.
+// Pictures are reference counted: the encoder may keep a reference, and the
+// buffer returns to the pool when the last holder lets go.
+class FramePool {
+public:
+    FramePool() = default;
+    ~FramePool();
+    
+    FramePool(const FramePool&) = delete;
+    FramePool& operator=(const FramePool&) = delete;
+    
+    // Picture geometry for acquirePicture(); a no-op if unchanged
+    bool configure(int width, int height, int pixelFormat);
+    
+    // Empty frame, e.g. to move a decoded frame into
+    AVFrame* acquire();
+    // Writable picture backed by the pool
+    AVFrame* acquirePicture();
+    // Unreferences the frame and keeps the struct for reuse; null is ignored
+    void release(AVFrame*& frame);
+    
+    PoolStats collectStats();
+    
+    static constexpr int ALIGNMENT = 64;
+
+private:
+    static AVBufferRef* allocBuffer(void* opaque, size_t size);
+    
+    std::mutex mutex;
+    std::vector<AVFrame*> idle;
+    AVBufferPool* bufferPool = nullptr;
+    int width = 0;
+    int height = 0;
+    int pixelFormat = -1;
+    PoolStats stats;
+};
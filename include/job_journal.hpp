@@ -0,0 +1,40 @@
+#pragma once
+#include <mutex>
+#include <string>
+#include <vector>
+
+// What it takes to run an accepted upload again after a restart
+struct JournaledJob {
+    std::string id;
+    std::string inputPath;      // the spilled upload
+    std::string workPath;       // where the transcode writes before entering the cache
+    std::string cacheKey;
+    std::string scaleQuality;   // as taken by parseScaleQuality
+    std::string priority;       // as taken by parseJobPriority
+    std::string sceneAdaptive;  // "1" or "0"
+};
+
+// Append-only log of accepted and finished jobs. Every record is synced to
+// disk before the call returns, so a job the client was told about survives
+// a crash of the server or the host.
+class JobJournal {
+public:
+    explicit JobJournal(std::string path);
+    
+    JobJournal(const JobJournal&) = delete;
+    JobJournal& operator=(const JobJournal&) = delete;
+    
+    // Jobs accepted but never finished, oldest first. The journal is then
+    // rewritten to hold just those, which also drops a line torn by a crash.
+    std::vector<JournaledJob> recover();
+    
+    bool recordQueued(const JournaledJob& job);
+    // Any end state; a finished job is never run again
+    bool recordFinished(const std::string& id);
+
+private:
+    bool append(const std::string& line);
+    
+    const std::string path;
+    std::mutex mutex;
+};
@@ -0,0 +1,189 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "threading_policy.hpp"
+
+class VideoProcessor;
+
+enum class JobState {
+    Queued,
+    Running,
+    Succeeded,
+    Failed,
+    Cancelled
+};
+
+const char* jobStateName(JobState state);
+
+// Interactive jobs, such as short clips a user waits for, go ahead of bulk
+// work like archive ingests
+enum class JobPriority {
+    Interactive,
+    Bulk
+};
+
+const char* jobPriorityName(JobPriority priority);
+bool parseJobPriority(const std::string& name, JobPriority& priority);
+
+struct JobOptions {
+    JobPriority priority = JobPriority::Interactive;
+    double deadlineSeconds = 0.0;   // from submission; queued jobs run earliest deadline first. 0 for none.
+    bool preemptible = false;       // the task yields at segment boundaries and resumes when run again
+    bool startNow = false;          // rejected unless a worker is free to start it right away
+};
+
+// Snapshot of a job, safe to hand out to other threads
+struct JobStatus {
+    std::string id;
+    JobState state = JobState::Queued;
+    std::string inputPath;
+    std::string outputPath;
+    std::string workPath;         // where the output grows while the job runs, if elsewhere
+    JobPriority priority = JobPriority::Interactive;
+    double deadlineSeconds = 0.0;
+    int preemptions = 0;          // times it yielded its worker to an interactive job
+    double queuedSeconds = 0.0;   // time spent waiting for a worker
+    double runSeconds = 0.0;      // time spent transcoding so far
+    double progress = 0.0;        // 0..1, -1 while the input duration is unknown
+    long long framesEncoded = 0;
+    double etaSeconds = -1.0;     // estimated time left, -1 when unknown
+};
+
+// Runs transcode jobs on a fixed pool of workers. Each worker owns its own
+// VideoProcessor, so jobs never share FFmpeg state, and each job starts with
+// an equal share of the host's cores (a task may override it). Admission is bounded:
+// submit() fails instead of queueing without limit when every worker is busy
+// and the queue of the job's priority is full.
+//
+// A free worker takes the next interactive job, unless bulk jobs are
+// waiting and fewer than a BULK_WORKER_SHARE of the workers (at least one,
+// with two workers or more) run bulk work.
+// An interactive job that finds no free worker makes the running bulk jobs
+// beyond that share yield, if they are preemptible; they go back to the
+// queue and resume later. An interactive job started while there is bulk
+// work gets INTERACTIVE_THREAD_WEIGHT times the threads of a bulk job, so
+// the kernel gives it that much more CPU, and bulk jobs still fill an
+// otherwise idle host.
+class JobScheduler {
+public:
+    // Work done for a job on a worker's processor. Defaults to processVideo.
+    using Task = std::function<bool(VideoProcessor& processor)>;
+    // Called on the worker thread once the job has finished
+    using CompletionCallback = std::function<void(const JobStatus& status)>;
+    // Called on the worker thread after every job, before its completion callback
+    using JobObserver = std::function<void(const JobStatus& status, const VideoProcessor& processor)>;
+    // Called on the submitting thread with the new job's id before any
+    // worker can take the job, e.g. to journal it
+    using AdmissionCallback = std::function<void(const std::string& id)>;
+    
+    JobScheduler(int workerCount, int queueCapacity);
+    ~JobScheduler();
+    
+    JobScheduler(const JobScheduler&) = delete;
+    JobScheduler& operator=(const JobScheduler&) = delete;
+    
+    // Returns the new job id, or an empty string when the queue is full.
+    // With onAdmitted, the job is queued only once the callback returns, so
+    // it cannot finish before the callback has recorded it.
+    std::string submit(const std::string& inputPath, const std::string& outputPath,
+                       Task task = nullptr, CompletionCallback onComplete = nullptr,
+                       const JobOptions& options = JobOptions(), AdmissionCallback onAdmitted = nullptr);
+    
+    // Queues a job recovered after a restart under its previous id, so
+    // clients polling it carry on. Never rejected, even past the queue's capacity.
+    void resume(const std::string& id, const std::string& inputPath, const std::string& outputPath,
+                Task task, CompletionCallback onComplete = nullptr, const JobOptions& options = JobOptions());
+    
+    bool getStatus(const std::string& id, JobStatus& status) const;
+    
+    // Queued jobs are dropped when a worker reaches them; running ones stop
+    // at the next packet and clean up their partial output. Returns false
+    // for unknown and already finished jobs.
+    bool cancel(const std::string& id);
+    
+    // Set before submitting jobs; used to collect per-job metrics
+    void setJobObserver(JobObserver observer);
+    
+    // For jobs whose final output location is only known after submission
+    void setOutputPath(const std::string& id, const std::string& outputPath);
+    void setWorkPath(const std::string& id, const std::string& workPath);
+    
+    int workerCount() const { return static_cast<int>(workers.size()); }
+    size_t queuedJobs() const;
+    size_t queuedJobs(JobPriority priority) const;
+    int runningJobs() const { return running.load(); }
+    // Running jobs that yielded to interactive ones, since startup
+    unsigned long long preemptions() const { return preemptionCount.load(); }
+    
+    // Seconds a rejected client should wait before retrying, from recent job durations
+    int retryAfterSeconds() const;
+    
+    // One worker per group of encoder threads the host can run at once
+    static int defaultWorkerCount(int threadsPerJob);
+    
+    static constexpr double BULK_WORKER_SHARE = 0.25;
+    static constexpr int INTERACTIVE_THREAD_WEIGHT = 2;
+
+private:
+    struct Job {
+        JobStatus status;
+        Task task;
+        CompletionCallback onComplete;
+        bool preemptible = false;
+        std::chrono::steady_clock::time_point submitted;
+        std::chrono::steady_clock::time_point started;
+        std::chrono::steady_clock::time_point deadline;   // max() for none
+        std::atomic<bool> cancelRequested{false};
+        std::atomic<bool> yieldRequested{false};
+        const VideoProcessor* processor = nullptr;   // while running, for progress
+    };
+    
+    static std::shared_ptr<Job> makeJob(const std::string& inputPath, const std::string& outputPath,
+                                        Task task, CompletionCallback onComplete, const JobOptions& options);
+    void workerLoop();
+    // Callers hold jobsMutex
+    void enqueue(const std::shared_ptr<Job>& job);
+    bool takeNext(std::shared_ptr<Job>& job);
+    void preemptForInteractive();
+    size_t queuedJobsLocked(JobPriority priority) const;
+    int bulkWorkerShare() const;
+    // processor is null for jobs cancelled before they started
+    void finishJob(const std::shared_ptr<Job>& job, bool succeeded, const VideoProcessor* processor);
+    
+    // Finished jobs kept around for status queries
+    static constexpr size_t MAX_FINISHED_JOBS = 1000;
+    
+    const size_t queueCapacity;
+    const int poolSize;
+    ThreadingPolicy jobThreading;
+    ThreadingPolicy interactiveThreading;
+    std::vector<std::thread> workers;
+    JobObserver jobObserver;
+    std::atomic<int> running{0};
+    std::atomic<unsigned long long> preemptionCount{0};
+    
+    mutable std::mutex jobsMutex;
+    std::condition_variable jobQueued;
+    bool stopping = false;
+    std::map<std::string, std::shared_ptr<Job>> jobs;
+    std::deque<std::string> finishedJobs;
+    // Earliest deadline first, then in order of submission
+    std::deque<std::shared_ptr<Job>> interactiveQueue;
+    std::deque<std::shared_ptr<Job>> bulkQueue;
+    std::vector<std::shared_ptr<Job>> runningJobList;
+    unsigned long long nextJobId = 1;
+    // Admitted jobs whose admission callback is still running; they count against the queue's capacity
+    size_t admittingJobs = 0;
+    double averageJobSeconds = 0.0;
+};
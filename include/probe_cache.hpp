@@ -0,0 +1,87 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct AVCodecParameters;
+struct AVFormatContext;
+
+// Container and stream parameters of an input, as found by probing
+struct MediaInfo {
+    std::string container;          // demuxer name, e.g. "mov,mp4,m4a,3gp,3g2,mj2"
+    double durationSeconds = 0.0;   // 0 when the container does not say
+    int64_t bitRate = 0;
+    std::string videoCodec;
+    int width = 0;
+    int height = 0;
+    double frameRate = 0.0;
+    std::string pixelFormat;
+    std::string audioCodec;         // empty without audio
+    int sampleRate = 0;
+    int channels = 0;
+};
+
+// What avformat_find_stream_info found for one file: every stream's codec
+// parameters and rates, enough to skip it when the file is opened again
+struct ProbeResult {
+    struct Stream {
+        AVCodecParameters* parameters = nullptr;   // owned
+        int frameRateNum = 0;                      // avg_frame_rate
+        int frameRateDen = 1;
+        int realFrameRateNum = 0;                  // r_frame_rate
+        int realFrameRateDen = 1;
+        int64_t startTime = 0;
+        int64_t duration = 0;
+    };
+    
+    ProbeResult() = default;
+    ~ProbeResult();
+    
+    ProbeResult(const ProbeResult&) = delete;
+    ProbeResult& operator=(const ProbeResult&) = delete;
+    
+    MediaInfo info;
+    std::vector<Stream> streams;
+    int64_t startTime = 0;
+    int64_t duration = 0;
+    int64_t bitRate = 0;
+};
+
+// Snapshot of an input opened and probed with avformat_find_stream_info
+std::shared_ptr<const ProbeResult> captureProbeResult(const AVFormatContext* context);
+
+// Fills in an input freshly opened with avformat_open_input from an earlier
+// probe of the same file. Returns false, changing nothing, when the streams
+// found by the header differ from the probed ones.
+bool applyProbeResult(const ProbeResult& result, AVFormatContext* context);
+
+// Probe results by file identity, so a file probed at upload is not probed
+// again by its thumbnails, its transcode or each of its segment workers.
+// Bounded; the oldest entries are dropped first.
+class ProbeCache {
+public:
+    explicit ProbeCache(size_t maxEntries = DEFAULT_MAX_ENTRIES);
+    
+    ProbeCache(const ProbeCache&) = delete;
+    ProbeCache& operator=(const ProbeCache&) = delete;
+    
+    // Device, inode, size and modification time of the file, so a file
+    // replaced under the same name is probed again. Empty if it cannot be stat'ed.
+    static std::string fileKey(const std::string& path);
+    
+    std::shared_ptr<const ProbeResult> lookup(const std::string& key) const;
+    void store(const std::string& key, std::shared_ptr<const ProbeResult> result);
+    
+    static constexpr size_t DEFAULT_MAX_ENTRIES = 1024;
+
+private:
+    const size_t maxEntries;
+    mutable std::mutex mutex;
+    std::map<std::string, std::shared_ptr<const ProbeResult>> entries;
+    std::deque<std::string> insertionOrder;
+};
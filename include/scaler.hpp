@@ -0,0 +1,76 @@
+#pragma once
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct AVFrame;
+struct SwsContext;
+
+// Resize filter, trading output quality for speed
+enum class ScaleQuality {
+    Fast,       // box filter on integer ratios, swscale fast bilinear otherwise
+    Bilinear,   // the default
+    Lanczos
+};
+
+const char* scaleQualityName(ScaleQuality quality);
+bool parseScaleQuality(const std::string& name, ScaleQuality& quality);
+
+// Converts decoded pictures to the encoder's size and pixel format.
+// Exact integer downscales of 8-bit planar YUV that keep the format (e.g.
+// 2160p -> 1080p yuv420p) run on box kernels, vectorized with AVX2, SSE4.1
+// or NEON for the 2:1 case, split into row bands over slice threads.
+// Everything else goes through swscale, slice-threaded where the library
+// supports it.
+class Scaler {
+public:
+    Scaler() = default;
+    ~Scaler();
+    
+    Scaler(const Scaler&) = delete;
+    Scaler& operator=(const Scaler&) = delete;
+    
+    // Formats are AVPixelFormat values
+    bool init(int srcWidth, int srcHeight, int srcFormat, int dstWidth, int dstHeight, int dstFormat,
+              ScaleQuality quality, int sliceThreads);
+    void reset();
+    bool active() const { return swsContext || boxFactor > 0; }
+    
+    // dst must be a writable picture of the configured output size and format
+    bool scale(const AVFrame* src, AVFrame* dst);
+    
+    // Which implementation init() picked, e.g. "box2-avx2" or "swscale-bilinear"
+    const char* kernelName() const { return kernel; }
+    
+    using RowKernel = void (*)(const uint8_t* const* rows, int factor, uint8_t* dst, int width);
+
+private:
+    void scaleBand(int band);
+    void sliceWorker(int band);
+    void stopWorkers();
+    
+    SwsContext* swsContext = nullptr;
+    const char* kernel = "none";
+    
+    // Box path
+    int boxFactor = 0;
+    RowKernel rowKernel = nullptr;
+    int planeCount = 0;
+    int planeWidths[4] = {};
+    int planeHeights[4] = {};
+    
+    // Slice threads wait for a new generation, scale their band of the
+    // current frame, and the calling thread does band 0 itself
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    uint64_t generation = 0;
+    int pendingBands = 0;
+    bool stopping = false;
+    const AVFrame* currentSrc = nullptr;
+    AVFrame* currentDst = nullptr;
+};
@@ -0,0 +1,62 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+
+struct AVFrame;
+
+// What to do with one frame before it reaches the encoder
+struct SceneDecision {
+    bool drop = false;        // repeats the last encoded frame; the player holds that one instead
+    bool sceneCut = false;    // start of a new shot: encode as a keyframe
+    int crfOffset = 0;        // added to the configured CRF for the current scene
+};
+
+// Cheap content analysis on the luma of the frames headed for the encoder,
+// sampled every SAMPLE_STEP pixels in both directions. Compares each frame
+// to the previous one for motion and scene cuts, and to the last kept frame
+// for duplicates, so slow drift still gets encoded once it adds up.
+class SceneAnalyzer {
+public:
+    // Before each job; the first frame after it is always kept and is a cut
+    void reset();
+    
+    // frame is 8-bit planar with luma in plane 0. ptsSeconds is the frame's
+    // time, or negative when unknown, in which case it is never dropped.
+    SceneDecision analyze(const AVFrame* frame, double ptsSeconds);
+    
+    static constexpr int SAMPLE_STEP = 4;
+    // Luma steps a sample may move and still count as unchanged (noise, dither)
+    static constexpr int NOISE_LEVEL = 6;
+    // Mean sample difference to the previous frame that starts a new scene,
+    // when it is also CUT_MOTION_RATIO times the scene's usual motion
+    static constexpr double CUT_DIFFERENCE = 24.0;
+    static constexpr double CUT_MOTION_RATIO = 4.0;
+    static constexpr int MIN_SCENE_FRAMES = 12;
+    // A dropped run never hides more than this, so the output keeps a
+    // frame at least this often and a late small change is not held back long
+    static constexpr double MAX_HOLD_SECONDS = 1.0;
+    // Scene motion (mean sample difference, smoothed) below which a scene is
+    // static and above which it is high motion
+    static constexpr double STATIC_MOTION = 0.5;
+    static constexpr double HIGH_MOTION = 10.0;
+    // Detail (mean difference between neighbouring samples) above which a
+    // static scene is text or fine graphics and keeps its quality
+    static constexpr double DETAILED_COMPLEXITY = 12.0;
+    static constexpr int STATIC_CRF_OFFSET = 4;
+    static constexpr int HIGH_MOTION_CRF_OFFSET = -4;
+
+private:
+    // Samples the frame into current; false if the geometry changed
+    bool sample(const AVFrame* frame);
+    
+    std::vector<uint8_t> current;
+    std::vector<uint8_t> previous;
+    std::vector<uint8_t> kept;
+    int sampleWidth = 0;
+    int sampleHeight = 0;
+    double motion = -1.0;       // smoothed over the scene, negative until its first comparison
+    double complexity = 0.0;
+    int sceneFrames = 0;
+    double keptSeconds = 0.0;
+    int crfOffset = 0;
+};
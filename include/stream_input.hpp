@@ -0,0 +1,58 @@
+#pragma once
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// How an upload has to be consumed, judged from its first bytes
+enum class StreamLayout {
+    Sequential,     // can be demuxed while it arrives
+    NeedsSeeking,   // e.g. MOV/MP4 with the moov atom at the end
+    Undetermined    // not enough bytes seen yet
+};
+
+// Decide from the head of a file whether it can be demuxed front to back
+StreamLayout classifyStreamHead(const char* data, size_t size);
+
+// Fixed-size ring buffer between an upload (the writer) and a demuxer (the
+// reader), so decoding can start while the body is still arriving. Memory use
+// is bounded by the capacity no matter how large the upload is: a full buffer
+// blocks the writer, which in turn throttles the client.
+class StreamInput {
+public:
+    explicit StreamInput(size_t capacity = DEFAULT_CAPACITY);
+    
+    StreamInput(const StreamInput&) = delete;
+    StreamInput& operator=(const StreamInput&) = delete;
+    
+    // Writer side. write() blocks while the buffer is full and returns false
+    // once the reader has aborted.
+    bool write(const char* data, size_t size);
+    void finish();   // upload complete
+    void fail();     // upload broken off
+    
+    // Reader side. Blocks until data is available. Returns the number of bytes
+    // read, 0 at the end of a complete upload and -1 if the upload failed or
+    // the stream was aborted.
+    int read(uint8_t* buffer, int size);
+    void abort();    // reader gives up, unblocks the writer
+    
+    size_t bytesWritten() const;
+    
+    static constexpr size_t DEFAULT_CAPACITY = 8 * 1024 * 1024;
+
+private:
+    std::vector<char> buffer;
+    size_t readPos = 0;
+    size_t used = 0;
+    size_t totalWritten = 0;
+    bool finished = false;
+    bool failed = false;
+    bool aborted = false;
+    
+    mutable std::mutex mutex;
+    std::condition_variable dataAvailable;
+    std::condition_variable spaceAvailable;
+};
@@ -0,0 +1,24 @@
+#pragma once
+
+// Threads one transcode may use for each stage. Decoder threads are frame
+// and slice threads inside libavcodec, scaler threads split each picture
+// into row bands, encoder threads go to the encoder's own pool.
+struct ThreadingPolicy {
+    int decoderThreads = 1;
+    int scalerThreads = 1;
+    int encoderThreads = 4;
+    
+    // Cores one job keeps busy when the host runs several; sizes worker pools
+    static constexpr int TYPICAL_JOB_THREADS = 4;
+    
+    // Give every stage the job's share of cores when concurrentJobs jobs
+    // run at once. The stages mostly take turns on a frame, so they are not
+    // split further.
+    static ThreadingPolicy forHost(int concurrentJobs = 1);
+    static ThreadingPolicy forCores(int cores);
+    
+    // Share of this policy for each of parts parallel workers of one job
+    ThreadingPolicy divided(int parts) const;
+    
+    static int hostCores();
+};
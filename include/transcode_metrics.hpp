@@ -0,0 +1,83 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+
+// Latency histogram with fixed exponential buckets, 0.1 ms doubling up to
+// about 3.3 s plus an overflow bucket. Safe to observe from several threads.
+class LatencyHistogram {
+public:
+    using Clock = std::chrono::steady_clock;
+    static constexpr int BUCKET_COUNT = 16;
+    
+    void observe(double seconds);
+    void observeSince(Clock::time_point start) { observe(secondsSince(start)); }
+    void merge(const LatencyHistogram& other);
+    void reset();
+    
+    // Upper bound in seconds; bucket BUCKET_COUNT is unbounded
+    static double upperBound(int bucket);
+    static double secondsSince(Clock::time_point start);
+    
+    // Observations in this bucket alone, not cumulative
+    uint64_t bucketCount(int bucket) const { return buckets[bucket].load(); }
+    uint64_t count() const { return total.load(); }
+    double sumSeconds() const { return sumNanos.load() / 1e9; }
+
+private:
+    std::atomic<uint64_t> buckets[BUCKET_COUNT + 1] = {};
+    std::atomic<uint64_t> total{0};
+    std::atomic<uint64_t> sumNanos{0};
+};
+
+// Timing and volume of one transcode, filled in by VideoProcessor
+struct TranscodeMetrics {
+    LatencyHistogram open;     // open and probe the input
+    LatencyHistogram decode;   // per decoded frame
+    LatencyHistogram scale;    // per scaled frame
+    LatencyHistogram encode;   // per encoded frame, including the mux write
+    
+    std::atomic<uint64_t> bytesIn{0};
+    std::atomic<uint64_t> bytesOut{0};
+    
+    // Scene-adaptive encoding: repeated frames left out, keyframes forced at scene starts
+    std::atomic<uint64_t> framesDropped{0};
+    std::atomic<uint64_t> sceneCuts{0};
+    
+    // Frames waiting in pipeline queues, sampled as stages take work
+    std::atomic<uint64_t> queueDepthSum{0};
+    std::atomic<uint64_t> queueDepthSamples{0};
+    std::atomic<uint64_t> queueDepthMax{0};
+    
+    // Packet/frame pool traffic: hand-outs, and allocations behind them
+    std::atomic<uint64_t> poolRequests{0};
+    std::atomic<uint64_t> poolAllocations{0};
+    std::atomic<uint64_t> poolAllocatedBytes{0};
+    
+    void observeQueueDepth(size_t depth);
+    void recordPool(uint64_t requests, uint64_t allocations, uint64_t bytes);
+    void merge(const TranscodeMetrics& other);
+    void reset();
+};
+
+// Totals over all finished jobs, rendered in the Prometheus text format
+class MetricsRegistry {
+public:
+    void recordJob(bool succeeded, double queuedSeconds, double runSeconds, const TranscodeMetrics& metrics);
+    
+    void render(std::ostream& out) const;
+    
+    static void writeGauge(std::ostream& out, const char* name, const char* help, double value);
+    static void writeCounter(std::ostream& out, const char* name, const char* help, uint64_t value);
+    static void writeHistogram(std::ostream& out, const char* name, const char* help,
+                               const LatencyHistogram& histogram);
+
+private:
+    TranscodeMetrics totals;
+    LatencyHistogram jobQueued;
+    LatencyHistogram jobRun;
+    std::atomic<uint64_t> jobsSucceeded{0};
+    std::atomic<uint64_t> jobsFailed{0};
+};
@@ -0,0 +1,12 @@
+#pragma once
+#include <string>
+#include <vector>
+
+// Tab-separated records, as written by the job journal and the cluster
+// protocol. Fields may hold anything but NUL: backslashes, tabs and
+// newlines are escaped, so a record is always one line.
+std::string escapeField(const std::string& value);
+
+// Splits an unterminated line into unescaped fields. Unlike std::getline,
+// keeps empty fields, trailing ones included, so "a\t" is two fields.
+std::vector<std::string> splitFields(const std::string& line);
@@ -1,13 +1,100 @@
 #pragma once
 #include <string>
+#include <atomic>
+#include <cstdint>
+#include <functional>
 #include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "async_file_io.hpp"
+#include "audio_transcoder.hpp"
+#include "encoder_tuning.hpp"
+#include "frame_pool.hpp"
+#include "probe_cache.hpp"
+#include "scaler.hpp"
+#include "scene_analysis.hpp"
+#include "threading_policy.hpp"
+#include "transcode_metrics.hpp"
 
 // Forward declarations of FFmpeg structures
 struct AVFormatContext;
 struct AVCodecContext;
 struct AVFrame;
 struct AVPacket;
-struct SwsContext;
+struct AVIOContext;
+struct AVStream;
+
+class StreamInput;
+
+template <typename T>
+class BoundedQueue;
+
+// Time one pipeline stage spent working versus waiting on its queues.
+// The stage with the least stall time is the one limiting throughput.
+struct PipelineStageStats {
+    double busySeconds = 0.0;
+    double stallSeconds = 0.0;
+    long long frames = 0;
+};
+
+struct PipelineStats {
+    PipelineStageStats decode;
+    PipelineStageStats scale;
+    PipelineStageStats encode;
+};
+
+// How far the running transcode has got. Safe to read from any thread.
+struct TranscodeProgress {
+    double mediaSeconds = 0.0;      // input position reached
+    double durationSeconds = 0.0;   // 0 when the input does not say, e.g. live uploads
+    long long framesEncoded = 0;
+    
+    // 0..1, or -1 when the duration is unknown
+    double fraction() const;
+};
+
+enum class ThumbnailFormat {
+    Jpeg,
+    WebP    // needs FFmpeg built with libwebp
+};
+
+// Preview images tiled into one sprite, left to right and top to bottom
+struct ThumbnailOptions {
+    int count = 9;                   // spread evenly over the duration
+    std::vector<double> timestamps;  // seconds from the start; replaces count when set
+    int width = 320;                 // of each tile, height follows the aspect ratio
+    int columns = 0;                 // 0 for a square-ish grid
+    ThumbnailFormat format = ThumbnailFormat::Jpeg;
+};
+
+// One output of an adaptive-bitrate ladder. The picture is fitted inside
+// maxWidth x maxHeight without upscaling; maxBitrate caps the CRF encode.
+struct Rendition {
+    int maxWidth;
+    int maxHeight;
+    int64_t maxBitrate;
+};
+
+// One GOP-aligned segment of a segmented transcode, to be run elsewhere
+struct SegmentTask {
+    std::string inputPath;
+    std::string spoolPath;
+    int64_t startPts = 0;
+    int64_t endPts = 0;
+    std::string settings;   // VideoProcessor::exportSettings() of the job
+};
+
+enum class RemoteResult {
+    Succeeded,
+    Failed,
+    Unavailable   // nowhere to run it; the caller runs it itself
+};
+
+// Runs a segment in another process, e.g. on a cluster worker. Blocks
+// until it is done; cancelFlag, when set, stops it.
+using SegmentRunner = std::function<RemoteResult(const SegmentTask& task, const std::atomic<bool>* cancelFlag)>;
 
 class VideoProcessor {
 public:
@@ -15,37 +102,301 @@ public:
     ~VideoProcessor();
     
     bool processVideo(const std::string& inputPath, const std::string& outputPath);
+    // Transcode an upload while it is still being written into the StreamInput
+    bool processStream(StreamInput& input, const std::string& outputPath);
     void setTargetResolution(int width, int height);
+
+    // Copy H.264/HEVC video that needs no resize into the output instead of
+    // re-encoding it. Enabled by default. AAC audio is copied either way.
+    void setStreamCopy(bool enabled);
+
+    // Write mp4 outputs as fragments (moof/mdat per keyframe) after an
+    // empty moov, instead of one moov written at the end. Every byte is
+    // final once written, so the file can be read while it grows.
+    void setFragmentedOutput(bool enabled);
+
+    // Resize filter; Bilinear by default. Exact 2:1 downscales of planar
+    // YUV take a vectorized box kernel for both Fast and Bilinear.
+    void setScaleQuality(ScaleQuality quality);
+
+    // Analyze the luma of every frame headed for the encoder: force a
+    // keyframe at scene cuts, drop frames that repeat the last encoded one
+    // (held at most SceneAnalyzer::MAX_HOLD_SECONDS), and with libx264
+    // raise the CRF for static scenes and lower it for high-motion ones.
+    // Ladders ignore it, as their keyframes must line up. Off by default.
+    void setSceneAdaptive(bool enabled);
+
+    // Video encoder: libx264 (default), libx265 or libsvtav1. Returns false,
+    // keeping the current encoder, when FFmpeg was built without it.
+    bool setEncoder(const std::string& codec);
+    // What the last transcode encoded with, after any auto-tuning
+    const EncoderSettings& getEncoderSettings() const { return jobEncoderSettings; }
+
+    // Before encoding a file input, encode a short sample at each of the
+    // encoder's presets and keep the slowest one that still runs at the
+    // target speed. Results go to cache, when given, and are reused for
+    // inputs of the same resolution class; stream inputs cannot be sampled
+    // ahead and only use cached results.
+    void setAutotune(bool enabled, const AutotuneTarget& target = AutotuneTarget(),
+                     EncoderTuningCache* cache = nullptr);
+
+    // Run demux/decode, scale and encode on separate threads linked by
+    // bounded frame queues instead of in strict order on one thread
+    void setPipelineMode(bool enabled, int queueDepth = 8);
+    const PipelineStats& getPipelineStats() const { return pipelineStats; }
+
+    // Timing and volume of the last transcode
+    const TranscodeMetrics& getMetrics() const { return metrics; }
+
+    // Position of the transcode in progress, for polling from another thread
+    TranscodeProgress getProgress() const;
+
+    // Checked between packets. Once the flag is set the transcode stops,
+    // removes its partial output and returns false. The flag must outlive
+    // the transcode; nullptr disables cancellation.
+    void setCancelFlag(const std::atomic<bool>* flag);
+    bool cancelRequested() const { return cancelFlag && cancelFlag->load(); }
+
+    // Checked by checkpointed transcodes between segments. Once the flag is
+    // set no new segment is started; the ones in flight finish, and the
+    // transcode returns false with yielded() true, its segments kept for the
+    // next run. Other transcodes run to the end. nullptr disables it.
+    void setYieldFlag(const std::atomic<bool>* flag);
+    bool yielded() const { return yieldedLast; }
+
+    // Split file inputs into GOP-aligned segments and transcode them in
+    // parallel with independent decoders, scalers and encoders. Each segment
+    // is muxed into the output as soon as it and every earlier one are done. segmentCount <= 1 disables it; workerCount 0 runs one
+    // worker per group of encoder threads the host has cores for.
+    void setSegmentParallelism(int segmentCount, int workerCount = 0);
+
+    // Transcode file inputs as GOP-aligned segments of about this many
+    // seconds, kept on disk as <output>.segN until the output is complete.
+    // The output still grows segment by segment as they finish.
+    // Running the same job again after a crash or failure skips the
+    // segments already done. 0 disables it.
+    void setCheckpointInterval(int seconds);
+
+    // Also hand segments to runner, up to slots at a time, next to the
+    // local segment workers. A segment the runner cannot place is
+    // transcoded locally. nullptr or 0 slots disables it.
+    void setSegmentRunner(SegmentRunner runner, int slots);
+
+    // The settings that decide the output, so another process can produce
+    // the same file: importSettings() applies them over its own. Threads,
+    // caches and runners stay with each process.
+    std::string exportSettings() const;
+    bool importSettings(const std::string& settings);
+
+    // Worker side of a SegmentRunner: transcode the task's segment into its spool
+    bool processSegment(const SegmentTask& task);
+
+    // Decode once and encode every rendition in parallel into fMP4 segments
+    // with keyframes aligned across renditions, plus a DASH manifest
+    // (manifest.mpd) and HLS playlists (master.m3u8) in outputDirectory
+    bool processLadder(const std::string& inputPath, const std::string& outputDirectory,
+                       const std::vector<Rendition>& renditions = defaultLadder());
+    static std::vector<Rendition> defaultLadder();
+
+    // Seek to the keyframe at or before each requested time and decode only
+    // that frame, so a sprite of a multi-hour file takes milliseconds.
+    // image receives the encoded JPEG or WebP sprite.
+    bool extractThumbnails(const std::string& inputPath, const ThumbnailOptions& options, std::string& image);
+    static const char* thumbnailMimeType(ThumbnailFormat format);
+
+    // Stream info of a file without opening decoders or transcoding
+    bool probe(const std::string& inputPath, MediaInfo& info);
+
+    // Bound how much avformat_find_stream_info reads and decodes: at most
+    // FAST_PROBE_BYTES and FAST_PROBE_DURATION, and no frame-rate analysis
+    // for containers that store the rate in their header. Off by default.
+    void setFastProbe(bool enabled);
+
+    // Probe results are reused for files seen before, by file identity, so
+    // opening them again skips avformat_find_stream_info. The cache must
+    // outlive the processor; nullptr disables it.
+    void setProbeCache(ProbeCache* cache);
+
+    // Identifies every setting that affects the output, for caching results
+    std::string outputSignature() const;
+
+    // Decoder, scaler and encoder threads. Defaults to every core of the
+    // host; a scheduler running several jobs gives each its share.
+    void setThreadingPolicy(const ThreadingPolicy& policy);
+    const ThreadingPolicy& getThreadingPolicy() const { return threading; }
     
 private:
     // Target resolution
     int targetWidth = 1920;
     int targetHeight = 1080;
 
-    // FFmpeg encoding parameters
-    const int CRF = 38;
+    // FFmpeg encoding parameters. The job's settings start as the
+    // configured ones and are replaced by the auto-tuner's choice.
+    EncoderSettings encoderSettings;
+    EncoderSettings jobEncoderSettings;
     const int AUDIO_BITRATE = 96000;
-    const int THREAD_COUNT = 4;
+    static constexpr int STREAM_IO_BUFFER_SIZE = 64 * 1024;
+    static constexpr int64_t FAST_PROBE_BYTES = 1024 * 1024;
+    static constexpr int64_t FAST_PROBE_DURATION = 1000000;   // AV_TIME_BASE units
+    static constexpr int LADDER_SEGMENT_SECONDS = 4;
+
+    // Scaling
+    ScaleQuality scaleQuality = ScaleQuality::Bilinear;
+
+    // Scene-adaptive encoding. The last dropped frame is held so the flush
+    // can encode it and the output keeps the input's duration.
+    bool sceneAdaptive = false;
+    SceneAnalyzer sceneAnalyzer;
+    AVFrame* heldFrame = nullptr;
+    int sceneCrf = -1;
+
+    // Encoder auto-tuning, see video_autotune.cpp
+    static constexpr int TUNING_SAMPLE_FRAMES = 60;
+    static constexpr size_t TUNING_SAMPLE_BYTES = 256 * 1024 * 1024;
+    static constexpr double TUNING_MIN_SAVING = 0.02;
+    bool autotuneEnabled = false;
+    bool encoderTuned = false;
+    AutotuneTarget autotuneTarget;
+    EncoderTuningCache* tuningCache = nullptr;
+
+    // Probing
+    bool fastProbe = false;
+    ProbeCache* probeCache = nullptr;
+    std::shared_ptr<const ProbeResult> probeResult;
+
+    // Threading
+    ThreadingPolicy threading = ThreadingPolicy::forHost();
+
+    // Stream copy
+    bool streamCopyEnabled = true;
+    bool videoStreamCopy = false;
+    bool audioStreamCopy = false;
+
+    bool fragmentedOutput = false;
+
+    // Segment-parallel mode
+    int segmentCountSetting = 0;
+    int segmentWorkerSetting = 0;
+    int checkpointSeconds = 0;
+    SegmentRunner segmentRunner;
+    int segmentRunnerSlots = 0;
+
+    // Pipeline mode
+    bool pipelineMode = false;
+    int pipelineQueueDepth = 8;
+    PipelineStats pipelineStats;
+
+    // Instrumentation
+    TranscodeMetrics metrics;
+    double pendingDecodeSeconds = 0.0;
+
+    // Progress, written by the transcoding thread and read by any other.
+    // Positions are in AV_TIME_BASE units from the start of the video stream.
+    std::atomic<int64_t> progressPosition{0};
+    std::atomic<int64_t> progressDuration{0};
+    std::atomic<long long> progressFrames{0};
+    int64_t progressStart = 0;
+    const std::atomic<bool>* cancelFlag = nullptr;
+    const std::atomic<bool>* yieldFlag = nullptr;
+    bool yieldedLast = false;
+
+    // Packet and frame structs and scaled pictures recycled across frames and jobs
+    PacketPool packetPool;
+    FramePool framePool;
 
     // Private methods for processing steps
     bool openInputFile(const std::string& inputPath);
+    // Demuxer and stream info only; openInputFile adds the decoders
+    bool openInputContainer(const std::string& inputPath);
+    // cacheKey is empty for inputs that cannot be cached, e.g. streams
+    bool findStreamInfo(const std::string& cacheKey);
+    bool openInputStream(StreamInput& input);
+    bool openDecoders();
+    int readInputPacket(AVPacket* packet);
+    bool transcodeOpenedInput(const std::string& outputPath);
     bool setupOutputFile(const std::string& outputPath);
+    // Waits for buffered output to reach the disk; false if any write failed
+    bool closeOutput();
+    bool canStreamCopy(int inputStreamIndex);
+    bool setupStreamCopy(int inputStreamIndex, AVStream* outStream);
+    bool setupVideoEncoder(AVStream* outVideoStream);
+    bool setupAudioEncoder(AVStream* outAudioStream);
+    bool tuneEncoder();
+    bool decodeTuningSample(std::vector<AVFrame*>& sample, int width, int height, double& secondsPerFrame);
+    bool trialEncode(const EncoderSettings& settings, const std::vector<AVFrame*>& sample,
+                     double& secondsPerFrame, double& bytesPerFrame);
     bool processFrames();
+    bool processFramesPipelined();
     void cleanup();
 
+    // Shared steps of the serial and pipelined paths
+    int sendDecoderPacket(const AVPacket* packet);
+    int receiveDecoderFrame(AVFrame* frame);
+    bool initScaler();
+    AVFrame* allocScaledFrame();
+    bool scaleFrame(const AVFrame* frame, AVFrame* scaledFrame);
+    bool encodeFrame(const AVFrame* frame);
+    // encodeFrame behind the scene analysis; null flushes as well
+    bool encodeAnalyzedFrame(AVFrame* frame);
+    bool writeAudioPacket(const AVPacket* packet);
+    bool remuxPacket(const AVPacket* packet, int outputStreamIndex);
+    bool writePacket(AVPacket* packet);
+    // Encoded audio up to the dts of until, or all of it for null. Callers hold muxMutex.
+    bool writeEncodedAudio(const AVPacket* until);
+    // Before the trailer: flushes the audio stage and writes what is left of it
+    bool finishAudio();
+
+    // Pipeline stages, see video_pipeline.cpp
+    bool runDecodeStage(BoundedQueue<AVFrame*>& output, PipelineStageStats& stats);
+    bool runScaleStage(BoundedQueue<AVFrame*>& input, BoundedQueue<AVFrame*>& output, PipelineStageStats& stats);
+    bool runEncodeStage(BoundedQueue<AVFrame*>& input, PipelineStageStats& stats);
+
+    // Segment-parallel transcoding, see video_segments.cpp
+    void copySettingsTo(VideoProcessor& other) const;
+    bool transcodeSegmented(const std::string& inputPath, const std::string& outputPath);
+    bool probeKeyframes(std::vector<int64_t>& keyframes);
+    static std::vector<std::pair<int64_t, int64_t>> planSegments(const std::vector<int64_t>& keyframes,
+                                                                 int segmentCount);
+    bool transcodeSegment(const std::string& inputPath, const std::string& spoolPath,
+                          int64_t startPts, int64_t endPts);
+    // Muxes the spools in order with the input's audio. waitForSegment(i) is
+    // called before spool i is opened and returns false if it never will be.
+    bool joinSegments(const std::vector<std::string>& spoolPaths,
+                      const std::function<bool(size_t index)>& waitForSegment);
+
+    // ABR ladder output, see video_ladder.cpp
+    bool transcodeLadder(const std::string& outputDirectory, const std::vector<Rendition>& renditions);
+
+    // Thumbnails, see video_thumbnails.cpp
+    bool renderThumbnails(const ThumbnailOptions& options, std::string& image);
+    bool decodeKeyframeAt(double seconds, AVFrame* frame);
+
     // Calculate output dimensions maintaining aspect ratio
     void calculateOutputDimensions(int inputWidth, int inputHeight, int& outWidth, int& outHeight);
+    static void fitDimensions(int inputWidth, int inputHeight, int maxWidth, int maxHeight,
+                              int& outWidth, int& outHeight);
     
     // FFmpeg context variables
     AVFormatContext* inputFormatContext = nullptr;
+    AVIOContext* inputIOContext = nullptr;
+    ReadAheadFile inputFile;
     AVFormatContext* outputFormatContext = nullptr;
+    AsyncFileWriter outputWriter;
     AVCodecContext* inputVideoCodecContext = nullptr;
     AVCodecContext* outputVideoCodecContext = nullptr;
     AVCodecContext* inputAudioCodecContext = nullptr;
     AVCodecContext* outputAudioCodecContext = nullptr;
-    SwsContext* swsContext = nullptr;
+    AudioTranscoder audioTranscoder;
+    Scaler scaler;
+
+    // Receives encoded packets instead of the muxer when set
+    std::function<bool(AVPacket* packet)> packetSink;
+
+    // Serializes muxer writes when audio and video are written from different threads
+    std::mutex muxMutex;
     
     // Stream indices
     int videoStreamIndex = -1;
     int audioStreamIndex = -1;
+    int audioOutputStreamIndex = 1;
 };
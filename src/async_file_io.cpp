@@ -0,0 +1,299 @@
+#include "async_file_io.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+extern "C" {
+#include <libavformat/avformat.h>
+}
+
+namespace {
+
+// Page aligned, so writes copy whole pages into the page cache
+constexpr size_t BLOCK_ALIGNMENT = 4096;
+
+bool writeAllAt(int fd, const uint8_t* data, size_t size, int64_t offset) {
+    while (size > 0) {
+        ssize_t n = pwrite(fd, data, size, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        data += n;
+        size -= static_cast<size_t>(n);
+        offset += n;
+    }
+    return true;
+}
+
+// Position an AVIO seek request resolves to, or -1 for bad requests
+int64_t seekTarget(int64_t offset, int whence, int64_t position, int64_t size) {
+    switch (whence & ~AVSEEK_FORCE) {
+        case SEEK_SET: return offset >= 0 ? offset : -1;
+        case SEEK_CUR: return position + offset >= 0 ? position + offset : -1;
+        case SEEK_END: return size + offset >= 0 ? size + offset : -1;
+    }
+    return -1;
+}
+
+} // namespace
+
+AsyncFileWriter::AsyncFileWriter() {}
+
+AsyncFileWriter::~AsyncFileWriter() {
+    close();
+    for (uint8_t* block : blocks) {
+        free(block);
+    }
+}
+
+bool AsyncFileWriter::open(const std::string& path) {
+    close();
+    
+    // Allocated once; a processor reuses them for every job
+    while (blocks.size() < BUFFER_COUNT) {
+        void* block = nullptr;
+        if (posix_memalign(&block, BLOCK_ALIGNMENT, BUFFER_SIZE) != 0) {
+            std::cerr << "Could not allocate output buffers" << std::endl;
+            return false;
+        }
+        blocks.push_back(static_cast<uint8_t*>(block));
+    }
+    
+    fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        std::cerr << "Could not open output file " << path << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    
+    uint8_t* ioBuffer = static_cast<uint8_t*>(av_malloc(IO_BUFFER_SIZE));
+    // FFmpeg 7 made the written data const
+#if LIBAVFORMAT_VERSION_MAJOR < 61
+    auto write = [](void* opaque, uint8_t* data, int size) { return writePacket(opaque, data, size); };
+#else
+    auto write = writePacket;
+#endif
+    ioContext = ioBuffer ? avio_alloc_context(ioBuffer, IO_BUFFER_SIZE, 1, this, nullptr, write, seek) : nullptr;
+    if (!ioContext) {
+        std::cerr << "Could not allocate output IO context" << std::endl;
+        av_free(ioBuffer);
+        ::close(fd);
+        fd = -1;
+        return false;
+    }
+    
+    freeBlocks = std::make_unique<BoundedQueue<Block>>(BUFFER_COUNT);
+    pendingBlocks = std::make_unique<BoundedQueue<Block>>(BUFFER_COUNT);
+    for (uint8_t* data : blocks) {
+        Block block;
+        block.data = data;
+        freeBlocks->push(block);
+    }
+    current = Block();
+    position = 0;
+    fileSize = 0;
+    failed = false;
+    writer = std::thread(&AsyncFileWriter::writerLoop, this);
+    return true;
+}
+
+bool AsyncFileWriter::close() {
+    if (fd < 0) {
+        return true;
+    }
+    
+    // Whatever the muxer still buffers, then the partly filled block
+    avio_flush(ioContext);
+    handOver();
+    pendingBlocks->close();
+    writer.join();
+    
+    bool ok = !failed && ioContext->error >= 0;
+    if (fsync(fd) != 0) {
+        std::cerr << "Could not sync output file: " << strerror(errno) << std::endl;
+        ok = false;
+    }
+    if (::close(fd) != 0) {
+        ok = false;
+    }
+    fd = -1;
+    
+    av_freep(&ioContext->buffer);
+    avio_context_free(&ioContext);
+    freeBlocks.reset();
+    pendingBlocks.reset();
+    return ok;
+}
+
+int AsyncFileWriter::writePacket(void* opaque, const uint8_t* data, int size) {
+    AsyncFileWriter* self = static_cast<AsyncFileWriter*>(opaque);
+    if (!self->append(data, static_cast<size_t>(size))) {
+        return AVERROR(EIO);
+    }
+    return size;
+}
+
+int64_t AsyncFileWriter::seek(void* opaque, int64_t offset, int whence) {
+    AsyncFileWriter* self = static_cast<AsyncFileWriter*>(opaque);
+    if (whence == AVSEEK_SIZE) {
+        return self->fileSize;
+    }
+    int64_t target = seekTarget(offset, whence, self->position, self->fileSize);
+    if (target < 0) {
+        return AVERROR(EINVAL);
+    }
+    
+    // A block covers one contiguous range, so a jump starts a new one.
+    // The writer applies blocks in order, so a patch lands after the data it patches.
+    if (target != self->position) {
+        self->handOver();
+        self->position = target;
+    }
+    return target;
+}
+
+bool AsyncFileWriter::append(const uint8_t* data, size_t size) {
+    while (size > 0) {
+        if (!current.data) {
+            // Blocks only while every buffer is waiting on the disk
+            if (!freeBlocks->pop(current)) {
+                return false;
+            }
+            current.size = 0;
+            current.offset = position;
+            currentSince = std::chrono::steady_clock::now();
+        }
+        
+        size_t n = std::min(size, BUFFER_SIZE - current.size);
+        memcpy(current.data + current.size, data, n);
+        current.size += n;
+        data += n;
+        size -= n;
+        position += static_cast<int64_t>(n);
+        fileSize = std::max(fileSize, position);
+        if (current.size == BUFFER_SIZE) {
+            handOver();
+        }
+    }
+    
+    if (current.data && std::chrono::steady_clock::now() - currentSince >= FLUSH_INTERVAL) {
+        handOver();
+    }
+    return !failed;
+}
+
+void AsyncFileWriter::handOver() {
+    if (!current.data) {
+        return;
+    }
+    if (current.size > 0) {
+        pendingBlocks->push(current);
+    } else {
+        freeBlocks->push(current);
+    }
+    current = Block();
+}
+
+void AsyncFileWriter::writerLoop() {
+    Block block;
+    while (pendingBlocks->pop(block)) {
+        if (!failed && !writeAllAt(fd, block.data, block.size, block.offset)) {
+            std::cerr << "Error writing output file: " << strerror(errno) << std::endl;
+            failed = true;
+        }
+        // There are only as many blocks as the free queue holds, so this never waits
+        block.size = 0;
+        freeBlocks->push(block);
+    }
+}
+
+ReadAheadFile::~ReadAheadFile() {
+    close();
+}
+
+bool ReadAheadFile::open(const std::string& path) {
+    close();
+    
+    fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat info;
+    fileSize = fstat(fd, &info) == 0 ? info.st_size : 0;
+    // Also doubles the kernel's own read-ahead window
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    
+    uint8_t* buffer = static_cast<uint8_t*>(av_malloc(BUFFER_SIZE));
+    ioContext = buffer ? avio_alloc_context(buffer, BUFFER_SIZE, 0, this, readPacket, nullptr, seek) : nullptr;
+    if (!ioContext) {
+        std::cerr << "Could not allocate input IO context" << std::endl;
+        av_free(buffer);
+        close();
+        return false;
+    }
+    position = 0;
+    prefetchedTo = 0;
+    return true;
+}
+
+void ReadAheadFile::close() {
+    if (ioContext) {
+        // The demuxer may have swapped in a larger buffer
+        av_freep(&ioContext->buffer);
+        avio_context_free(&ioContext);
+    }
+    if (fd >= 0) {
+        ::close(fd);
+        fd = -1;
+    }
+}
+
+int ReadAheadFile::readPacket(void* opaque, uint8_t* buffer, int size) {
+    ReadAheadFile* self = static_cast<ReadAheadFile*>(opaque);
+    
+    // Top up the prefetch window once half of it has been consumed
+    if (self->position >= self->prefetchedTo - READ_AHEAD_BYTES / 2) {
+        int64_t from = std::max(self->position, self->prefetchedTo);
+        int64_t to = self->position + READ_AHEAD_BYTES;
+        posix_fadvise(self->fd, from, to - from, POSIX_FADV_WILLNEED);
+        self->prefetchedTo = to;
+    }
+    
+    ssize_t n;
+    do {
+        n = pread(self->fd, buffer, static_cast<size_t>(size), self->position);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) {
+        return AVERROR(errno);
+    }
+    if (n == 0) {
+        return AVERROR_EOF;
+    }
+    self->position += n;
+    return static_cast<int>(n);
+}
+
+int64_t ReadAheadFile::seek(void* opaque, int64_t offset, int whence) {
+    ReadAheadFile* self = static_cast<ReadAheadFile*>(opaque);
+    if (whence == AVSEEK_SIZE) {
+        return self->fileSize;
+    }
+    int64_t target = seekTarget(offset, whence, self->position, self->fileSize);
+    if (target < 0) {
+        return AVERROR(EINVAL);
+    }
+    
+    // Outside the window, e.g. to a moov at the end: prefetch from there
+    if (target < self->position || target > self->prefetchedTo) {
+        self->prefetchedTo = target;
+    }
+    self->position = target;
+    return target;
+}
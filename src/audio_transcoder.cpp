@@ -0,0 +1,257 @@
+#include "audio_transcoder.hpp"
+#include <algorithm>
+#include <iostream>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavutil/audio_fifo.h>
+#include <libswresample/swresample.h>
+}
+
+namespace {
+
+// For encoders that take any number of samples per frame
+constexpr int DEFAULT_FRAME_SIZE = 1024;
+
+void freePacket(AVPacket*& packet) {
+    av_packet_free(&packet);
+}
+
+// Output frame in the encoder's sample format, layout and rate, without a buffer yet
+void describeEncoderFrame(AVFrame* frame, const AVCodecContext* encoder) {
+    av_frame_unref(frame);
+    frame->format = encoder->sample_fmt;
+    frame->sample_rate = encoder->sample_rate;
+    av_channel_layout_copy(&frame->ch_layout, &encoder->ch_layout);
+}
+
+} // namespace
+
+AudioTranscoder::~AudioTranscoder() {
+    reset();
+}
+
+bool AudioTranscoder::start(AVCodecContext* decoder, AVCodecContext* encoder, AVRational inputTimeBase) {
+    reset();
+    this->decoder = decoder;
+    this->encoder = encoder;
+    inputTimeBaseNum = inputTimeBase.num;
+    inputTimeBaseDen = inputTimeBase.den;
+    
+    int frameSize = encoder->frame_size > 0 ? encoder->frame_size : DEFAULT_FRAME_SIZE;
+    fifo = av_audio_fifo_alloc(encoder->sample_fmt, encoder->ch_layout.nb_channels, frameSize);
+    decoded = av_frame_alloc();
+    converted = av_frame_alloc();
+    batch = av_frame_alloc();
+    if (!fifo || !decoded || !converted || !batch) {
+        std::cerr << "Could not allocate audio buffers" << std::endl;
+        reset();
+        return false;
+    }
+    
+    packets = std::make_unique<BoundedQueue<AVPacket*>>(QUEUE_DEPTH, freePacket);
+    worker = std::thread(&AudioTranscoder::run, this);
+    return true;
+}
+
+bool AudioTranscoder::push(const AVPacket* packet) {
+    if (failed) {
+        return false;
+    }
+    AVPacket* reference = av_packet_clone(packet);
+    if (!reference) {
+        std::cerr << "Could not reference audio packet" << std::endl;
+        return false;
+    }
+    // Freed by the queue if the audio thread has stopped
+    return packets->push(reference) && !failed;
+}
+
+bool AudioTranscoder::pop(AVPacket* packet, int64_t dts, AVRational timeBase) {
+    std::lock_guard<std::mutex> lock(encodedMutex);
+    if (encoded.empty()) {
+        return false;
+    }
+    AVPacket* next = encoded.front();
+    if (dts != AV_NOPTS_VALUE && av_compare_ts(next->dts, encoder->time_base, dts, timeBase) > 0) {
+        return false;
+    }
+    encoded.pop_front();
+    av_packet_move_ref(packet, next);
+    av_packet_free(&next);
+    return true;
+}
+
+bool AudioTranscoder::finish() {
+    if (!active()) {
+        return !failed;
+    }
+    // The thread flushes once it has drained the queue
+    packets->close();
+    worker.join();
+    return !failed;
+}
+
+void AudioTranscoder::reset() {
+    if (packets) {
+        packets->abort();
+    }
+    if (worker.joinable()) {
+        worker.join();
+    }
+    packets.reset();
+    
+    swr_free(&resampler);
+    if (fifo) {
+        av_audio_fifo_free(fifo);
+        fifo = nullptr;
+    }
+    av_frame_free(&decoded);
+    av_frame_free(&converted);
+    av_frame_free(&batch);
+    {
+        std::lock_guard<std::mutex> lock(encodedMutex);
+        for (AVPacket* packet : encoded) {
+            av_packet_free(&packet);
+        }
+        encoded.clear();
+    }
+    decoder = nullptr;
+    encoder = nullptr;
+    nextPts = 0;
+    failed = false;
+}
+
+void AudioTranscoder::run() {
+    bool ok = true;
+    AVPacket* packet = nullptr;
+    while (ok && packets->pop(packet)) {
+        ok = decode(packet);
+        av_packet_free(&packet);
+    }
+    // Closed rather than aborted: the stream is complete, flush every stage
+    if (ok && !packets->aborted()) {
+        ok = decode(nullptr) && resample(nullptr) && encodeFifo(true);
+    }
+    if (!ok) {
+        // Unblocks and fails the next push
+        failed = true;
+        packets->abort();
+    }
+}
+
+bool AudioTranscoder::decode(const AVPacket* packet) {
+    // A null packet flushes the decoder
+    if (avcodec_send_packet(decoder, packet) < 0) {
+        std::cerr << "Error sending packet for audio decoding" << std::endl;
+        return false;
+    }
+    while (true) {
+        int ret = avcodec_receive_frame(decoder, decoded);
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+            return true;
+        } else if (ret < 0) {
+            std::cerr << "Error receiving audio frame" << std::endl;
+            return false;
+        }
+        bool ok = resample(decoded) && encodeFifo(false);
+        av_frame_unref(decoded);
+        if (!ok) {
+            return false;
+        }
+    }
+}
+
+bool AudioTranscoder::resample(const AVFrame* frame) {
+    if (!resampler) {
+        // Nothing was decoded, so there is nothing to flush
+        if (!frame) {
+            return true;
+        }
+        // Set up from the first frame, whose layout is known even when the
+        // container left it out. Output starts where the input's audio does.
+        if (frame->best_effort_timestamp != AV_NOPTS_VALUE) {
+            nextPts = av_rescale_q(frame->best_effort_timestamp, AVRational{inputTimeBaseNum, inputTimeBaseDen},
+                                   encoder->time_base);
+        }
+        if (swr_alloc_set_opts2(&resampler, &encoder->ch_layout, encoder->sample_fmt, encoder->sample_rate,
+                                &frame->ch_layout, static_cast<AVSampleFormat>(frame->format),
+                                frame->sample_rate, 0, nullptr) < 0 ||
+            swr_init(resampler) < 0) {
+            std::cerr << "Could not initialize audio resampler" << std::endl;
+            return false;
+        }
+    }
+    
+    // Without a buffer, swr_convert_frame allocates one for what it has;
+    // a null frame returns the samples it kept back for filtering
+    describeEncoderFrame(converted, encoder);
+    if (swr_convert_frame(resampler, converted, frame) < 0) {
+        std::cerr << "Error resampling audio" << std::endl;
+        return false;
+    }
+    if (converted->nb_samples > 0 &&
+        av_audio_fifo_write(fifo, reinterpret_cast<void**>(converted->extended_data),
+                            converted->nb_samples) < converted->nb_samples) {
+        std::cerr << "Could not buffer audio samples" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool AudioTranscoder::encodeFifo(bool flush) {
+    int frameSize = encoder->frame_size > 0 ? encoder->frame_size : DEFAULT_FRAME_SIZE;
+    // The encoder takes a shorter frame only as the last one
+    while (av_audio_fifo_size(fifo) >= frameSize || (flush && av_audio_fifo_size(fifo) > 0)) {
+        int samples = std::min(frameSize, av_audio_fifo_size(fifo));
+        describeEncoderFrame(batch, encoder);
+        batch->nb_samples = samples;
+        if (av_frame_get_buffer(batch, 0) < 0 ||
+            av_audio_fifo_read(fifo, reinterpret_cast<void**>(batch->extended_data), samples) < samples) {
+            std::cerr << "Could not allocate audio frame" << std::endl;
+            return false;
+        }
+        batch->pts = nextPts;
+        nextPts += samples;
+        
+        if (avcodec_send_frame(encoder, batch) < 0) {
+            std::cerr << "Error sending frame for audio encoding" << std::endl;
+            return false;
+        }
+        if (!receivePackets()) {
+            return false;
+        }
+    }
+    
+    if (!flush) {
+        return true;
+    }
+    // A null frame flushes the encoder
+    if (avcodec_send_frame(encoder, nullptr) < 0) {
+        std::cerr << "Error flushing audio encoder" << std::endl;
+        return false;
+    }
+    return receivePackets();
+}
+
+bool AudioTranscoder::receivePackets() {
+    while (true) {
+        AVPacket* packet = av_packet_alloc();
+        if (!packet) {
+            std::cerr << "Could not allocate packet" << std::endl;
+            return false;
+        }
+        int ret = avcodec_receive_packet(encoder, packet);
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+            av_packet_free(&packet);
+            return true;
+        } else if (ret < 0) {
+            av_packet_free(&packet);
+            std::cerr << "Error receiving packet from audio encoder" << std::endl;
+            return false;
+        }
+        
+        std::lock_guard<std::mutex> lock(encodedMutex);
+        encoded.push_back(packet);
+    }
+}
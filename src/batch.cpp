@@ -0,0 +1,285 @@
+#include "batch.hpp"
+#include "cluster.hpp"
+#include "job_scheduler.hpp"
+#include "video_processor.hpp"
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <set>
+#include <glob.h>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+constexpr double MEGABYTE = 1024.0 * 1024.0;
+
+// Value of a string field in one manifest line. The manifest is flat
+// objects of strings, so no JSON parser is needed.
+bool jsonStringField(const std::string& line, const std::string& key, std::string& value) {
+    std::string quotedKey = "\"" + key + "\"";
+    size_t pos = line.find(quotedKey);
+    if (pos == std::string::npos) {
+        return false;
+    }
+    pos = line.find(':', pos + quotedKey.size());
+    if (pos == std::string::npos) {
+        return false;
+    }
+    pos = line.find('"', pos + 1);
+    if (pos == std::string::npos) {
+        return false;
+    }
+    
+    value.clear();
+    for (size_t i = pos + 1; i < line.size(); i++) {
+        char c = line[i];
+        if (c == '"') {
+            return true;
+        }
+        if (c == '\\' && i + 1 < line.size()) {
+            char escaped = line[++i];
+            switch (escaped) {
+                case 'n': value += '\n'; break;
+                case 't': value += '\t'; break;
+                default: value += escaped; break;
+            }
+        } else {
+            value += c;
+        }
+    }
+    return false;
+}
+
+bool readManifest(const std::string& path, std::vector<BatchItem>& items) {
+    std::ifstream manifest(path);
+    if (!manifest) {
+        std::cerr << "Could not read manifest " << path << std::endl;
+        return false;
+    }
+    
+    std::string line;
+    int lineNumber = 0;
+    while (std::getline(manifest, line)) {
+        lineNumber++;
+        if (line.find_first_not_of(" \t\r") == std::string::npos) {
+            continue;
+        }
+        BatchItem item;
+        if (!jsonStringField(line, "input", item.inputPath)) {
+            std::cerr << path << ":" << lineNumber << ": no \"input\" field" << std::endl;
+            return false;
+        }
+        jsonStringField(line, "output", item.outputPath);
+        items.push_back(item);
+    }
+    return true;
+}
+
+bool expandGlob(const std::string& pattern, std::vector<BatchItem>& items) {
+    glob_t matches;
+    int ret = glob(pattern.c_str(), 0, nullptr, &matches);
+    if (ret == GLOB_NOMATCH) {
+        globfree(&matches);
+        return true;
+    }
+    if (ret != 0) {
+        std::cerr << "Could not expand " << pattern << std::endl;
+        globfree(&matches);
+        return false;
+    }
+    
+    for (size_t i = 0; i < matches.gl_pathc; i++) {
+        std::error_code error;
+        if (fs::is_regular_file(matches.gl_pathv[i], error)) {
+            BatchItem item;
+            item.inputPath = matches.gl_pathv[i];
+            items.push_back(item);
+        }
+    }
+    globfree(&matches);
+    return true;
+}
+
+// clip.mp4 -> clip.part.mp4, keeping the extension the muxer is picked by
+std::string partialPath(const std::string& outputPath) {
+    fs::path path(outputPath);
+    return (path.parent_path() / (path.stem().string() + ".part" + path.extension().string())).string();
+}
+
+} // namespace
+
+bool collectBatchItems(const std::string& source, const std::string& outputDirectory,
+                       std::vector<BatchItem>& items) {
+    std::error_code error;
+    if (fs::is_directory(source, error)) {
+        for (const auto& entry : fs::directory_iterator(source, error)) {
+            std::string name = entry.path().filename().string();
+            if (entry.is_regular_file(error) && !name.empty() && name[0] != '.') {
+                BatchItem item;
+                item.inputPath = entry.path().string();
+                items.push_back(item);
+            }
+        }
+        if (error) {
+            std::cerr << "Could not list " << source << ": " << error.message() << std::endl;
+            return false;
+        }
+        // Listing order is unspecified; output names must not change between runs
+        std::sort(items.begin(), items.end(), [](const BatchItem& a, const BatchItem& b) {
+            return a.inputPath < b.inputPath;
+        });
+    } else if (fs::path(source).extension() == ".jsonl" && fs::is_regular_file(source, error)) {
+        if (!readManifest(source, items)) {
+            return false;
+        }
+    } else if (!expandGlob(source, items)) {
+        return false;
+    }
+    
+    // Default outputs are named after the input; inputs from different
+    // directories may share a name, so later ones get a suffix
+    std::set<std::string> usedOutputs;
+    for (BatchItem& item : items) {
+        if (item.outputPath.empty()) {
+            std::string stem = fs::path(item.inputPath).stem().string();
+            item.outputPath = (fs::path(outputDirectory) / (stem + ".mp4")).string();
+            for (int n = 2; usedOutputs.count(item.outputPath); n++) {
+                item.outputPath = (fs::path(outputDirectory) / (stem + "_" + std::to_string(n) + ".mp4")).string();
+            }
+        }
+        usedOutputs.insert(item.outputPath);
+        item.inputBytes = fs::file_size(item.inputPath, error);
+        if (error) {
+            item.inputBytes = 0;
+        }
+    }
+    return true;
+}
+
+int runBatch(std::vector<BatchItem> items, int workerCount,
+             const std::function<void(VideoProcessor& processor)>& configure,
+             Coordinator* coordinator) {
+    // Longest jobs first: the last jobs to start are short, so workers finish together
+    std::stable_sort(items.begin(), items.end(), [](const BatchItem& a, const BatchItem& b) {
+        return a.inputBytes > b.inputBytes;
+    });
+    
+    std::vector<BatchItem> pending;
+    int skipped = 0;
+    for (const BatchItem& item : items) {
+        std::error_code error;
+        if (fs::exists(item.outputPath, error)) {
+            skipped++;
+        } else {
+            pending.push_back(item);
+        }
+    }
+    
+    std::mutex statsMutex;
+    size_t finished = 0;
+    int failed = 0;
+    uint64_t bytesIn = 0;
+    uint64_t bytesOut = 0;
+    uint64_t frames = 0;
+    std::vector<std::string> failures;
+    // Jobs run by cluster workers leave no metrics in the local processor
+    std::set<std::string> remoteInputs;
+    size_t remoteJobs = 0;
+    
+    std::cout << "Batch: " << items.size() << " inputs, " << skipped << " already done, "
+              << pending.size() << " to transcode on " << workerCount << " workers" << std::endl;
+    
+    auto start = std::chrono::steady_clock::now();
+    {
+        // Every job is admitted up front; the queue only hands them out in order
+        JobScheduler scheduler(workerCount, static_cast<int>(std::max<size_t>(1, pending.size())));
+        scheduler.setJobObserver([&](const JobStatus& status, const VideoProcessor& processor) {
+            std::lock_guard<std::mutex> lock(statsMutex);
+            if (remoteInputs.erase(status.inputPath) > 0) {
+                remoteJobs++;
+            } else if (status.state == JobState::Succeeded) {
+                frames += processor.getMetrics().encode.count();
+            }
+        });
+        
+        for (const BatchItem& item : pending) {
+            std::string input = item.inputPath;
+            std::string output = item.outputPath;
+            std::string partial = partialPath(output);
+            uint64_t inputBytes = item.inputBytes;
+            
+            scheduler.submit(input, output,
+                [&, input, output, partial](VideoProcessor& processor) {
+                    std::error_code error;
+                    fs::path parent = fs::path(output).parent_path();
+                    if (!parent.empty()) {
+                        fs::create_directories(parent, error);
+                    }
+                    if (configure) {
+                        configure(processor);
+                    }
+                    
+                    RemoteResult remote = RemoteResult::Unavailable;
+                    if (coordinator) {
+                        remote = coordinator->runJob(input, partial, processor.exportSettings(), nullptr);
+                    }
+                    if (remote != RemoteResult::Unavailable) {
+                        std::lock_guard<std::mutex> lock(statsMutex);
+                        remoteInputs.insert(input);
+                    }
+                    bool processed = remote == RemoteResult::Unavailable
+                        ? processor.processVideo(input, partial)
+                        : remote == RemoteResult::Succeeded;
+                    if (processed) {
+                        fs::rename(partial, output, error);
+                        processed = !error;
+                    }
+                    if (!processed) {
+                        fs::remove(partial, error);
+                    }
+                    return processed;
+                },
+                [&, inputBytes, pendingCount = pending.size()](const JobStatus& status) {
+                    bool succeeded = status.state == JobState::Succeeded;
+                    std::error_code error;
+                    uint64_t outputBytes = succeeded ? fs::file_size(status.outputPath, error) : 0;
+                    
+                    std::lock_guard<std::mutex> lock(statsMutex);
+                    finished++;
+                    if (succeeded) {
+                        bytesIn += inputBytes;
+                        bytesOut += error ? 0 : outputBytes;
+                    } else {
+                        failed++;
+                        failures.push_back(status.inputPath);
+                    }
+                    std::cout << "[" << finished << "/" << pendingCount << "] " << status.inputPath
+                              << (succeeded ? " -> " + status.outputPath : " failed")
+                              << " (" << status.runSeconds << "s)" << std::endl;
+                });
+        }
+        // The scheduler drains its queue before it is destroyed
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    size_t succeeded = pending.size() - static_cast<size_t>(failed);
+    
+    std::cout << "Transcoded " << succeeded << " of " << pending.size() << " files in "
+              << seconds << "s" << std::endl;
+    if (seconds > 0.0) {
+        std::cout << "  input " << bytesIn / MEGABYTE << " MB (" << bytesIn / MEGABYTE / seconds << " MB/s), "
+                  << "output " << bytesOut / MEGABYTE << " MB" << std::endl;
+        std::cout << "  " << frames << " frames (" << frames / seconds << " fps), "
+                  << succeeded * 60.0 / seconds << " files/min" << std::endl;
+        if (remoteJobs > 0) {
+            std::cout << "  " << remoteJobs << " files on cluster workers, not counted in frames" << std::endl;
+        }
+    }
+    for (const std::string& failure : failures) {
+        std::cout << "  failed: " << failure << std::endl;
+    }
+    return failed;
+}
@@ -0,0 +1,800 @@
+#include "video_processor.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/channel_layout.h>
+#include <libavutil/mathematics.h>
+#include <libavutil/opt.h>
+#include <libavutil/pixdesc.h>
+#include <libswscale/swscale.h>
+}
+
+namespace fs = std::filesystem;
+
+namespace {
+
+// A synthetic input: everything needed to regenerate it bit for bit
+struct BenchCase {
+    std::string name;
+    int width;
+    int height;
+    AVPixelFormat pixelFormat;
+    std::string codec;
+    std::string container;
+    bool withAudio;
+};
+
+const std::vector<BenchCase> BENCH_CASES = {
+    {"480p_yuv420p_mpeg4_aac", 854, 480, AV_PIX_FMT_YUV420P, "mpeg4", "mp4", true},
+    {"720p_yuv420p_h264", 1280, 720, AV_PIX_FMT_YUV420P, "libx264", "mp4", false},
+    {"1080p_yuv422p_h264_aac", 1920, 1080, AV_PIX_FMT_YUV422P, "libx264", "mkv", true},
+    {"1080p_yuv422p_mpeg2", 1920, 1080, AV_PIX_FMT_YUV422P, "mpeg2video", "mkv", false},
+    {"2160p_yuv420p_h264_aac", 3840, 2160, AV_PIX_FMT_YUV420P, "libx264", "mp4", true},
+};
+
+// Resizes timed on their own by --scaler: exact 2:1 downscales and one odd ratio
+struct ScalerCase {
+    std::string name;
+    int srcWidth;
+    int srcHeight;
+    int dstWidth;
+    int dstHeight;
+};
+
+const std::vector<ScalerCase> SCALER_CASES = {
+    {"scale_2160p_to_1080p_yuv420p", 3840, 2160, 1920, 1080},
+    {"scale_1080p_to_540p_yuv420p", 1920, 1080, 960, 540},
+    {"scale_1080p_to_720p_yuv420p", 1920, 1080, 1280, 720},
+};
+
+constexpr int FRAME_RATE = 30;
+constexpr int SAMPLE_RATE = 48000;
+
+struct Options {
+    int frames = 120;
+    int repeat = 3;
+    bool streamCopy = false;
+    bool scalerOnly = false;
+    std::string filter;
+    std::string workDirectory = "bench_media";
+    std::string outputPath = "bench.json";
+    std::string baselinePath;
+    double tolerancePercent = 10.0;
+};
+
+// What one timed run reports back from its child process
+struct RunResult {
+    bool ok = false;
+    double wallSeconds = 0.0;
+    PipelineStats stages;
+    long peakRssKb = 0;
+};
+
+struct ModeResult {
+    std::string mode;
+    RunResult median;
+    double fps = 0.0;
+    double realtimeFactor = 0.0;
+    double bitrateKbps = 0.0;
+    double psnr = 0.0;
+};
+
+bool encodeAndWrite(AVFormatContext* format, AVCodecContext* encoder, AVStream* stream, const AVFrame* frame) {
+    if (avcodec_send_frame(encoder, frame) < 0) {
+        std::cerr << "Error sending frame to generator encoder" << std::endl;
+        return false;
+    }
+    
+    AVPacket* packet = av_packet_alloc();
+    while (true) {
+        int ret = avcodec_receive_packet(encoder, packet);
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+            break;
+        } else if (ret < 0) {
+            std::cerr << "Error receiving packet from generator encoder" << std::endl;
+            av_packet_free(&packet);
+            return false;
+        }
+        
+        packet->stream_index = stream->index;
+        av_packet_rescale_ts(packet, encoder->time_base, stream->time_base);
+        if (av_interleaved_write_frame(format, packet) < 0) {
+            std::cerr << "Error writing generated packet" << std::endl;
+            av_packet_free(&packet);
+            return false;
+        }
+    }
+    av_packet_free(&packet);
+    return true;
+}
+
+// Moving gradients plus seeded noise, so every run encodes the same content
+// and the encoder cannot coast on a static picture
+void fillPicture(AVFrame* frame, int index) {
+    uint32_t seed = 0x9e3779b9u * static_cast<uint32_t>(index + 1);
+    for (int y = 0; y < frame->height; y++) {
+        uint8_t* row = frame->data[0] + y * frame->linesize[0];
+        for (int x = 0; x < frame->width; x++) {
+            seed = seed * 1664525u + 1013904223u;
+            row[x] = static_cast<uint8_t>(((x + 2 * y + 3 * index) & 0xff) ^ ((seed >> 28) & 0x0f));
+        }
+    }
+    
+    for (int y = 0; y < frame->height / 2; y++) {
+        uint8_t* u = frame->data[1] + y * frame->linesize[1];
+        uint8_t* v = frame->data[2] + y * frame->linesize[2];
+        for (int x = 0; x < frame->width / 2; x++) {
+            u[x] = static_cast<uint8_t>(128 + 64 * std::sin((x + index) * 0.05));
+            v[x] = static_cast<uint8_t>(128 + 64 * std::cos((y - index) * 0.05));
+        }
+    }
+}
+
+void fillTone(AVFrame* frame, int64_t firstSample) {
+    for (int channel = 0; channel < frame->ch_layout.nb_channels; channel++) {
+        float* samples = reinterpret_cast<float*>(frame->data[channel]);
+        for (int i = 0; i < frame->nb_samples; i++) {
+            double t = static_cast<double>(firstSample + i) / SAMPLE_RATE;
+            samples[i] = static_cast<float>(0.25 * std::sin(2.0 * M_PI * (440.0 + 110.0 * channel) * t));
+        }
+    }
+}
+
+AVCodecContext* openGeneratorVideo(const BenchCase& benchCase, AVFormatContext* format, AVStream*& stream) {
+    const AVCodec* codec = avcodec_find_encoder_by_name(benchCase.codec.c_str());
+    if (!codec) {
+        std::cerr << "Encoder not available: " << benchCase.codec << std::endl;
+        return nullptr;
+    }
+    
+    AVCodecContext* encoder = avcodec_alloc_context3(codec);
+    encoder->width = benchCase.width;
+    encoder->height = benchCase.height;
+    encoder->pix_fmt = benchCase.pixelFormat;
+    encoder->time_base = AVRational{1, FRAME_RATE};
+    encoder->framerate = AVRational{FRAME_RATE, 1};
+    encoder->gop_size = FRAME_RATE;
+    encoder->bit_rate = static_cast<int64_t>(benchCase.width) * benchCase.height * 4;
+    if (benchCase.codec == "libx264") {
+        av_opt_set(encoder->priv_data, "preset", "veryfast", 0);
+    }
+    if (format->oformat->flags & AVFMT_GLOBALHEADER) {
+        encoder->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    }
+    
+    stream = avformat_new_stream(format, nullptr);
+    if (!stream || avcodec_open2(encoder, codec, nullptr) < 0 ||
+        avcodec_parameters_from_context(stream->codecpar, encoder) < 0) {
+        std::cerr << "Could not open generator encoder " << benchCase.codec << std::endl;
+        avcodec_free_context(&encoder);
+        return nullptr;
+    }
+    stream->time_base = encoder->time_base;
+    return encoder;
+}
+
+AVCodecContext* openGeneratorAudio(AVFormatContext* format, AVStream*& stream) {
+    const AVCodec* codec = avcodec_find_encoder(AV_CODEC_ID_AAC);
+    if (!codec) {
+        std::cerr << "Could not find AAC encoder" << std::endl;
+        return nullptr;
+    }
+    
+    AVCodecContext* encoder = avcodec_alloc_context3(codec);
+    encoder->sample_fmt = AV_SAMPLE_FMT_FLTP;
+    encoder->sample_rate = SAMPLE_RATE;
+    encoder->bit_rate = 128000;
+    av_channel_layout_default(&encoder->ch_layout, 2);
+    encoder->time_base = AVRational{1, SAMPLE_RATE};
+    if (format->oformat->flags & AVFMT_GLOBALHEADER) {
+        encoder->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    }
+    
+    stream = avformat_new_stream(format, nullptr);
+    if (!stream || avcodec_open2(encoder, codec, nullptr) < 0 ||
+        avcodec_parameters_from_context(stream->codecpar, encoder) < 0) {
+        std::cerr << "Could not open generator audio encoder" << std::endl;
+        avcodec_free_context(&encoder);
+        return nullptr;
+    }
+    stream->time_base = encoder->time_base;
+    return encoder;
+}
+
+// Encode frameCount frames of the case's pattern (and a tone) into path
+bool generateInput(const BenchCase& benchCase, int frameCount, const std::string& path) {
+    AVFormatContext* format = nullptr;
+    avformat_alloc_output_context2(&format, nullptr, nullptr, path.c_str());
+    if (!format) {
+        std::cerr << "Could not create generator output " << path << std::endl;
+        return false;
+    }
+    
+    AVStream* videoStream = nullptr;
+    AVStream* audioStream = nullptr;
+    AVCodecContext* videoEncoder = openGeneratorVideo(benchCase, format, videoStream);
+    AVCodecContext* audioEncoder = nullptr;
+    AVFrame* picture = av_frame_alloc();
+    AVFrame* converted = av_frame_alloc();
+    AVFrame* tone = av_frame_alloc();
+    SwsContext* converter = nullptr;
+    bool ok = videoEncoder != nullptr;
+    
+    if (ok && benchCase.withAudio) {
+        audioEncoder = openGeneratorAudio(format, audioStream);
+        ok = audioEncoder != nullptr;
+    }
+    
+    // The pattern is drawn in yuv420p and converted to the case's format
+    if (ok) {
+        picture->format = AV_PIX_FMT_YUV420P;
+        picture->width = benchCase.width;
+        picture->height = benchCase.height;
+        converted->format = benchCase.pixelFormat;
+        converted->width = benchCase.width;
+        converted->height = benchCase.height;
+        ok = av_frame_get_buffer(picture, 0) >= 0 && av_frame_get_buffer(converted, 0) >= 0;
+        if (ok && benchCase.pixelFormat != AV_PIX_FMT_YUV420P) {
+            converter = sws_getContext(benchCase.width, benchCase.height, AV_PIX_FMT_YUV420P,
+                                       benchCase.width, benchCase.height, benchCase.pixelFormat,
+                                       SWS_POINT, nullptr, nullptr, nullptr);
+            ok = converter != nullptr;
+        }
+    }
+    if (ok && audioEncoder) {
+        tone->format = audioEncoder->sample_fmt;
+        tone->sample_rate = SAMPLE_RATE;
+        tone->nb_samples = audioEncoder->frame_size;
+        av_channel_layout_copy(&tone->ch_layout, &audioEncoder->ch_layout);
+        ok = av_frame_get_buffer(tone, 0) >= 0;
+    }
+    
+    if (ok && avio_open(&format->pb, path.c_str(), AVIO_FLAG_WRITE) < 0) {
+        std::cerr << "Could not open " << path << std::endl;
+        ok = false;
+    }
+    if (ok && avformat_write_header(format, nullptr) < 0) {
+        std::cerr << "Could not write generator header" << std::endl;
+        ok = false;
+    }
+    
+    // Interleave picture and tone frames by timestamp
+    int64_t nextFrame = 0;
+    int64_t nextSample = 0;
+    int64_t totalSamples = av_rescale(frameCount, SAMPLE_RATE, FRAME_RATE);
+    while (ok && (nextFrame < frameCount || (audioEncoder && nextSample < totalSamples))) {
+        bool videoNext = !audioEncoder || nextSample >= totalSamples ||
+                         (nextFrame < frameCount &&
+                          av_compare_ts(nextFrame, videoEncoder->time_base, nextSample, audioEncoder->time_base) <= 0);
+        if (videoNext) {
+            ok = av_frame_make_writable(picture) >= 0;
+            fillPicture(picture, static_cast<int>(nextFrame));
+            AVFrame* frame = picture;
+            if (ok && converter) {
+                ok = av_frame_make_writable(converted) >= 0;
+                sws_scale(converter, picture->data, picture->linesize, 0, picture->height,
+                          converted->data, converted->linesize);
+                frame = converted;
+            }
+            frame->pts = nextFrame++;
+            ok = ok && encodeAndWrite(format, videoEncoder, videoStream, frame);
+        } else {
+            ok = av_frame_make_writable(tone) >= 0;
+            fillTone(tone, nextSample);
+            tone->pts = nextSample;
+            nextSample += tone->nb_samples;
+            ok = ok && encodeAndWrite(format, audioEncoder, audioStream, tone);
+        }
+    }
+    
+    if (ok) {
+        ok = encodeAndWrite(format, videoEncoder, videoStream, nullptr) &&
+             (!audioEncoder || encodeAndWrite(format, audioEncoder, audioStream, nullptr)) &&
+             av_write_trailer(format) >= 0;
+    }
+    
+    sws_freeContext(converter);
+    av_frame_free(&picture);
+    av_frame_free(&converted);
+    av_frame_free(&tone);
+    avcodec_free_context(&videoEncoder);
+    avcodec_free_context(&audioEncoder);
+    if (format->pb) {
+        avio_closep(&format->pb);
+    }
+    avformat_free_context(format);
+    return ok;
+}
+
+// Sequential decoded video frames of a file
+class FrameReader {
+public:
+    ~FrameReader() {
+        av_packet_free(&packet);
+        avcodec_free_context(&decoder);
+        if (format) {
+            avformat_close_input(&format);
+        }
+    }
+    
+    bool open(const std::string& path) {
+        if (avformat_open_input(&format, path.c_str(), nullptr, nullptr) < 0 ||
+            avformat_find_stream_info(format, nullptr) < 0) {
+            return false;
+        }
+        streamIndex = av_find_best_stream(format, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
+        if (streamIndex < 0) {
+            return false;
+        }
+        
+        const AVCodecParameters* codecpar = format->streams[streamIndex]->codecpar;
+        const AVCodec* codec = avcodec_find_decoder(codecpar->codec_id);
+        decoder = codec ? avcodec_alloc_context3(codec) : nullptr;
+        packet = av_packet_alloc();
+        return decoder && packet &&
+               avcodec_parameters_to_context(decoder, codecpar) >= 0 &&
+               avcodec_open2(decoder, codec, nullptr) >= 0;
+    }
+    
+    bool next(AVFrame* frame) {
+        while (true) {
+            int ret = avcodec_receive_frame(decoder, frame);
+            if (ret >= 0) {
+                return true;
+            }
+            if (ret != AVERROR(EAGAIN)) {
+                return false;
+            }
+            
+            // Feed the next video packet, or flush at the end of the file
+            bool fed = false;
+            while (!flushed && !fed) {
+                if (av_read_frame(format, packet) < 0) {
+                    avcodec_send_packet(decoder, nullptr);
+                    flushed = true;
+                } else {
+                    if (packet->stream_index == streamIndex) {
+                        avcodec_send_packet(decoder, packet);
+                        fed = true;
+                    }
+                    av_packet_unref(packet);
+                }
+            }
+            if (!fed && !flushed) {
+                return false;
+            }
+        }
+    }
+
+private:
+    AVFormatContext* format = nullptr;
+    AVCodecContext* decoder = nullptr;
+    AVPacket* packet = nullptr;
+    int streamIndex = -1;
+    bool flushed = false;
+};
+
+// Luma PSNR of the output against the source scaled to the output size
+double measurePsnr(const std::string& sourcePath, const std::string& outputPath) {
+    FrameReader source;
+    FrameReader output;
+    if (!source.open(sourcePath) || !output.open(outputPath)) {
+        return 0.0;
+    }
+    
+    AVFrame* sourceFrame = av_frame_alloc();
+    AVFrame* outputFrame = av_frame_alloc();
+    SwsContext* sourceToGray = nullptr;
+    SwsContext* outputToGray = nullptr;
+    std::vector<uint8_t> sourceLuma;
+    std::vector<uint8_t> outputLuma;
+    double squaredError = 0.0;
+    double samples = 0.0;
+    
+    while (source.next(sourceFrame) && output.next(outputFrame)) {
+        int width = outputFrame->width;
+        int height = outputFrame->height;
+        sourceToGray = sws_getCachedContext(sourceToGray, sourceFrame->width, sourceFrame->height,
+                                            static_cast<AVPixelFormat>(sourceFrame->format),
+                                            width, height, AV_PIX_FMT_GRAY8,
+                                            SWS_BICUBIC, nullptr, nullptr, nullptr);
+        outputToGray = sws_getCachedContext(outputToGray, width, height,
+                                            static_cast<AVPixelFormat>(outputFrame->format),
+                                            width, height, AV_PIX_FMT_GRAY8,
+                                            SWS_POINT, nullptr, nullptr, nullptr);
+        if (!sourceToGray || !outputToGray) {
+            break;
+        }
+        
+        sourceLuma.resize(static_cast<size_t>(width) * height);
+        outputLuma.resize(sourceLuma.size());
+        uint8_t* sourcePlanes[4] = {sourceLuma.data(), nullptr, nullptr, nullptr};
+        uint8_t* outputPlanes[4] = {outputLuma.data(), nullptr, nullptr, nullptr};
+        int strides[4] = {width, 0, 0, 0};
+        sws_scale(sourceToGray, sourceFrame->data, sourceFrame->linesize, 0, sourceFrame->height,
+                  sourcePlanes, strides);
+        sws_scale(outputToGray, outputFrame->data, outputFrame->linesize, 0, height,
+                  outputPlanes, strides);
+        
+        for (size_t i = 0; i < sourceLuma.size(); i++) {
+            double difference = static_cast<double>(sourceLuma[i]) - outputLuma[i];
+            squaredError += difference * difference;
+        }
+        samples += sourceLuma.size();
+        av_frame_unref(sourceFrame);
+        av_frame_unref(outputFrame);
+    }
+    
+    sws_freeContext(sourceToGray);
+    sws_freeContext(outputToGray);
+    av_frame_free(&sourceFrame);
+    av_frame_free(&outputFrame);
+    
+    if (samples == 0.0) {
+        return 0.0;
+    }
+    if (squaredError == 0.0) {
+        return 100.0;
+    }
+    return 10.0 * std::log10(255.0 * 255.0 / (squaredError / samples));
+}
+
+// Run one transcode in a child process, so its timing is not disturbed by
+// earlier runs and wait4() reports the peak RSS of that run alone
+RunResult runIsolated(const std::string& inputPath, const std::string& outputPath,
+                      bool pipeline, bool streamCopy) {
+    RunResult result;
+    int fds[2];
+    if (pipe(fds) != 0) {
+        return result;
+    }
+    
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        VideoProcessor processor;
+        processor.setStreamCopy(streamCopy);
+        processor.setPipelineMode(pipeline);
+        
+        RunResult child;
+        auto start = std::chrono::steady_clock::now();
+        child.ok = processor.processVideo(inputPath, outputPath);
+        child.wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        child.stages = processor.getPipelineStats();
+        
+        ssize_t written = write(fds[1], &child, sizeof(child));
+        _exit(written == static_cast<ssize_t>(sizeof(child)) ? 0 : 1);
+    }
+    
+    close(fds[1]);
+    if (pid < 0) {
+        close(fds[0]);
+        return result;
+    }
+    
+    RunResult child;
+    ssize_t received = read(fds[0], &child, sizeof(child));
+    close(fds[0]);
+    
+    int status = 0;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0 &&
+        received == static_cast<ssize_t>(sizeof(child))) {
+        result = child;
+        result.peakRssKb = usage.ru_maxrss;
+    }
+    return result;
+}
+
+ModeResult benchmarkMode(const BenchCase& benchCase, const Options& options, const std::string& inputPath,
+                         bool pipeline) {
+    ModeResult mode;
+    mode.mode = pipeline ? "pipeline" : "serial";
+    std::string outputPath = options.workDirectory + "/" + benchCase.name + "_" + mode.mode + ".mp4";
+    
+    std::vector<RunResult> runs;
+    for (int i = 0; i < options.repeat; i++) {
+        RunResult run = runIsolated(inputPath, outputPath, pipeline, options.streamCopy);
+        if (!run.ok) {
+            return mode;
+        }
+        runs.push_back(run);
+    }
+    
+    // Median wall time is robust against a single noisy run
+    std::sort(runs.begin(), runs.end(), [](const RunResult& a, const RunResult& b) {
+        return a.wallSeconds < b.wallSeconds;
+    });
+    mode.median = runs[runs.size() / 2];
+    
+    double duration = static_cast<double>(options.frames) / FRAME_RATE;
+    mode.fps = options.frames / mode.median.wallSeconds;
+    mode.realtimeFactor = duration / mode.median.wallSeconds;
+    std::error_code error;
+    uint64_t outputBytes = fs::file_size(outputPath, error);
+    mode.bitrateKbps = error ? 0.0 : outputBytes * 8.0 / duration / 1000.0;
+    mode.psnr = measurePsnr(inputPath, outputPath);
+    return mode;
+}
+
+struct ScalerResult {
+    std::string mode;
+    std::string kernel;
+    bool ok = false;
+    double secondsPerFrame = 0.0;
+    double fps = 0.0;
+};
+
+// Time the scaler on frames already in memory: no decode, encode or muxing
+ScalerResult benchmarkScaler(const ScalerCase& scalerCase, ScaleQuality quality, const Options& options) {
+    ScalerResult result;
+    result.mode = scaleQualityName(quality);
+    
+    const int sourceCount = 4;
+    std::vector<AVFrame*> sources;
+    AVFrame* scaled = av_frame_alloc();
+    bool ready = scaled != nullptr;
+    for (int i = 0; ready && i < sourceCount; i++) {
+        AVFrame* source = av_frame_alloc();
+        sources.push_back(source);
+        ready = source != nullptr;
+        if (ready) {
+            source->format = AV_PIX_FMT_YUV420P;
+            source->width = scalerCase.srcWidth;
+            source->height = scalerCase.srcHeight;
+            ready = av_frame_get_buffer(source, 0) >= 0;
+        }
+        if (ready) {
+            fillPicture(source, i);
+        }
+    }
+    if (ready) {
+        scaled->format = AV_PIX_FMT_YUV420P;
+        scaled->width = scalerCase.dstWidth;
+        scaled->height = scalerCase.dstHeight;
+        ready = av_frame_get_buffer(scaled, 0) >= 0;
+    }
+    
+    Scaler scaler;
+    if (ready && scaler.init(scalerCase.srcWidth, scalerCase.srcHeight, AV_PIX_FMT_YUV420P,
+                             scalerCase.dstWidth, scalerCase.dstHeight, AV_PIX_FMT_YUV420P,
+                             quality, ThreadingPolicy::forHost().scalerThreads)) {
+        result.kernel = scaler.kernelName();
+        std::vector<double> runs;
+        for (int run = 0; run < options.repeat; run++) {
+            auto start = std::chrono::steady_clock::now();
+            for (int i = 0; i < options.frames; i++) {
+                scaler.scale(sources[i % sourceCount], scaled);
+            }
+            runs.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+        }
+        std::sort(runs.begin(), runs.end());
+        result.ok = true;
+        result.secondsPerFrame = runs[runs.size() / 2] / options.frames;
+        result.fps = result.secondsPerFrame > 0.0 ? 1.0 / result.secondsPerFrame : 0.0;
+    }
+    
+    for (AVFrame* source : sources) {
+        av_frame_free(&source);
+    }
+    av_frame_free(&scaled);
+    return result;
+}
+
+void writeStageJson(std::ostream& json, const char* name, const PipelineStageStats& stats) {
+    json << "\"" << name << "\":{\"busy_seconds\":" << stats.busySeconds
+         << ",\"stall_seconds\":" << stats.stallSeconds
+         << ",\"frames\":" << stats.frames << "}";
+}
+
+void writeResultJson(std::ostream& json, const BenchCase& benchCase, const ModeResult& mode) {
+    json << "    {\"case\":\"" << benchCase.name << "\",\"mode\":\"" << mode.mode << "\""
+         << ",\"ok\":" << (mode.median.ok ? "true" : "false")
+         << ",\"wall_seconds\":" << mode.median.wallSeconds
+         << ",\"fps\":" << mode.fps
+         << ",\"realtime_factor\":" << mode.realtimeFactor
+         << ",\"peak_rss_kb\":" << mode.median.peakRssKb
+         << ",\"bitrate_kbps\":" << mode.bitrateKbps
+         << ",\"psnr_y\":" << mode.psnr;
+    if (mode.mode == "pipeline") {
+        json << ",\"stages\":{";
+        writeStageJson(json, "decode", mode.median.stages.decode);
+        json << ",";
+        writeStageJson(json, "scale", mode.median.stages.scale);
+        json << ",";
+        writeStageJson(json, "encode", mode.median.stages.encode);
+        json << "}";
+    }
+    json << "}";
+}
+
+void writeScalerJson(std::ostream& json, const ScalerCase& scalerCase, const ScalerResult& result) {
+    json << "    {\"case\":\"" << scalerCase.name << "\",\"mode\":\"" << result.mode << "\""
+         << ",\"ok\":" << (result.ok ? "true" : "false")
+         << ",\"kernel\":\"" << result.kernel << "\""
+         << ",\"ms_per_frame\":" << result.secondsPerFrame * 1000.0
+         << ",\"fps\":" << result.fps << "}";
+}
+
+// Pull "fps" for a case and mode out of a baseline written by this tool.
+// The format is our own one-object-per-line layout, so no JSON parser is needed.
+bool baselineFps(const std::string& baseline, const std::string& caseName, const std::string& mode, double& fps) {
+    std::istringstream lines(baseline);
+    std::string line;
+    std::string caseKey = "\"case\":\"" + caseName + "\"";
+    std::string modeKey = "\"mode\":\"" + mode + "\"";
+    while (std::getline(lines, line)) {
+        size_t fpsPos = line.find("\"fps\":");
+        if (line.find(caseKey) != std::string::npos && line.find(modeKey) != std::string::npos &&
+            fpsPos != std::string::npos) {
+            fps = std::atof(line.c_str() + fpsPos + 6);
+            return true;
+        }
+    }
+    return false;
+}
+
+void printUsage(const char* program) {
+    std::cout << "Usage: " << program << " [options]" << std::endl;
+    std::cout << "Options:" << std::endl;
+    std::cout << "  --frames <n>        frames per synthetic input (default 120)" << std::endl;
+    std::cout << "  --repeat <n>        timed runs per case and mode, median is reported (default 3)" << std::endl;
+    std::cout << "  --case <substring>  only run cases whose name contains it" << std::endl;
+    std::cout << "  --stream-copy       allow video stream copy (AAC audio is always remuxed)" << std::endl;
+    std::cout << "  --scaler            time the scaler alone for each quality instead of transcodes" << std::endl;
+    std::cout << "  --work-dir <dir>    where inputs and outputs are written (default bench_media)" << std::endl;
+    std::cout << "  --output <file>     JSON results (default bench.json)" << std::endl;
+    std::cout << "  --baseline <file>   compare fps against an earlier results file" << std::endl;
+    std::cout << "  --tolerance <pct>   allowed fps drop against the baseline (default 10)" << std::endl;
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    Options options;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--frames" && hasValue) {
+            options.frames = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--repeat" && hasValue) {
+            options.repeat = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--case" && hasValue) {
+            options.filter = argv[++i];
+        } else if (arg == "--stream-copy") {
+            options.streamCopy = true;
+        } else if (arg == "--scaler") {
+            options.scalerOnly = true;
+        } else if (arg == "--work-dir" && hasValue) {
+            options.workDirectory = argv[++i];
+        } else if (arg == "--output" && hasValue) {
+            options.outputPath = argv[++i];
+        } else if (arg == "--baseline" && hasValue) {
+            options.baselinePath = argv[++i];
+        } else if (arg == "--tolerance" && hasValue) {
+            options.tolerancePercent = std::atof(argv[++i]);
+        } else {
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+    
+    fs::create_directories(options.workDirectory);
+    
+    std::string baseline;
+    if (!options.baselinePath.empty()) {
+        std::ifstream baselineFile(options.baselinePath);
+        if (!baselineFile) {
+            std::cerr << "Could not read baseline " << options.baselinePath << std::endl;
+            return 1;
+        }
+        std::stringstream contents;
+        contents << baselineFile.rdbuf();
+        baseline = contents.str();
+    }
+    
+    std::ostringstream json;
+    json << "{\n  \"ffmpeg\":\"" << av_version_info() << "\",\n"
+         << "  \"frames\":" << options.frames << ",\n"
+         << "  \"repeat\":" << options.repeat << ",\n"
+         << "  \"results\":[\n";
+    
+    bool first = true;
+    int regressions = 0;
+    auto compareToBaseline = [&](const std::string& caseName, const std::string& mode, double fps) {
+        double previous = 0.0;
+        if (!baseline.empty() && baselineFps(baseline, caseName, mode, previous) && previous > 0.0) {
+            double change = (fps - previous) / previous * 100.0;
+            std::cout << "  vs baseline: " << previous << " fps (" << (change >= 0 ? "+" : "")
+                      << change << "%)" << std::endl;
+            if (change < -options.tolerancePercent) {
+                std::cout << "  REGRESSION" << std::endl;
+                regressions++;
+            }
+        }
+    };
+    
+    for (const ScalerCase& scalerCase : SCALER_CASES) {
+        if (!options.scalerOnly ||
+            (!options.filter.empty() && scalerCase.name.find(options.filter) == std::string::npos)) {
+            continue;
+        }
+        
+        for (ScaleQuality quality : {ScaleQuality::Fast, ScaleQuality::Bilinear, ScaleQuality::Lanczos}) {
+            ScalerResult result = benchmarkScaler(scalerCase, quality, options);
+            
+            json << (first ? "" : ",\n");
+            writeScalerJson(json, scalerCase, result);
+            first = false;
+            
+            if (!result.ok) {
+                std::cout << scalerCase.name << " [" << result.mode << "]: failed" << std::endl;
+                regressions++;
+                continue;
+            }
+            
+            std::cout << scalerCase.name << " [" << result.mode << "]: " << result.kernel << ", "
+                      << result.secondsPerFrame * 1000.0 << " ms/frame, " << result.fps << " fps" << std::endl;
+            compareToBaseline(scalerCase.name, result.mode, result.fps);
+        }
+    }
+    
+    for (const BenchCase& benchCase : BENCH_CASES) {
+        if (options.scalerOnly ||
+            (!options.filter.empty() && benchCase.name.find(options.filter) == std::string::npos)) {
+            continue;
+        }
+        
+        std::string inputPath = options.workDirectory + "/" + benchCase.name + "." + benchCase.container;
+        if (!generateInput(benchCase, options.frames, inputPath)) {
+            std::cout << benchCase.name << ": skipped, could not generate input" << std::endl;
+            continue;
+        }
+        
+        for (bool pipeline : {false, true}) {
+            ModeResult mode = benchmarkMode(benchCase, options, inputPath, pipeline);
+            
+            json << (first ? "" : ",\n");
+            writeResultJson(json, benchCase, mode);
+            first = false;
+            
+            if (!mode.median.ok) {
+                std::cout << benchCase.name << " [" << mode.mode << "]: failed" << std::endl;
+                regressions++;
+                continue;
+            }
+            
+            std::cout << benchCase.name << " [" << mode.mode << "]: "
+                      << mode.fps << " fps, " << mode.realtimeFactor << "x realtime, "
+                      << mode.median.peakRssKb / 1024 << " MB peak RSS, "
+                      << mode.bitrateKbps << " kbps, PSNR-Y " << mode.psnr << " dB" << std::endl;
+            compareToBaseline(benchCase.name, mode.mode, mode.fps);
+        }
+    }
+    json << "\n  ]\n}\n";
+    
+    std::ofstream output(options.outputPath);
+    output << json.str();
+    if (!output) {
+        std::cerr << "Could not write " << options.outputPath << std::endl;
+        return 1;
+    }
+    std::cout << "Results written to " << options.outputPath << std::endl;
+    
+    return regressions > 0 ? 2 : 0;
+}
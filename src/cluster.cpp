@@ -0,0 +1,645 @@
+#include "cluster.hpp"
+#include "tsv_fields.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+constexpr std::chrono::seconds HEARTBEAT_INTERVAL{2};
+constexpr std::chrono::seconds RECONNECT_DELAY{2};
+// How often a waiting caller checks its cancel flag
+constexpr std::chrono::milliseconds CANCEL_POLL{200};
+constexpr int LISTEN_BACKLOG = 64;
+
+bool sendFields(int fd, const std::vector<std::string>& fields) {
+    std::string line;
+    for (size_t i = 0; i < fields.size(); i++) {
+        line += (i > 0 ? "\t" : "") + escapeField(fields[i]);
+    }
+    line += "\n";
+    
+    size_t sent = 0;
+    while (sent < line.size()) {
+        // A peer that went away must not kill the process with SIGPIPE
+        ssize_t n = send(fd, line.data() + sent, line.size() - sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        sent += static_cast<size_t>(n);
+    }
+    return true;
+}
+
+// Reads newline-terminated messages from a socket
+class LineReader {
+public:
+    explicit LineReader(int fd) : fd(fd) {}
+    
+    // False once the peer closes the connection or it fails
+    bool next(std::vector<std::string>& fields) {
+        while (true) {
+            size_t end = buffer.find('\n');
+            if (end != std::string::npos) {
+                fields = splitFields(buffer.substr(0, end));
+                buffer.erase(0, end + 1);
+                return true;
+            }
+            char chunk[4096];
+            ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                return false;
+            }
+            buffer.append(chunk, static_cast<size_t>(n));
+        }
+    }
+
+private:
+    int fd;
+    std::string buffer;
+};
+
+// clip.part.mp4 -> clip.part.attempt2.mp4, keeping the extension the muxer is picked by
+std::string attemptPath(const std::string& path, size_t attempt) {
+    fs::path original(path);
+    std::string name = original.stem().string() + ".attempt" + std::to_string(attempt) +
+                       original.extension().string();
+    return (original.parent_path() / name).string();
+}
+
+std::string absolutePath(const std::string& path) {
+    std::error_code error;
+    fs::path absolute = fs::absolute(path, error);
+    return error ? path : absolute.string();
+}
+
+int connectTo(const std::string& host, const std::string& port) {
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* addresses = nullptr;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &addresses) != 0) {
+        return -1;
+    }
+    int fd = -1;
+    for (addrinfo* address = addresses; address && fd < 0; address = address->ai_next) {
+        fd = socket(address->ai_family, address->ai_socktype | SOCK_CLOEXEC, address->ai_protocol);
+        if (fd >= 0 && connect(fd, address->ai_addr, address->ai_addrlen) != 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(addresses);
+    return fd;
+}
+
+bool isLoopback(const sockaddr* address) {
+    if (address->sa_family == AF_INET) {
+        return (ntohl(reinterpret_cast<const sockaddr_in*>(address)->sin_addr.s_addr) >> 24) == 127;
+    }
+    return address->sa_family == AF_INET6 &&
+           IN6_IS_ADDR_LOOPBACK(&reinterpret_cast<const sockaddr_in6*>(address)->sin6_addr);
+}
+
+// Takes as long whatever the first difference, so timing does not give the token away
+bool sameToken(const std::string& given, const std::string& expected) {
+    unsigned char difference = given.size() == expected.size() ? 0 : 1;
+    for (size_t i = 0; i < expected.size(); i++) {
+        difference |= static_cast<unsigned char>(expected[i] ^ (i < given.size() ? given[i] : 0));
+    }
+    return difference == 0;
+}
+
+} // namespace
+
+std::string clusterToken() {
+    const char* token = std::getenv(CLUSTER_TOKEN_VARIABLE);
+    return token ? token : "";
+}
+
+Coordinator::~Coordinator() {
+    if (listenFd < 0) {
+        return;
+    }
+    stopping = true;
+    // Wakes the blocked accept()
+    shutdown(listenFd, SHUT_RDWR);
+    acceptor.join();
+    close(listenFd);
+    
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto& entry : workers) {
+            dropWorker(entry.second.get());
+        }
+        // Whatever is still waiting runs locally, if anyone is left to run it
+        for (const auto& task : queued) {
+            finishTask(task, RemoteResult::Unavailable);
+        }
+        queued.clear();
+    }
+    changed.notify_all();
+    monitor.join();
+    for (auto& entry : workers) {
+        if (entry.second->reader.joinable()) {
+            entry.second->reader.join();
+        }
+        close(entry.second->fd);
+    }
+}
+
+bool Coordinator::start(const std::string& listenAddress, const std::string& token) {
+    // A bare port listens on loopback only
+    size_t colon = listenAddress.rfind(':');
+    std::string host = colon == std::string::npos ? "127.0.0.1" : listenAddress.substr(0, colon);
+    std::string port = colon == std::string::npos ? listenAddress : listenAddress.substr(colon + 1);
+    // [::1]:7000 names an IPv6 address
+    if (host.size() > 1 && host.front() == '[' && host.back() == ']') {
+        host = host.substr(1, host.size() - 2);
+    }
+    this->token = token;
+    
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    addrinfo* addresses = nullptr;
+    if (port.empty() || getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &addresses) != 0) {
+        std::cerr << "Expected the coordinator address as [host:]port, got " << listenAddress << std::endl;
+        return false;
+    }
+    for (addrinfo* address = addresses; address && listenFd < 0; address = address->ai_next) {
+        // Anyone who can connect is given absolute paths and runs transcodes
+        if (token.empty() && !isLoopback(address->ai_addr)) {
+            std::cerr << "Set " << CLUSTER_TOKEN_VARIABLE << " to accept workers from other hosts on "
+                      << listenAddress << std::endl;
+            break;
+        }
+        listenFd = socket(address->ai_family, address->ai_socktype | SOCK_CLOEXEC, address->ai_protocol);
+        if (listenFd < 0) {
+            continue;
+        }
+        int reuse = 1;
+        setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        if (bind(listenFd, address->ai_addr, address->ai_addrlen) != 0 || listen(listenFd, LISTEN_BACKLOG) != 0) {
+            std::cerr << "Could not listen for workers on " << listenAddress << ": " << strerror(errno) << std::endl;
+            close(listenFd);
+            listenFd = -1;
+        }
+    }
+    freeaddrinfo(addresses);
+    if (listenFd < 0) {
+        return false;
+    }
+    
+    acceptor = std::thread(&Coordinator::acceptLoop, this);
+    monitor = std::thread(&Coordinator::monitorLoop, this);
+    return true;
+}
+
+int Coordinator::capacity() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    int slots = 0;
+    for (const auto& entry : workers) {
+        if (entry.second->alive) {
+            slots += entry.second->slots;
+        }
+    }
+    return slots;
+}
+
+bool Coordinator::waitForWorkers(std::chrono::seconds timeout) {
+    std::unique_lock<std::mutex> lock(mutex);
+    return changed.wait_for(lock, timeout, [this]() { return hasCapacity(); });
+}
+
+bool Coordinator::hasCapacity() const {
+    for (const auto& entry : workers) {
+        if (entry.second->alive && entry.second->slots > 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+RemoteResult Coordinator::runJob(const std::string& inputPath, const std::string& outputPath,
+                                 const std::string& settings, const std::atomic<bool>* cancelFlag) {
+    auto task = std::make_shared<Task>();
+    task->kind = "job";
+    task->inputPath = absolutePath(inputPath);
+    task->outputPath = absolutePath(outputPath);
+    task->settings = settings;
+    return run(task, cancelFlag);
+}
+
+RemoteResult Coordinator::runSegment(const SegmentTask& segment, const std::atomic<bool>* cancelFlag) {
+    auto task = std::make_shared<Task>();
+    task->kind = "segment";
+    task->inputPath = absolutePath(segment.inputPath);
+    task->outputPath = absolutePath(segment.spoolPath);
+    task->startPts = segment.startPts;
+    task->endPts = segment.endPts;
+    task->settings = segment.settings;
+    return run(task, cancelFlag);
+}
+
+SegmentRunner Coordinator::segmentRunner() {
+    return [this](const SegmentTask& task, const std::atomic<bool>* cancelFlag) {
+        return runSegment(task, cancelFlag);
+    };
+}
+
+RemoteResult Coordinator::run(std::shared_ptr<Task> task, const std::atomic<bool>* cancelFlag) {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (stopping || !hasCapacity()) {
+        return RemoteResult::Unavailable;
+    }
+    task->id = nextTaskId++;
+    task->idleSince = Clock::now();
+    queued.push_back(task);
+    assignTasks();
+    
+    while (!task->finished) {
+        if (cancelFlag && cancelFlag->load()) {
+            auto it = workers.find(task->workerId);
+            if (task->workerId != 0 && it != workers.end()) {
+                sendFields(it->second->fd, {"CANCEL", std::to_string(task->id)});
+                it->second->running--;
+            }
+            assigned.erase(task->id);
+            queued.erase(std::remove(queued.begin(), queued.end(), task), queued.end());
+            finishTask(task, RemoteResult::Failed);
+            assignTasks();
+            break;
+        }
+        changed.wait_for(lock, CANCEL_POLL);
+    }
+    return task->result;
+}
+
+void Coordinator::assignTasks() {
+    while (!queued.empty()) {
+        // Least busy for its size first, then least loaded host
+        Worker* best = nullptr;
+        double bestScore = 0.0;
+        for (auto& entry : workers) {
+            Worker* worker = entry.second.get();
+            if (!worker->alive || worker->running >= worker->slots) {
+                continue;
+            }
+            double score = static_cast<double>(worker->running) / worker->slots + worker->load;
+            if (!best || score < bestScore) {
+                best = worker;
+                bestScore = score;
+            }
+        }
+        if (!best) {
+            return;
+        }
+        
+        std::shared_ptr<Task> task = queued.front();
+        queued.pop_front();
+        if (task->attemptPaths.size() >= static_cast<size_t>(MAX_ATTEMPTS)) {
+            std::cerr << "Giving up on cluster task " << task->id << " after " << MAX_ATTEMPTS
+                      << " attempts" << std::endl;
+            finishTask(task, RemoteResult::Failed);
+            continue;
+        }
+        
+        std::string output = attemptPath(task->outputPath, task->attemptPaths.size() + 1);
+        std::vector<std::string> message = {"RUN", std::to_string(task->id), task->kind, task->inputPath, output};
+        if (task->kind == "segment") {
+            message.push_back(std::to_string(task->startPts));
+            message.push_back(std::to_string(task->endPts));
+        }
+        message.push_back(task->settings);
+        if (!sendFields(best->fd, message)) {
+            queued.push_front(task);
+            dropWorker(best);
+            continue;
+        }
+        
+        task->attemptPaths.push_back(output);
+        task->workerId = best->id;
+        best->running++;
+        assigned[task->id] = task;
+    }
+}
+
+void Coordinator::dropWorker(Worker* worker) {
+    if (!worker->alive) {
+        return;
+    }
+    worker->alive = false;
+    // Ends its reader; a worker that is still running sees the connection
+    // drop and cancels what it was doing
+    shutdown(worker->fd, SHUT_RDWR);
+    if (worker->slots > 0) {
+        std::cerr << "Lost cluster worker " << worker->name << std::endl;
+    }
+    
+    for (auto it = assigned.begin(); it != assigned.end();) {
+        std::shared_ptr<Task> task = it->second;
+        if (task->workerId == worker->id) {
+            task->workerId = 0;
+            task->idleSince = Clock::now();
+            queued.push_front(task);
+            it = assigned.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    changed.notify_all();
+}
+
+void Coordinator::finishTask(const std::shared_ptr<Task>& task, RemoteResult result) {
+    if (result == RemoteResult::Succeeded &&
+        std::rename(task->attemptPaths.back().c_str(), task->outputPath.c_str()) != 0) {
+        std::cerr << "Could not move cluster output into place: " << task->outputPath << std::endl;
+        result = RemoteResult::Failed;
+    }
+    // Earlier attempts, and this one unless it was moved
+    for (const std::string& path : task->attemptPaths) {
+        std::remove(path.c_str());
+    }
+    task->finished = true;
+    task->result = result;
+    changed.notify_all();
+}
+
+void Coordinator::acceptLoop() {
+    while (!stopping) {
+        int fd = accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            // Shut down, or out of descriptors; either way stop taking workers
+            if (!stopping) {
+                std::cerr << "Coordinator stopped accepting workers: " << strerror(errno) << std::endl;
+            }
+            return;
+        }
+        
+        std::lock_guard<std::mutex> lock(mutex);
+        auto worker = std::make_unique<Worker>();
+        worker->id = nextWorkerId++;
+        worker->fd = fd;
+        worker->lastSeen = Clock::now();
+        Worker* added = worker.get();
+        workers[added->id] = std::move(worker);
+        added->reader = std::thread(&Coordinator::readLoop, this, added);
+    }
+}
+
+void Coordinator::readLoop(Worker* worker) {
+    LineReader reader(worker->fd);
+    std::vector<std::string> fields;
+    while (reader.next(fields)) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!worker->alive) {
+            return;
+        }
+        // Nothing counts before a HELLO with the right token
+        bool hello = fields[0] == "HELLO" && (fields.size() == 3 || fields.size() == 4);
+        if (worker->slots == 0 && !hello) {
+            break;
+        }
+        if (hello && !token.empty() && (fields.size() < 4 || !sameToken(fields[3], token))) {
+            std::cerr << "Cluster worker " << fields[1] << " sent the wrong token, disconnecting" << std::endl;
+            break;
+        }
+        worker->lastSeen = Clock::now();
+        
+        if (hello) {
+            worker->name = fields[1];
+            worker->slots = std::max(1, std::atoi(fields[2].c_str()));
+            std::cout << "Cluster worker " << worker->name << " joined with " << worker->slots
+                      << " slots" << std::endl;
+            changed.notify_all();
+            assignTasks();
+        } else if (fields[0] == "HEARTBEAT" && fields.size() == 3) {
+            worker->load = std::atof(fields[2].c_str());
+        } else if (fields[0] == "DONE" && fields.size() == 3) {
+            auto it = assigned.find(std::strtoull(fields[1].c_str(), nullptr, 10));
+            // Tasks taken away from this worker are someone else's now
+            if (it != assigned.end() && it->second->workerId == worker->id) {
+                std::shared_ptr<Task> task = it->second;
+                assigned.erase(it);
+                worker->running--;
+                finishTask(task, fields[2] == "1" ? RemoteResult::Succeeded : RemoteResult::Failed);
+                assignTasks();
+            }
+        }
+    }
+    
+    std::lock_guard<std::mutex> lock(mutex);
+    dropWorker(worker);
+    assignTasks();
+}
+
+void Coordinator::monitorLoop() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!stopping) {
+        changed.wait_for(lock, std::chrono::seconds(1));
+        auto now = Clock::now();
+        
+        for (auto& entry : workers) {
+            if (entry.second->alive && now - entry.second->lastSeen > HEARTBEAT_TIMEOUT) {
+                dropWorker(entry.second.get());
+            }
+        }
+        // With nobody left to run them, callers get their tasks back
+        if (!hasCapacity()) {
+            for (auto it = queued.begin(); it != queued.end();) {
+                if (now - (*it)->idleSince > WORKER_WAIT) {
+                    finishTask(*it, RemoteResult::Unavailable);
+                    it = queued.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+        }
+        assignTasks();
+        
+        // Join readers of dropped workers without holding the lock they exit through
+        std::vector<std::unique_ptr<Worker>> dropped;
+        for (auto it = workers.begin(); it != workers.end();) {
+            if (!it->second->alive && !stopping) {
+                dropped.push_back(std::move(it->second));
+                it = workers.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        if (!dropped.empty()) {
+            lock.unlock();
+            for (auto& worker : dropped) {
+                worker->reader.join();
+                close(worker->fd);
+            }
+            lock.lock();
+        }
+    }
+}
+
+int runClusterWorker(const std::string& address, int slots, const std::string& token,
+                     const std::function<void(VideoProcessor& processor)>& configure) {
+    size_t colon = address.rfind(':');
+    if (colon == std::string::npos || colon + 1 == address.size()) {
+        std::cerr << "Expected the coordinator as host:port, got " << address << std::endl;
+        return 1;
+    }
+    std::string host = address.substr(0, colon);
+    std::string port = address.substr(colon + 1);
+    slots = std::max(1, slots);
+    
+    char hostname[256] = {};
+    gethostname(hostname, sizeof(hostname) - 1);
+    std::string name = std::string(hostname) + ":" + std::to_string(getpid());
+    
+    bool connectedBefore = false;
+    while (true) {
+        int fd = connectTo(host, port);
+        if (fd < 0) {
+            if (connectedBefore) {
+                std::cerr << "Could not reach coordinator at " << address << ", retrying" << std::endl;
+                connectedBefore = false;
+            }
+            std::this_thread::sleep_for(RECONNECT_DELAY);
+            continue;
+        }
+        connectedBefore = true;
+        std::cout << "Connected to coordinator at " << address << " with " << slots << " slots" << std::endl;
+        
+        std::mutex writeMutex;
+        auto send = [&](const std::vector<std::string>& fields) {
+            std::lock_guard<std::mutex> lock(writeMutex);
+            return sendFields(fd, fields);
+        };
+        
+        struct RunningTask {
+            std::thread thread;
+            std::shared_ptr<std::atomic<bool>> cancel;
+            std::shared_ptr<std::atomic<bool>> done;
+        };
+        std::map<std::string, RunningTask> tasks;
+        std::atomic<int> running(0);
+        
+        // Heartbeats carry the load average per core, for placement
+        std::mutex heartbeatMutex;
+        std::condition_variable heartbeatWake;
+        bool connected = true;
+        std::thread heartbeat([&]() {
+            std::unique_lock<std::mutex> lock(heartbeatMutex);
+            while (connected) {
+                double load = 0.0;
+                getloadavg(&load, 1);
+                load /= ThreadingPolicy::hostCores();
+                lock.unlock();
+                bool sent = send({"HEARTBEAT", std::to_string(running.load()), std::to_string(load)});
+                lock.lock();
+                if (!sent) {
+                    break;
+                }
+                heartbeatWake.wait_for(lock, HEARTBEAT_INTERVAL);
+            }
+        });
+        
+        send({"HELLO", name, std::to_string(slots), token});
+        LineReader reader(fd);
+        std::vector<std::string> fields;
+        while (reader.next(fields)) {
+            // Reap tasks that have finished
+            for (auto it = tasks.begin(); it != tasks.end();) {
+                if (it->second.done->load()) {
+                    it->second.thread.join();
+                    it = tasks.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+            
+            if (fields[0] == "CANCEL" && fields.size() == 2) {
+                auto it = tasks.find(fields[1]);
+                if (it != tasks.end()) {
+                    *it->second.cancel = true;
+                }
+                continue;
+            }
+            bool isJob = fields.size() == 6 && fields[0] == "RUN" && fields[2] == "job";
+            bool isSegment = fields.size() == 8 && fields[0] == "RUN" && fields[2] == "segment";
+            if (!isJob && !isSegment) {
+                continue;
+            }
+            
+            RunningTask task;
+            task.cancel = std::make_shared<std::atomic<bool>>(false);
+            task.done = std::make_shared<std::atomic<bool>>(false);
+            running++;
+            task.thread = std::thread([&, fields, isJob, cancel = task.cancel, done = task.done]() {
+                VideoProcessor processor;
+                if (configure) {
+                    configure(processor);
+                }
+                processor.setThreadingPolicy(ThreadingPolicy::forHost(slots));
+                processor.setCancelFlag(cancel.get());
+                
+                bool processed;
+                if (isJob) {
+                    processed = processor.importSettings(fields[5]) && processor.processVideo(fields[3], fields[4]);
+                } else {
+                    SegmentTask segment;
+                    segment.inputPath = fields[3];
+                    segment.spoolPath = fields[4];
+                    segment.startPts = std::strtoll(fields[5].c_str(), nullptr, 10);
+                    segment.endPts = std::strtoll(fields[6].c_str(), nullptr, 10);
+                    segment.settings = fields[7];
+                    processed = processor.processSegment(segment);
+                }
+                if (!*cancel) {
+                    send({"DONE", fields[1], processed ? "1" : "0"});
+                }
+                running--;
+                *done = true;
+            });
+            tasks[fields[1]] = std::move(task);
+        }
+        
+        // The coordinator hands this work to someone else, so stop it
+        std::cerr << "Lost connection to coordinator" << std::endl;
+        shutdown(fd, SHUT_RDWR);
+        for (auto& entry : tasks) {
+            *entry.second.cancel = true;
+        }
+        for (auto& entry : tasks) {
+            entry.second.thread.join();
+        }
+        {
+            std::lock_guard<std::mutex> lock(heartbeatMutex);
+            connected = false;
+        }
+        heartbeatWake.notify_all();
+        heartbeat.join();
+        close(fd);
+        std::this_thread::sleep_for(RECONNECT_DELAY);
+    }
+}
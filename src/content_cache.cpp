@@ -0,0 +1,206 @@
+#include "content_cache.hpp"
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <system_error>
+#include <unistd.h>
+
+extern "C" {
+#include <libavutil/hash.h>
+}
+
+namespace fs = std::filesystem;
+
+ContentHasher::ContentHasher() {
+    // SHA-256 rather than a faster non-cryptographic hash: keys come from
+    // untrusted uploads, and a collision would serve one client another's output
+    if (av_hash_alloc(&context, "SHA256") < 0) {
+        context = nullptr;
+        return;
+    }
+    av_hash_init(context);
+}
+
+ContentHasher::~ContentHasher() {
+    if (context) {
+        av_hash_freep(&context);
+    }
+}
+
+void ContentHasher::update(const char* data, size_t size) {
+    if (context) {
+        av_hash_update(context, reinterpret_cast<const uint8_t*>(data), size);
+    }
+}
+
+std::string ContentHasher::finishHex() {
+    if (!context) {
+        return "";
+    }
+    uint8_t hex[2 * AV_HASH_MAX_SIZE + 1];
+    av_hash_final_hex(context, hex, sizeof(hex));
+    return reinterpret_cast<const char*>(hex);
+}
+
+std::string ContentHasher::hashHex(const std::string& data) {
+    ContentHasher hasher;
+    hasher.update(data.data(), data.size());
+    return hasher.finishHex();
+}
+
+ResultCache::ResultCache(std::string directory, std::string indexPath, uint64_t maxBytes)
+    : directory(std::move(directory)), indexPath(std::move(indexPath)), maxBytes(maxBytes) {
+    fs::create_directories(this->directory);
+    load();
+}
+
+ResultCache::~ResultCache() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (indexDirty) {
+        save();
+    }
+}
+
+std::string ResultCache::makeKey(const std::string& contentHash, const std::string& outputSignature) {
+    return ContentHasher::hashHex(contentHash + "|" + outputSignature);
+}
+
+std::string ResultCache::pathFor(const std::string& key) const {
+    return directory + "/" + key + ".mp4";
+}
+
+bool ResultCache::lookup(const std::string& key, std::string& outputPath) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = entries.find(key);
+    if (it == entries.end()) {
+        return false;
+    }
+    
+    // Deleted behind our back; load() skips it too, so this need not be saved now
+    if (!fs::exists(pathFor(key))) {
+        usedBytes -= it->second.size;
+        entries.erase(it);
+        indexDirty = true;
+        return false;
+    }
+    
+    // Recency stays in memory until the next save, so a hit does not cost a rewrite
+    it->second.lastUsed = nextUse++;
+    indexDirty = true;
+    if (std::chrono::steady_clock::now() - lastSave >= INDEX_SAVE_INTERVAL) {
+        save();
+    }
+    outputPath = pathFor(key);
+    return true;
+}
+
+bool ResultCache::insert(const std::string& key, const std::string& finishedPath) {
+    std::error_code error;
+    uint64_t size = fs::file_size(finishedPath, error);
+    if (error) {
+        std::cerr << "Could not stat cache output " << finishedPath << ": " << error.message() << std::endl;
+        return false;
+    }
+    
+    std::lock_guard<std::mutex> lock(mutex);
+    fs::rename(finishedPath, pathFor(key), error);
+    if (error) {
+        std::cerr << "Could not move output into cache: " << error.message() << std::endl;
+        return false;
+    }
+    
+    auto it = entries.find(key);
+    if (it != entries.end()) {
+        usedBytes -= it->second.size;
+    }
+    Entry& entry = entries[key];
+    entry.size = size;
+    entry.lastUsed = nextUse++;
+    usedBytes += size;
+    
+    evict();
+    save();
+    return true;
+}
+
+uint64_t ResultCache::totalBytes() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return usedBytes;
+}
+
+void ResultCache::evict() {
+    while (usedBytes > maxBytes && entries.size() > 1) {
+        auto oldest = entries.begin();
+        for (auto it = entries.begin(); it != entries.end(); ++it) {
+            if (it->second.lastUsed < oldest->second.lastUsed) {
+                oldest = it;
+            }
+        }
+        
+        std::error_code error;
+        fs::remove(pathFor(oldest->first), error);
+        usedBytes -= oldest->second.size;
+        entries.erase(oldest);
+    }
+}
+
+void ResultCache::load() {
+    std::ifstream index(indexPath);
+    std::string line;
+    while (std::getline(index, line)) {
+        std::istringstream fields(line);
+        std::string key;
+        Entry entry;
+        if (!(fields >> key >> entry.size >> entry.lastUsed)) {
+            continue;
+        }
+        
+        // Skip entries whose output is gone
+        std::error_code error;
+        uint64_t size = fs::file_size(pathFor(key), error);
+        if (error) {
+            continue;
+        }
+        entry.size = size;
+        entries[key] = entry;
+        usedBytes += size;
+        if (entry.lastUsed >= nextUse) {
+            nextUse = entry.lastUsed + 1;
+        }
+    }
+    evict();
+}
+
+void ResultCache::save() {
+    lastSave = std::chrono::steady_clock::now();
+    indexDirty = false;
+    
+    // Write a new index, synced, and swap it in so a crash never leaves a
+    // torn or empty file
+    std::string tempPath = indexPath + ".tmp";
+    FILE* index = fopen(tempPath.c_str(), "w");
+    if (!index) {
+        std::cerr << "Could not write cache index" << std::endl;
+        return;
+    }
+    bool ok = true;
+    for (const auto& entry : entries) {
+        ok = ok && fprintf(index, "%s\t%llu\t%llu\n", entry.first.c_str(),
+                           static_cast<unsigned long long>(entry.second.size),
+                           static_cast<unsigned long long>(entry.second.lastUsed)) > 0;
+    }
+    ok = ok && fflush(index) == 0 && fsync(fileno(index)) == 0;
+    if (fclose(index) != 0 || !ok) {
+        std::cerr << "Could not write cache index" << std::endl;
+        std::remove(tempPath.c_str());
+        return;
+    }
+    
+    std::error_code error;
+    fs::rename(tempPath, indexPath, error);
+    if (error) {
+        std::cerr << "Could not replace cache index: " << error.message() << std::endl;
+    }
+}
@@ -0,0 +1,178 @@
+#include "encoder_tuning.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <system_error>
+#include <unistd.h>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavutil/opt.h>
+}
+
+namespace fs = std::filesystem;
+
+namespace {
+
+// Nearest common height at or above the given one, so 1072p and 1080p
+// sources share a tuning result
+int resolutionClass(int height) {
+    static const int classes[] = {240, 360, 480, 720, 1080, 1440, 2160};
+    for (int resolution : classes) {
+        if (height <= resolution) {
+            return resolution;
+        }
+    }
+    return 4320;
+}
+
+} // namespace
+
+bool encoderAvailable(const std::string& codec) {
+    return avcodec_find_encoder_by_name(codec.c_str()) != nullptr;
+}
+
+void applyEncoderSettings(AVCodecContext* context, const EncoderSettings& settings) {
+    av_opt_set(context->priv_data, "preset", settings.preset.c_str(), 0);
+    if (!settings.tune.empty() && settings.codec != "libsvtav1") {
+        av_opt_set(context->priv_data, "tune", settings.tune.c_str(), 0);
+    }
+    
+    // Older SVT-AV1 wrappers only take a constant QP
+    if (av_opt_set_int(context->priv_data, "crf", settings.crf, 0) < 0 && settings.codec == "libsvtav1") {
+        av_opt_set_int(context->priv_data, "qp", settings.crf, 0);
+    }
+    
+    if (settings.codec == "libx265") {
+        av_opt_set(context->priv_data, "x265-params", "log-level=error", 0);
+    }
+}
+
+std::vector<EncoderSettings> tuningCandidates(const std::string& codec, int referenceCrf) {
+    std::vector<std::string> presets;
+    int crf = referenceCrf;
+    if (codec == "libx265") {
+        presets = {"ultrafast", "superfast", "veryfast", "faster", "fast", "medium"};
+        // x265 reaches x264's quality about 5 CRF steps higher
+        crf = std::min(51, referenceCrf + 5);
+    } else if (codec == "libsvtav1") {
+        presets = {"12", "10", "8", "6", "4"};
+        // SVT-AV1 uses a 0-63 scale
+        crf = std::min(63, referenceCrf + 17);
+    } else {
+        presets = {"ultrafast", "superfast", "veryfast", "faster", "fast", "medium", "slow"};
+    }
+    
+    // No zerolatency: the tuned presets may use lookahead and B-frames,
+    // which is where the slower presets win their compression
+    std::vector<EncoderSettings> candidates;
+    for (const std::string& preset : presets) {
+        EncoderSettings settings;
+        settings.codec = codec;
+        settings.preset = preset;
+        settings.tune = "";
+        settings.crf = crf;
+        candidates.push_back(settings);
+    }
+    return candidates;
+}
+
+EncoderTuningCache::EncoderTuningCache(std::string indexPath) : indexPath(std::move(indexPath)) {
+    load();
+}
+
+std::string EncoderTuningCache::makeKey(const std::string& codec, int referenceCrf, int sourceHeight,
+                                        int outputHeight, double frameRate, int encoderThreads,
+                                        double realtimeFactor) {
+    std::ostringstream key;
+    key << codec << "/crf" << referenceCrf
+        << "/" << resolutionClass(sourceHeight) << "p-" << resolutionClass(outputHeight) << "p"
+        << "/" << std::lround(frameRate) << "fps"
+        << "/t" << encoderThreads
+        << "/rt" << std::lround(realtimeFactor * 100) / 100.0;
+    return key.str();
+}
+
+bool EncoderTuningCache::lookup(const std::string& key, EncoderSettings& settings) const {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = entries.find(key);
+    if (it == entries.end()) {
+        return false;
+    }
+    settings = it->second;
+    return true;
+}
+
+void EncoderTuningCache::store(const std::string& key, const EncoderSettings& settings) {
+    std::lock_guard<std::mutex> lock(mutex);
+    entries[key] = settings;
+    save();
+}
+
+void EncoderTuningCache::load() {
+    if (indexPath.empty()) {
+        return;
+    }
+    
+    std::ifstream index(indexPath);
+    std::string line;
+    while (std::getline(index, line)) {
+        // key, codec, preset, tune (may be empty), crf
+        std::vector<std::string> fields;
+        std::istringstream stream(line);
+        std::string field;
+        while (std::getline(stream, field, '\t')) {
+            fields.push_back(field);
+        }
+        if (fields.size() != 5) {
+            continue;
+        }
+        
+        EncoderSettings settings;
+        settings.codec = fields[1];
+        settings.preset = fields[2];
+        settings.tune = fields[3];
+        try {
+            settings.crf = std::stoi(fields[4]);
+        } catch (const std::exception&) {
+            continue;
+        }
+        entries[fields[0]] = settings;
+    }
+}
+
+void EncoderTuningCache::save() const {
+    if (indexPath.empty()) {
+        return;
+    }
+    
+    // Same synced swap-in as the result cache index
+    std::string tempPath = indexPath + ".tmp";
+    FILE* index = fopen(tempPath.c_str(), "w");
+    if (!index) {
+        std::cerr << "Could not write encoder tuning cache" << std::endl;
+        return;
+    }
+    bool ok = true;
+    for (const auto& entry : entries) {
+        const EncoderSettings& settings = entry.second;
+        ok = ok && fprintf(index, "%s\t%s\t%s\t%s\t%d\n", entry.first.c_str(), settings.codec.c_str(),
+                           settings.preset.c_str(), settings.tune.c_str(), settings.crf) > 0;
+    }
+    ok = ok && fflush(index) == 0 && fsync(fileno(index)) == 0;
+    if (fclose(index) != 0 || !ok) {
+        std::cerr << "Could not write encoder tuning cache" << std::endl;
+        std::remove(tempPath.c_str());
+        return;
+    }
+    
+    std::error_code error;
+    fs::rename(tempPath, indexPath, error);
+    if (error) {
+        std::cerr << "Could not replace encoder tuning cache: " << error.message() << std::endl;
+    }
+}
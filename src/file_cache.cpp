@@ -0,0 +1,99 @@
+#include "file_cache.hpp"
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+MappedFile::~MappedFile() {
+    if (mapping) {
+        munmap(const_cast<char*>(mapping), length);
+    }
+}
+
+MappedFileCache::MappedFileCache(size_t maxEntries)
+    : maxEntries(maxEntries > 0 ? maxEntries : 1) {
+}
+
+std::shared_ptr<const MappedFile> MappedFileCache::open(const std::string& path) {
+    struct stat info;
+    if (stat(path.c_str(), &info) != 0 || !S_ISREG(info.st_mode)) {
+        return nullptr;
+    }
+    
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = entries.find(path);
+    if (it != entries.end()) {
+        const MappedFile& cached = *it->second.file;
+        if (cached.inode == static_cast<uint64_t>(info.st_ino) &&
+            cached.length == static_cast<size_t>(info.st_size) &&
+            cached.mtime == info.st_mtim.tv_sec &&
+            cached.mtimeNanos == info.st_mtim.tv_nsec) {
+            recent.splice(recent.begin(), recent, it->second.position);
+            return it->second.file;
+        }
+        
+        // Replaced on disk; readers still holding the old mapping keep it
+        recent.erase(it->second.position);
+        entries.erase(it);
+    }
+    
+    std::shared_ptr<MappedFile> file = mapFile(path);
+    if (!file) {
+        return nullptr;
+    }
+    
+    recent.push_front(path);
+    entries[path] = Entry{file, recent.begin()};
+    while (entries.size() > maxEntries) {
+        entries.erase(recent.back());
+        recent.pop_back();
+    }
+    return file;
+}
+
+std::shared_ptr<MappedFile> MappedFileCache::mapFile(const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        std::cerr << "Could not open " << path << ": " << strerror(errno) << std::endl;
+        return nullptr;
+    }
+    
+    // Stat the descriptor, not the path, so the validator matches what is mapped
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        std::cerr << "Could not stat " << path << ": " << strerror(errno) << std::endl;
+        close(fd);
+        return nullptr;
+    }
+    
+    std::shared_ptr<MappedFile> file(new MappedFile());
+    file->length = static_cast<size_t>(info.st_size);
+    file->inode = static_cast<uint64_t>(info.st_ino);
+    file->mtime = info.st_mtim.tv_sec;
+    file->mtimeNanos = info.st_mtim.tv_nsec;
+    
+    // mmap rejects empty files; an empty body needs no mapping
+    if (file->length > 0) {
+        void* mapping = mmap(nullptr, file->length, PROT_READ, MAP_SHARED, fd, 0);
+        if (mapping == MAP_FAILED) {
+            std::cerr << "Could not map " << path << ": " << strerror(errno) << std::endl;
+            close(fd);
+            return nullptr;
+        }
+        // Downloads read front to back; let the kernel read ahead aggressively
+        madvise(mapping, file->length, MADV_SEQUENTIAL);
+        file->mapping = static_cast<const char*>(mapping);
+    }
+    // The mapping keeps the pages reachable, the descriptor is not needed
+    close(fd);
+    
+    std::ostringstream tag;
+    tag << '"' << std::hex << file->inode << '-' << file->length << '-'
+        << file->mtime << '.' << file->mtimeNanos << '"';
+    file->entityTag = tag.str();
+    return file;
+}
@@ -0,0 +1,169 @@
+#include "frame_pool.hpp"
+#include <iostream>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavutil/buffer.h>
+#include <libavutil/frame.h>
+#include <libavutil/imgutils.h>
+}
+
+namespace {
+
+// Idle structs kept per pool; more than a pipeline ever has in flight
+constexpr size_t MAX_IDLE = 64;
+
+} // namespace
+
+PacketPool::~PacketPool() {
+    for (AVPacket* packet : idle) {
+        av_packet_free(&packet);
+    }
+}
+
+AVPacket* PacketPool::acquire() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stats.requests++;
+        if (!idle.empty()) {
+            AVPacket* packet = idle.back();
+            idle.pop_back();
+            return packet;
+        }
+        stats.allocations++;
+        stats.bytes += sizeof(AVPacket);
+    }
+    return av_packet_alloc();
+}
+
+void PacketPool::release(AVPacket*& packet) {
+    if (!packet) {
+        return;
+    }
+    av_packet_unref(packet);
+    
+    std::lock_guard<std::mutex> lock(mutex);
+    if (idle.size() < MAX_IDLE) {
+        idle.push_back(packet);
+        packet = nullptr;
+        return;
+    }
+    av_packet_free(&packet);
+}
+
+PoolStats PacketPool::collectStats() {
+    std::lock_guard<std::mutex> lock(mutex);
+    PoolStats collected = stats;
+    stats = PoolStats();
+    return collected;
+}
+
+FramePool::~FramePool() {
+    for (AVFrame* frame : idle) {
+        av_frame_free(&frame);
+    }
+    // Outstanding pictures keep the pool alive until they are unreferenced
+    av_buffer_pool_uninit(&bufferPool);
+}
+
+bool FramePool::configure(int width, int height, int pixelFormat) {
+    if (bufferPool && width == this->width && height == this->height && pixelFormat == this->pixelFormat) {
+        return true;
+    }
+    
+    int size = av_image_get_buffer_size(static_cast<AVPixelFormat>(pixelFormat), width, height, ALIGNMENT);
+    if (size < 0) {
+        std::cerr << "Unsupported picture format for frame pool" << std::endl;
+        return false;
+    }
+    
+    av_buffer_pool_uninit(&bufferPool);
+    bufferPool = av_buffer_pool_init2(static_cast<size_t>(size), this, allocBuffer, nullptr);
+    if (!bufferPool) {
+        std::cerr << "Could not create frame buffer pool" << std::endl;
+        return false;
+    }
+    this->width = width;
+    this->height = height;
+    this->pixelFormat = pixelFormat;
+    return true;
+}
+
+AVBufferRef* FramePool::allocBuffer(void* opaque, size_t size) {
+    FramePool* pool = static_cast<FramePool*>(opaque);
+    {
+        std::lock_guard<std::mutex> lock(pool->mutex);
+        pool->stats.allocations++;
+        pool->stats.bytes += size;
+    }
+    return av_buffer_alloc(size);
+}
+
+AVFrame* FramePool::acquire() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stats.requests++;
+        if (!idle.empty()) {
+            AVFrame* frame = idle.back();
+            idle.pop_back();
+            return frame;
+        }
+        stats.allocations++;
+        stats.bytes += sizeof(AVFrame);
+    }
+    return av_frame_alloc();
+}
+
+AVFrame* FramePool::acquirePicture() {
+    if (!bufferPool) {
+        return nullptr;
+    }
+    
+    AVFrame* frame = acquire();
+    if (!frame) {
+        return nullptr;
+    }
+    
+    // Not under the lock: a pool miss calls back into allocBuffer
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stats.requests++;
+    }
+    frame->buf[0] = av_buffer_pool_get(bufferPool);
+    if (!frame->buf[0]) {
+        release(frame);
+        return nullptr;
+    }
+    
+    frame->format = pixelFormat;
+    frame->width = width;
+    frame->height = height;
+    if (av_image_fill_arrays(frame->data, frame->linesize, frame->buf[0]->data,
+                             static_cast<AVPixelFormat>(pixelFormat), width, height, ALIGNMENT) < 0) {
+        release(frame);
+        return nullptr;
+    }
+    return frame;
+}
+
+void FramePool::release(AVFrame*& frame) {
+    if (!frame) {
+        return;
+    }
+    av_frame_unref(frame);
+    
+    std::lock_guard<std::mutex> lock(mutex);
+    if (idle.size() < MAX_IDLE) {
+        idle.push_back(frame);
+        frame = nullptr;
+        return;
+    }
+    av_frame_free(&frame);
+}
+
+PoolStats FramePool::collectStats() {
+    std::lock_guard<std::mutex> lock(mutex);
+    PoolStats collected = stats;
+    stats = PoolStats();
+    return collected;
+}
@@ -0,0 +1,104 @@
+#include "job_journal.hpp"
+#include "tsv_fields.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace {
+
+std::string queuedLine(const JournaledJob& job) {
+    return "queued\t" + escapeField(job.id) + "\t" + escapeField(job.inputPath) + "\t" +
+           escapeField(job.workPath) + "\t" + escapeField(job.cacheKey) + "\t" +
+           escapeField(job.scaleQuality) + "\t" + escapeField(job.priority) + "\t" +
+           escapeField(job.sceneAdaptive) + "\n";
+}
+
+bool writeAll(int fd, const std::string& data) {
+    size_t written = 0;
+    while (written < data.size()) {
+        ssize_t n = ::write(fd, data.data() + written, data.size() - written);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        written += static_cast<size_t>(n);
+    }
+    return true;
+}
+
+} // namespace
+
+JobJournal::JobJournal(std::string path) : path(std::move(path)) {}
+
+std::vector<JournaledJob> JobJournal::recover() {
+    std::lock_guard<std::mutex> lock(mutex);
+    
+    std::vector<JournaledJob> pending;
+    {
+        std::ifstream journal(path);
+        std::string line;
+        while (std::getline(journal, line)) {
+            std::vector<std::string> fields = splitFields(line);
+            if (fields.size() == 8 && fields[0] == "queued") {
+                pending.push_back(JournaledJob{fields[1], fields[2], fields[3], fields[4], fields[5],
+                                               fields[6], fields[7]});
+            } else if (fields.size() == 2 && fields[0] == "finished") {
+                std::string id = fields[1];
+                pending.erase(std::remove_if(pending.begin(), pending.end(),
+                                             [&id](const JournaledJob& job) { return job.id == id; }),
+                              pending.end());
+            }
+        }
+    }
+    
+    // Compact: same swap-in as the cache index, synced before the rename
+    std::string tempPath = path + ".tmp";
+    int fd = ::open(tempPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        std::cerr << "Could not rewrite job journal: " << strerror(errno) << std::endl;
+        return pending;
+    }
+    std::string contents;
+    for (const JournaledJob& job : pending) {
+        contents += queuedLine(job);
+    }
+    bool ok = writeAll(fd, contents) && fsync(fd) == 0;
+    ::close(fd);
+    if (!ok || std::rename(tempPath.c_str(), path.c_str()) != 0) {
+        std::cerr << "Could not rewrite job journal" << std::endl;
+        std::remove(tempPath.c_str());
+    }
+    return pending;
+}
+
+bool JobJournal::recordQueued(const JournaledJob& job) {
+    return append(queuedLine(job));
+}
+
+bool JobJournal::recordFinished(const std::string& id) {
+    return append("finished\t" + escapeField(id) + "\n");
+}
+
+bool JobJournal::append(const std::string& line) {
+    std::lock_guard<std::mutex> lock(mutex);
+    
+    // One short write per record; O_APPEND keeps it whole at the end
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0) {
+        std::cerr << "Could not open job journal: " << strerror(errno) << std::endl;
+        return false;
+    }
+    bool ok = writeAll(fd, line) && fdatasync(fd) == 0;
+    ::close(fd);
+    if (!ok) {
+        std::cerr << "Could not write job journal" << std::endl;
+    }
+    return ok;
+}
@@ -0,0 +1,425 @@
+#include "job_scheduler.hpp"
+#include "video_processor.hpp"
+#include <algorithm>
+#include <cmath>
+#include <exception>
+#include <iostream>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+double secondsBetween(Clock::time_point start, Clock::time_point end) {
+    return std::chrono::duration<double>(end - start).count();
+}
+
+} // namespace
+
+const char* jobStateName(JobState state) {
+    switch (state) {
+        case JobState::Queued: return "queued";
+        case JobState::Running: return "running";
+        case JobState::Succeeded: return "succeeded";
+        case JobState::Failed: return "failed";
+        case JobState::Cancelled: return "cancelled";
+    }
+    return "unknown";
+}
+
+const char* jobPriorityName(JobPriority priority) {
+    return priority == JobPriority::Bulk ? "bulk" : "interactive";
+}
+
+bool parseJobPriority(const std::string& name, JobPriority& priority) {
+    if (name == "interactive") {
+        priority = JobPriority::Interactive;
+    } else if (name == "bulk") {
+        priority = JobPriority::Bulk;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+JobScheduler::JobScheduler(int workerCount, int queueCapacity)
+    : queueCapacity(static_cast<size_t>(std::max(1, queueCapacity))),
+      poolSize(std::max(1, workerCount)),
+      jobThreading(ThreadingPolicy::forHost(std::max(1, workerCount))),
+      interactiveThreading(ThreadingPolicy::forHost(std::max(1, workerCount / INTERACTIVE_THREAD_WEIGHT))) {
+    for (int i = 0; i < poolSize; i++) {
+        workers.emplace_back(&JobScheduler::workerLoop, this);
+    }
+}
+
+JobScheduler::~JobScheduler() {
+    // Let workers finish what was already admitted
+    {
+        std::lock_guard<std::mutex> lock(jobsMutex);
+        stopping = true;
+    }
+    jobQueued.notify_all();
+    for (auto& worker : workers) {
+        worker.join();
+    }
+}
+
+int JobScheduler::defaultWorkerCount(int threadsPerJob) {
+    int cores = static_cast<int>(std::thread::hardware_concurrency());
+    if (cores <= 0) {
+        cores = 1;
+    }
+    return std::max(1, cores / std::max(1, threadsPerJob));
+}
+
+std::shared_ptr<JobScheduler::Job> JobScheduler::makeJob(const std::string& inputPath, const std::string& outputPath,
+                                                         Task task, CompletionCallback onComplete,
+                                                         const JobOptions& options) {
+    auto job = std::make_shared<Job>();
+    job->status.inputPath = inputPath;
+    job->status.outputPath = outputPath;
+    job->status.priority = options.priority;
+    job->status.deadlineSeconds = std::max(0.0, options.deadlineSeconds);
+    job->task = std::move(task);
+    job->onComplete = std::move(onComplete);
+    job->preemptible = options.preemptible;
+    job->submitted = Clock::now();
+    job->deadline = Clock::time_point::max();
+    if (job->status.deadlineSeconds > 0.0) {
+        job->deadline = job->submitted + std::chrono::duration_cast<Clock::duration>(
+            std::chrono::duration<double>(job->status.deadlineSeconds));
+    }
+    return job;
+}
+
+std::string JobScheduler::submit(const std::string& inputPath, const std::string& outputPath,
+                                 Task task, CompletionCallback onComplete, const JobOptions& options,
+                                 AdmissionCallback onAdmitted) {
+    auto job = makeJob(inputPath, outputPath, std::move(task), std::move(onComplete), options);
+    
+    {
+        std::lock_guard<std::mutex> lock(jobsMutex);
+        if (stopping || queuedJobsLocked(options.priority) + admittingJobs >= queueCapacity) {
+            return "";
+        }
+        // Every queued job is taken before this one could be
+        size_t waiting = interactiveQueue.size() + bulkQueue.size() + admittingJobs;
+        if (options.startNow && runningJobList.size() + waiting >= static_cast<size_t>(poolSize)) {
+            return "";
+        }
+        // Registered under the lock, so a fast worker always finds the record
+        job->status.id = std::to_string(nextJobId++);
+        jobs[job->status.id] = job;
+        if (!onAdmitted) {
+            enqueue(job);
+            return job->status.id;
+        }
+        admittingJobs++;
+    }
+    
+    // Outside the lock, since the callback may wait on the disk. The job
+    // shows as queued meanwhile, and a cancel is honoured once it is taken.
+    onAdmitted(job->status.id);
+    
+    std::lock_guard<std::mutex> lock(jobsMutex);
+    admittingJobs--;
+    enqueue(job);
+    return job->status.id;
+}
+
+void JobScheduler::resume(const std::string& id, const std::string& inputPath, const std::string& outputPath,
+                          Task task, CompletionCallback onComplete, const JobOptions& options) {
+    auto job = makeJob(inputPath, outputPath, std::move(task), std::move(onComplete), options);
+    job->status.id = id;
+    
+    std::lock_guard<std::mutex> lock(jobsMutex);
+    // New jobs are numbered past every recovered one
+    try {
+        nextJobId = std::max(nextJobId, std::stoull(id) + 1);
+    } catch (const std::exception&) {
+    }
+    jobs[id] = job;
+    enqueue(job);
+}
+
+bool JobScheduler::getStatus(const std::string& id, JobStatus& status) const {
+    std::lock_guard<std::mutex> lock(jobsMutex);
+    auto it = jobs.find(id);
+    if (it == jobs.end()) {
+        return false;
+    }
+    
+    const Job& job = *it->second;
+    status = job.status;
+    auto now = Clock::now();
+    if (status.state == JobState::Queued) {
+        status.queuedSeconds = secondsBetween(job.submitted, now);
+    } else if (status.state == JobState::Running) {
+        status.runSeconds = secondsBetween(job.started, now);
+        if (job.processor) {
+            TranscodeProgress progress = job.processor->getProgress();
+            status.progress = progress.fraction();
+            status.framesEncoded = progress.framesEncoded;
+            // Assumes the rest of the input goes at the pace so far
+            if (status.progress > 0.0) {
+                status.etaSeconds = status.runSeconds * (1.0 - status.progress) / status.progress;
+            }
+        }
+    }
+    return true;
+}
+
+bool JobScheduler::cancel(const std::string& id) {
+    std::lock_guard<std::mutex> lock(jobsMutex);
+    auto it = jobs.find(id);
+    if (it == jobs.end()) {
+        return false;
+    }
+    
+    Job& job = *it->second;
+    if (job.status.state != JobState::Queued && job.status.state != JobState::Running) {
+        return false;
+    }
+    job.cancelRequested = true;
+    return true;
+}
+
+void JobScheduler::setOutputPath(const std::string& id, const std::string& outputPath) {
+    std::lock_guard<std::mutex> lock(jobsMutex);
+    auto it = jobs.find(id);
+    if (it != jobs.end()) {
+        it->second->status.outputPath = outputPath;
+    }
+}
+
+void JobScheduler::setWorkPath(const std::string& id, const std::string& workPath) {
+    std::lock_guard<std::mutex> lock(jobsMutex);
+    auto it = jobs.find(id);
+    if (it != jobs.end()) {
+        it->second->status.workPath = workPath;
+    }
+}
+
+void JobScheduler::setJobObserver(JobObserver observer) {
+    jobObserver = std::move(observer);
+}
+
+int JobScheduler::retryAfterSeconds() const {
+    double average;
+    {
+        std::lock_guard<std::mutex> lock(jobsMutex);
+        average = averageJobSeconds;
+    }
+    // Roughly when the next worker frees up
+    double seconds = average / static_cast<double>(workers.size());
+    return std::max(1, static_cast<int>(std::ceil(seconds)));
+}
+
+size_t JobScheduler::queuedJobs() const {
+    std::lock_guard<std::mutex> lock(jobsMutex);
+    return interactiveQueue.size() + bulkQueue.size();
+}
+
+size_t JobScheduler::queuedJobs(JobPriority priority) const {
+    std::lock_guard<std::mutex> lock(jobsMutex);
+    return queuedJobsLocked(priority);
+}
+
+size_t JobScheduler::queuedJobsLocked(JobPriority priority) const {
+    return priority == JobPriority::Interactive ? interactiveQueue.size() : bulkQueue.size();
+}
+
+int JobScheduler::bulkWorkerShare() const {
+    // At least one worker as soon as there are two, or the share would be
+    // nothing below four workers. A single worker is not split: interactive
+    // jobs always come first there, and preempt any bulk job it is running.
+    if (poolSize < 2) {
+        return 0;
+    }
+    return std::max(1, static_cast<int>(poolSize * BULK_WORKER_SHARE));
+}
+
+void JobScheduler::enqueue(const std::shared_ptr<Job>& job) {
+    bool interactive = job->status.priority == JobPriority::Interactive;
+    auto& queue = interactive ? interactiveQueue : bulkQueue;
+    auto position = std::upper_bound(queue.begin(), queue.end(), job,
+        [](const std::shared_ptr<Job>& a, const std::shared_ptr<Job>& b) {
+            return a->deadline != b->deadline ? a->deadline < b->deadline : a->submitted < b->submitted;
+        });
+    queue.insert(position, job);
+    jobQueued.notify_one();
+    if (interactive) {
+        preemptForInteractive();
+    }
+}
+
+bool JobScheduler::takeNext(std::shared_ptr<Job>& job) {
+    int runningBulk = static_cast<int>(std::count_if(runningJobList.begin(), runningJobList.end(),
+        [](const std::shared_ptr<Job>& running) { return running->status.priority == JobPriority::Bulk; }));
+    bool bulkFirst = !bulkQueue.empty() && (interactiveQueue.empty() || runningBulk < bulkWorkerShare());
+    auto& queue = bulkFirst ? bulkQueue : interactiveQueue;
+    if (queue.empty()) {
+        return false;
+    }
+    job = queue.front();
+    queue.pop_front();
+    return true;
+}
+
+void JobScheduler::preemptForInteractive() {
+    int runningBulk = 0;
+    int yielding = 0;
+    std::vector<std::shared_ptr<Job>> candidates;
+    for (const auto& job : runningJobList) {
+        if (job->status.priority != JobPriority::Bulk) {
+            continue;
+        }
+        runningBulk++;
+        if (job->yieldRequested) {
+            yielding++;
+        } else if (job->preemptible) {
+            candidates.push_back(job);
+        }
+    }
+    // Idle workers and the ones already being given up take queued jobs first
+    int idle = poolSize - static_cast<int>(runningJobList.size());
+    int needed = static_cast<int>(interactiveQueue.size()) - idle - yielding;
+    // Never below the bulk share, whether or not the jobs in it are preemptible
+    int spare = runningBulk - yielding - bulkWorkerShare();
+    
+    // Jobs without a deadline, or with the latest one, yield first; then
+    // the ones started last
+    std::sort(candidates.begin(), candidates.end(),
+        [](const std::shared_ptr<Job>& a, const std::shared_ptr<Job>& b) {
+            return a->deadline != b->deadline ? a->deadline > b->deadline : a->started > b->started;
+        });
+    for (size_t i = 0; i < candidates.size() && needed > 0 && spare > 0; i++, needed--, spare--) {
+        std::cout << "Preempting bulk job " << candidates[i]->status.id << std::endl;
+        candidates[i]->yieldRequested = true;
+    }
+}
+
+void JobScheduler::workerLoop() {
+    // Reused across jobs so each worker pays setup costs once
+    VideoProcessor processor;
+    
+    std::shared_ptr<Job> job;
+    while (true) {
+        bool cancelled;
+        bool weighted = false;
+        {
+            std::unique_lock<std::mutex> lock(jobsMutex);
+            jobQueued.wait(lock, [this]() {
+                return stopping || !interactiveQueue.empty() || !bulkQueue.empty();
+            });
+            // Stopping, and everything admitted has been taken
+            if (!takeNext(job)) {
+                return;
+            }
+            job->started = Clock::now();
+            job->status.queuedSeconds = secondsBetween(job->submitted, job->started);
+            cancelled = job->cancelRequested;
+            if (!cancelled) {
+                job->status.state = JobState::Running;
+                job->processor = &processor;
+                runningJobList.push_back(job);
+                weighted = job->status.priority == JobPriority::Interactive &&
+                           (!bulkQueue.empty() ||
+                            std::any_of(runningJobList.begin(), runningJobList.end(), [](const std::shared_ptr<Job>& other) {
+                                return other->status.priority == JobPriority::Bulk;
+                            }));
+            }
+        }
+        if (cancelled) {
+            finishJob(job, false, nullptr);
+            job.reset();
+            continue;
+        }
+        running++;
+        
+        // Reset per job, so one task's override does not leak into the next
+        processor.setThreadingPolicy(weighted ? interactiveThreading : jobThreading);
+        processor.setCancelFlag(&job->cancelRequested);
+        processor.setYieldFlag(job->preemptible ? &job->yieldRequested : nullptr);
+        
+        bool succeeded = false;
+        try {
+            if (job->task) {
+                succeeded = job->task(processor);
+            } else {
+                succeeded = processor.processVideo(job->status.inputPath, job->status.outputPath);
+            }
+        } catch (const std::exception& e) {
+            std::cerr << "Job " << job->status.id << " failed: " << e.what() << std::endl;
+        }
+        
+        processor.setCancelFlag(nullptr);
+        processor.setYieldFlag(nullptr);
+        running--;
+        
+        // A yielded job goes back to the queue and resumes from its checkpoints
+        bool requeued = false;
+        {
+            std::lock_guard<std::mutex> lock(jobsMutex);
+            runningJobList.erase(std::find(runningJobList.begin(), runningJobList.end(), job));
+            if (!succeeded && processor.yielded() && !job->cancelRequested) {
+                job->status.state = JobState::Queued;
+                job->status.preemptions++;
+                job->processor = nullptr;
+                job->yieldRequested = false;
+                enqueue(job);
+                requeued = true;
+            }
+        }
+        if (requeued) {
+            preemptionCount++;
+        } else {
+            finishJob(job, succeeded, &processor);
+        }
+        job.reset();
+    }
+}
+
+void JobScheduler::finishJob(const std::shared_ptr<Job>& job, bool succeeded, const VideoProcessor* processor) {
+    JobStatus status;
+    {
+        std::lock_guard<std::mutex> lock(jobsMutex);
+        // A job that completed before noticing the cancel still succeeded
+        if (succeeded) {
+            job->status.state = JobState::Succeeded;
+        } else {
+            job->status.state = job->cancelRequested ? JobState::Cancelled : JobState::Failed;
+        }
+        job->status.runSeconds = secondsBetween(job->started, Clock::now());
+        job->processor = nullptr;
+        if (processor) {
+            // Where a failed or cancelled job stopped
+            TranscodeProgress progress = processor->getProgress();
+            job->status.progress = succeeded ? 1.0 : progress.fraction();
+            job->status.framesEncoded = progress.framesEncoded;
+        }
+        status = job->status;
+        
+        // Exponential moving average of job durations for Retry-After.
+        // How long a cancelled job ran says nothing about job length.
+        if (status.state != JobState::Cancelled) {
+            if (averageJobSeconds == 0.0) {
+                averageJobSeconds = status.runSeconds;
+            } else {
+                averageJobSeconds = 0.8 * averageJobSeconds + 0.2 * status.runSeconds;
+            }
+        }
+        
+        finishedJobs.push_back(status.id);
+        while (finishedJobs.size() > MAX_FINISHED_JOBS) {
+            jobs.erase(finishedJobs.front());
+            finishedJobs.pop_front();
+        }
+    }
+    
+    if (jobObserver && processor) {
+        jobObserver(status, *processor);
+    }
+    if (job->onComplete) {
+        job->onComplete(status);
+    }
+}
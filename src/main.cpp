@@ -1,18 +1,272 @@
+#include "batch.hpp"
+#include "cluster.hpp"
+#include "job_scheduler.hpp"
 #include "video_processor.hpp"
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
 #include <iostream>
+#include <string>
+#include <vector>
+
+namespace {
+
+void printStage(const char* name, const PipelineStageStats& stats) {
+    std::cout << "  " << name << ": " << stats.frames << " frames, "
+              << stats.busySeconds << "s busy, "
+              << stats.stallSeconds << "s stalled" << std::endl;
+}
+
+void printUsage(const char* program) {
+    std::cout << "Usage: " << program << " [options] <input_file> <output_file>" << std::endl;
+    std::cout << "       " << program << " --ladder <output_dir> <input_file>" << std::endl;
+    std::cout << "       " << program << " --batch <output_dir> <input_dir|'glob'|manifest.jsonl>" << std::endl;
+    std::cout << "       " << program << " --probe <input_file>" << std::endl;
+    std::cout << "       " << program << " --thumbnails <n> <input_file> <sprite.jpg|sprite.webp>" << std::endl;
+    std::cout << "       " << program << " --worker <host:port> [--jobs <n>]" << std::endl;
+    std::cout << "Options:" << std::endl;
+    std::cout << "  --fast-probe        bound how much of the input is read to find stream info" << std::endl;
+    std::cout << "  --pipeline          decode, scale and encode on separate threads" << std::endl;
+    std::cout << "  --fragmented        write fragmented mp4, readable while it is written" << std::endl;
+    std::cout << "  --scene-adaptive    keyframes at scene cuts, skip repeated frames, CRF per scene" << std::endl;
+    std::cout << "  --no-stream-copy    re-encode video even when it already fits the output" << std::endl;
+    std::cout << "  --segments <n>      split at keyframes into n segments transcoded in parallel" << std::endl;
+    std::cout << "  --workers <n>       parallel segment workers (default: from core count)" << std::endl;
+    std::cout << "  --ladder <dir>      encode a 1080p/720p/480p/360p HLS and DASH ladder into dir" << std::endl;
+    std::cout << "  --scale-quality <q> fast, bilinear (default) or lanczos" << std::endl;
+    std::cout << "  --threads <n>       cores for decode, scale and encode (default: all)" << std::endl;
+    std::cout << "  --batch <dir>       transcode many inputs into dir, skipping outputs already there" << std::endl;
+    std::cout << "  --jobs <n>          concurrent batch jobs, or worker slots (default: from core count)" << std::endl;
+    std::cout << "  --coordinator <a>   hand batch jobs to cluster workers connecting to [host:]port a" << std::endl;
+    std::cout << "  --worker <h:p>      run jobs for the coordinator at h:p until stopped" << std::endl;
+    std::cout << "  --thumbnails <n>    write a sprite of n keyframes instead of transcoding" << std::endl;
+    std::cout << "  --encoder <name>    libx264 (default), libx265 or libsvtav1" << std::endl;
+    std::cout << "  --autotune <x>      slowest preset that still encodes at x times realtime" << std::endl;
+    std::cout << "  --deadline <s>      slowest preset that still finishes within s seconds" << std::endl;
+    std::cout << "  --tuning-cache <f>  where tuning results are kept (default: encoder_tuning.tsv)" << std::endl;
+}
+
+} // namespace
 
 int main(int argc, char* argv[]) {
-    if (argc != 3) {
-        std::cout << "Usage: " << argv[0] << " <input_file> <output_file>" << std::endl;
+    bool pipeline = false;
+    bool fragmented = false;
+    bool sceneAdaptive = false;
+    bool streamCopy = true;
+    bool fastProbe = false;
+    bool probe = false;
+    int segments = 0;
+    int workers = 0;
+    int threads = 0;
+    int jobs = 0;
+    int thumbnails = 0;
+    std::string coordinatorAddress;
+    std::string workerAddress;
+    std::string batchDirectory;
+    std::string ladderDirectory;
+    ScaleQuality scaleQuality = ScaleQuality::Bilinear;
+    std::string encoder = "libx264";
+    bool autotune = false;
+    AutotuneTarget autotuneTarget;
+    std::string tuningCachePath = "encoder_tuning.tsv";
+    std::vector<std::string> paths;
+    
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--pipeline") {
+            pipeline = true;
+        } else if (arg == "--fragmented") {
+            fragmented = true;
+        } else if (arg == "--scene-adaptive") {
+            sceneAdaptive = true;
+        } else if (arg == "--no-stream-copy") {
+            streamCopy = false;
+        } else if (arg == "--fast-probe" || arg == "--probe") {
+            (arg == "--probe" ? probe : fastProbe) = true;
+        } else if ((arg == "--threads" || arg == "--jobs") && i + 1 < argc) {
+            (arg == "--threads" ? threads : jobs) = std::atoi(argv[++i]);
+        } else if (arg == "--thumbnails" && i + 1 < argc) {
+            thumbnails = std::atoi(argv[++i]);
+        } else if (arg == "--coordinator" && i + 1 < argc) {
+            coordinatorAddress = argv[++i];
+        } else if (arg == "--worker" && i + 1 < argc) {
+            workerAddress = argv[++i];
+        } else if (arg == "--batch" && i + 1 < argc) {
+            batchDirectory = argv[++i];
+        } else if ((arg == "--segments" || arg == "--workers") && i + 1 < argc) {
+            (arg == "--segments" ? segments : workers) = std::atoi(argv[++i]);
+        } else if (arg == "--ladder" && i + 1 < argc) {
+            ladderDirectory = argv[++i];
+        } else if (arg == "--scale-quality" && i + 1 < argc && parseScaleQuality(argv[i + 1], scaleQuality)) {
+            i++;
+        } else if (arg == "--encoder" && i + 1 < argc) {
+            encoder = argv[++i];
+        } else if (arg == "--autotune" && i + 1 < argc) {
+            autotune = true;
+            autotuneTarget.realtimeFactor = std::atof(argv[++i]);
+        } else if (arg == "--deadline" && i + 1 < argc) {
+            // Alone, only the deadline constrains the encode
+            if (!autotune) {
+                autotuneTarget.realtimeFactor = 0.0;
+            }
+            autotune = true;
+            autotuneTarget.deadlineSeconds = std::atof(argv[++i]);
+        } else if (arg == "--tuning-cache" && i + 1 < argc) {
+            tuningCachePath = argv[++i];
+        } else if (arg.rfind("--", 0) == 0) {
+            printUsage(argv[0]);
+            return 1;
+        } else {
+            paths.push_back(arg);
+        }
+    }
+    
+    bool singleInput = probe || !ladderDirectory.empty() || !batchDirectory.empty();
+    size_t pathCount = !workerAddress.empty() ? 0u : singleInput ? 1u : 2u;
+    if (paths.size() != pathCount) {
+        printUsage(argv[0]);
+        return 1;
+    }
+    if (!encoderAvailable(encoder)) {
+        std::cout << "Encoder " << encoder << " is not available in this FFmpeg build" << std::endl;
         return 1;
     }
     
+    // Shared by every job so a batch tunes once per resolution class
+    EncoderTuningCache tuningCache(autotune ? tuningCachePath : "");
+    auto configureEncoder = [&](VideoProcessor& processor) {
+        processor.setEncoder(encoder);
+        processor.setAutotune(autotune, autotuneTarget, &tuningCache);
+        processor.setSceneAdaptive(sceneAdaptive);
+        processor.setStreamCopy(streamCopy);
+    };
+    // Lets segment workers skip probing the input again
+    ProbeCache probeCache;
+    auto configureProbing = [&](VideoProcessor& processor) {
+        processor.setFastProbe(fastProbe);
+        processor.setProbeCache(&probeCache);
+    };
+    
+    if (!workerAddress.empty()) {
+        // Settings come with each task; only what is local to this host is set here
+        int slots = jobs > 0 ? jobs
+                             : JobScheduler::defaultWorkerCount(ThreadingPolicy::TYPICAL_JOB_THREADS);
+        return runClusterWorker(workerAddress, slots, clusterToken(), configureProbing);
+    }
+    
+    if (!batchDirectory.empty()) {
+        std::vector<BatchItem> items;
+        if (!collectBatchItems(paths[0], batchDirectory, items)) {
+            return 1;
+        }
+        Coordinator coordinator;
+        if (!coordinatorAddress.empty()) {
+            if (!coordinator.start(coordinatorAddress, clusterToken())) {
+                return 1;
+            }
+            std::cout << "Waiting for cluster workers on " << coordinatorAddress << std::endl;
+            if (!coordinator.waitForWorkers(Coordinator::WORKER_WAIT)) {
+                std::cout << "No worker joined, transcoding locally" << std::endl;
+            }
+        }
+        if (jobs <= 0) {
+            jobs = JobScheduler::defaultWorkerCount(threads > 0 ? threads : ThreadingPolicy::TYPICAL_JOB_THREADS);
+            // Enough jobs in flight to keep every worker slot busy
+            jobs = std::max(jobs, coordinator.capacity());
+        }
+        int failed = runBatch(items, jobs, [&](VideoProcessor& processor) {
+            processor.setScaleQuality(scaleQuality);
+            processor.setPipelineMode(pipeline);
+            processor.setFragmentedOutput(fragmented);
+            processor.setSegmentParallelism(segments, workers);
+            configureEncoder(processor);
+            configureProbing(processor);
+            if (threads > 0) {
+                processor.setThreadingPolicy(ThreadingPolicy::forCores(threads));
+            }
+        }, !coordinatorAddress.empty() ? &coordinator : nullptr);
+        return failed > 0 ? 1 : 0;
+    }
+    
     VideoProcessor processor;
-    if (processor.processVideo(argv[1], argv[2])) {
+    configureProbing(processor);
+    if (probe) {
+        // Header and stream parameters only, nothing is decoded beyond that
+        processor.setFastProbe(true);
+        MediaInfo info;
+        if (!processor.probe(paths[0], info)) {
+            std::cout << "Error probing video" << std::endl;
+            return 1;
+        }
+        std::cout << "container: " << info.container << std::endl;
+        std::cout << "duration: " << info.durationSeconds << "s, " << info.bitRate / 1000 << " kb/s" << std::endl;
+        std::cout << "video: " << info.videoCodec << " " << info.width << "x" << info.height << " "
+                  << info.pixelFormat << " " << info.frameRate << " fps" << std::endl;
+        if (!info.audioCodec.empty()) {
+            std::cout << "audio: " << info.audioCodec << " " << info.sampleRate << " Hz, "
+                      << info.channels << " channels" << std::endl;
+        }
+        return 0;
+    }
+    if (thumbnails > 0) {
+        ThumbnailOptions options;
+        options.count = thumbnails;
+        std::string extension = paths[1].size() >= 5 ? paths[1].substr(paths[1].size() - 5) : "";
+        if (extension == ".webp") {
+            options.format = ThumbnailFormat::WebP;
+        }
+        std::string image;
+        std::ofstream sprite;
+        if (processor.extractThumbnails(paths[0], options, image)) {
+            sprite.open(paths[1], std::ios::binary | std::ios::trunc);
+            sprite.write(image.data(), image.size());
+        }
+        if (!sprite.is_open() || !sprite.good()) {
+            std::cout << "Error extracting thumbnails" << std::endl;
+            return 1;
+        }
+        std::cout << "Sprite written to " << paths[1] << std::endl;
+        return 0;
+    }
+    
+    processor.setScaleQuality(scaleQuality);
+    if (threads > 0) {
+        processor.setThreadingPolicy(ThreadingPolicy::forCores(threads));
+    }
+    if (!ladderDirectory.empty()) {
+        if (processor.processLadder(paths[0], ladderDirectory)) {
+            std::cout << "Ladder written to " << ladderDirectory << std::endl;
+            return 0;
+        }
+        std::cout << "Error processing video" << std::endl;
+        return 1;
+    }
+    
+    processor.setPipelineMode(pipeline);
+    processor.setFragmentedOutput(fragmented);
+    processor.setSegmentParallelism(segments, workers);
+    configureEncoder(processor);
+    if (processor.processVideo(paths[0], paths[1])) {
         std::cout << "Video processed successfully" << std::endl;
+        if (autotune) {
+            const EncoderSettings& settings = processor.getEncoderSettings();
+            std::cout << "  encoder: " << settings.codec << " preset " << settings.preset
+                      << " crf " << settings.crf << std::endl;
+        }
+        if (sceneAdaptive) {
+            const TranscodeMetrics& metrics = processor.getMetrics();
+            std::cout << "  scenes: " << metrics.sceneCuts.load() << ", repeated frames dropped: "
+                      << metrics.framesDropped.load() << std::endl;
+        }
+        if (pipeline) {
+            const PipelineStats& stats = processor.getPipelineStats();
+            printStage("decode", stats.decode);
+            printStage("scale", stats.scale);
+            printStage("encode", stats.encode);
+        }
         return 0;
     }
     
     std::cout << "Error processing video" << std::endl;
     return 1;
-}
\ No newline at end of file
+}
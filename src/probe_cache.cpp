@@ -0,0 +1,119 @@
+#include "probe_cache.hpp"
+#include <sstream>
+#include <sys/stat.h>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/pixdesc.h>
+}
+
+ProbeResult::~ProbeResult() {
+    for (Stream& stream : streams) {
+        avcodec_parameters_free(&stream.parameters);
+    }
+}
+
+std::shared_ptr<const ProbeResult> captureProbeResult(const AVFormatContext* context) {
+    auto result = std::make_shared<ProbeResult>();
+    result->startTime = context->start_time;
+    result->duration = context->duration;
+    result->bitRate = context->bit_rate;
+    
+    MediaInfo& info = result->info;
+    info.container = context->iformat ? context->iformat->name : "";
+    info.durationSeconds = context->duration > 0 ? static_cast<double>(context->duration) / AV_TIME_BASE : 0.0;
+    info.bitRate = context->bit_rate;
+    
+    for (unsigned int i = 0; i < context->nb_streams; i++) {
+        const AVStream* stream = context->streams[i];
+        ProbeResult::Stream probed;
+        probed.parameters = avcodec_parameters_alloc();
+        if (!probed.parameters || avcodec_parameters_copy(probed.parameters, stream->codecpar) < 0) {
+            avcodec_parameters_free(&probed.parameters);
+            return nullptr;
+        }
+        probed.frameRateNum = stream->avg_frame_rate.num;
+        probed.frameRateDen = stream->avg_frame_rate.den;
+        probed.realFrameRateNum = stream->r_frame_rate.num;
+        probed.realFrameRateDen = stream->r_frame_rate.den;
+        probed.startTime = stream->start_time;
+        probed.duration = stream->duration;
+        result->streams.push_back(probed);
+        
+        // The streams a transcode would pick: the first of each kind
+        const AVCodecParameters* parameters = stream->codecpar;
+        if (parameters->codec_type == AVMEDIA_TYPE_VIDEO && info.videoCodec.empty()) {
+            info.videoCodec = avcodec_get_name(parameters->codec_id);
+            info.width = parameters->width;
+            info.height = parameters->height;
+            info.frameRate = stream->avg_frame_rate.den > 0 ? av_q2d(stream->avg_frame_rate) : 0.0;
+            const char* pixelFormat = av_get_pix_fmt_name(static_cast<AVPixelFormat>(parameters->format));
+            info.pixelFormat = pixelFormat ? pixelFormat : "";
+        } else if (parameters->codec_type == AVMEDIA_TYPE_AUDIO && info.audioCodec.empty()) {
+            info.audioCodec = avcodec_get_name(parameters->codec_id);
+            info.sampleRate = parameters->sample_rate;
+            info.channels = parameters->ch_layout.nb_channels;
+        }
+    }
+    return result;
+}
+
+bool applyProbeResult(const ProbeResult& result, AVFormatContext* context) {
+    // Streams found only while reading packets (MPEG-TS) are not there yet
+    if (context->nb_streams != result.streams.size()) {
+        return false;
+    }
+    for (unsigned int i = 0; i < context->nb_streams; i++) {
+        if (context->streams[i]->codecpar->codec_id != result.streams[i].parameters->codec_id) {
+            return false;
+        }
+    }
+    
+    for (unsigned int i = 0; i < context->nb_streams; i++) {
+        AVStream* stream = context->streams[i];
+        const ProbeResult::Stream& probed = result.streams[i];
+        if (avcodec_parameters_copy(stream->codecpar, probed.parameters) < 0) {
+            return false;
+        }
+        stream->avg_frame_rate = AVRational{probed.frameRateNum, probed.frameRateDen};
+        stream->r_frame_rate = AVRational{probed.realFrameRateNum, probed.realFrameRateDen};
+        stream->start_time = probed.startTime;
+        stream->duration = probed.duration;
+    }
+    context->start_time = result.startTime;
+    context->duration = result.duration;
+    context->bit_rate = result.bitRate;
+    return true;
+}
+
+ProbeCache::ProbeCache(size_t maxEntries) : maxEntries(maxEntries > 0 ? maxEntries : 1) {}
+
+std::string ProbeCache::fileKey(const std::string& path) {
+    struct stat info;
+    if (stat(path.c_str(), &info) != 0) {
+        return "";
+    }
+    std::ostringstream key;
+    key << info.st_dev << ":" << info.st_ino << ":" << info.st_size << ":"
+        << info.st_mtim.tv_sec << "." << info.st_mtim.tv_nsec;
+    return key.str();
+}
+
+std::shared_ptr<const ProbeResult> ProbeCache::lookup(const std::string& key) const {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = entries.find(key);
+    return it != entries.end() ? it->second : nullptr;
+}
+
+void ProbeCache::store(const std::string& key, std::shared_ptr<const ProbeResult> result) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (entries.find(key) == entries.end()) {
+        insertionOrder.push_back(key);
+    }
+    entries[key] = std::move(result);
+    while (entries.size() > maxEntries) {
+        entries.erase(insertionOrder.front());
+        insertionOrder.pop_front();
+    }
+}
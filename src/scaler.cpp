@@ -0,0 +1,372 @@
+#include "scaler.hpp"
+#include <algorithm>
+#include <iostream>
+
+extern "C" {
+#include <libavutil/common.h>
+#include <libavutil/frame.h>
+#include <libavutil/opt.h>
+#include <libavutil/pixdesc.h>
+#include <libswscale/swscale.h>
+}
+
+// swscale slice-threads on its own since 6.1 (FFmpeg 5.0) when driven through sws_scale_frame
+#define SCALER_SWS_THREADS (LIBSWSCALE_VERSION_INT >= AV_VERSION_INT(6, 1, 100))
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define SCALER_X86 1
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#define SCALER_NEON 1
+#include <arm_neon.h>
+#endif
+
+namespace {
+
+// Bands narrower than this cost more to hand out than they save
+constexpr int MIN_BAND_ROWS = 16;
+constexpr int MAX_BOX_FACTOR = 8;
+
+// Average of each factor x factor block, rounded to nearest
+void boxRow(const uint8_t* const* rows, int factor, uint8_t* dst, int width) {
+    const int area = factor * factor;
+    for (int x = 0; x < width; x++) {
+        int sum = 0;
+        for (int row = 0; row < factor; row++) {
+            const uint8_t* src = rows[row] + x * factor;
+            for (int i = 0; i < factor; i++) {
+                sum += src[i];
+            }
+        }
+        dst[x] = static_cast<uint8_t>((sum + area / 2) / area);
+    }
+}
+
+void box2Row(const uint8_t* const* rows, int, uint8_t* dst, int width) {
+    const uint8_t* top = rows[0];
+    const uint8_t* bottom = rows[1];
+    for (int x = 0; x < width; x++) {
+        dst[x] = static_cast<uint8_t>((top[2 * x] + top[2 * x + 1] + bottom[2 * x] + bottom[2 * x + 1] + 2) >> 2);
+    }
+}
+
+#ifdef SCALER_X86
+
+// maddubs against a vector of ones adds neighbouring bytes into 16-bit lanes
+__attribute__((target("sse4.1")))
+void box2RowSse41(const uint8_t* const* rows, int factor, uint8_t* dst, int width) {
+    const uint8_t* top = rows[0];
+    const uint8_t* bottom = rows[1];
+    const __m128i ones = _mm_set1_epi8(1);
+    const __m128i two = _mm_set1_epi16(2);
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+        __m128i low = _mm_add_epi16(
+            _mm_maddubs_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(top + 2 * x)), ones),
+            _mm_maddubs_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(bottom + 2 * x)), ones));
+        __m128i high = _mm_add_epi16(
+            _mm_maddubs_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(top + 2 * x + 16)), ones),
+            _mm_maddubs_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(bottom + 2 * x + 16)), ones));
+        low = _mm_srli_epi16(_mm_add_epi16(low, two), 2);
+        high = _mm_srli_epi16(_mm_add_epi16(high, two), 2);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x), _mm_packus_epi16(low, high));
+    }
+    if (x < width) {
+        const uint8_t* tail[2] = {top + 2 * x, bottom + 2 * x};
+        box2Row(tail, factor, dst + x, width - x);
+    }
+}
+
+__attribute__((target("avx2")))
+void box2RowAvx2(const uint8_t* const* rows, int factor, uint8_t* dst, int width) {
+    const uint8_t* top = rows[0];
+    const uint8_t* bottom = rows[1];
+    const __m256i ones = _mm256_set1_epi8(1);
+    const __m256i two = _mm256_set1_epi16(2);
+    int x = 0;
+    for (; x + 32 <= width; x += 32) {
+        __m256i low = _mm256_add_epi16(
+            _mm256_maddubs_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(top + 2 * x)), ones),
+            _mm256_maddubs_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(bottom + 2 * x)), ones));
+        __m256i high = _mm256_add_epi16(
+            _mm256_maddubs_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(top + 2 * x + 32)), ones),
+            _mm256_maddubs_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(bottom + 2 * x + 32)), ones));
+        low = _mm256_srli_epi16(_mm256_add_epi16(low, two), 2);
+        high = _mm256_srli_epi16(_mm256_add_epi16(high, two), 2);
+        // packus works per 128-bit lane; put the lanes back in order
+        __m256i packed = _mm256_packus_epi16(low, high);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + x), _mm256_permute4x64_epi64(packed, 0xD8));
+    }
+    if (x < width) {
+        const uint8_t* tail[2] = {top + 2 * x, bottom + 2 * x};
+        box2RowSse41(tail, factor, dst + x, width - x);
+    }
+}
+
+#endif
+
+#ifdef SCALER_NEON
+
+void box2RowNeon(const uint8_t* const* rows, int factor, uint8_t* dst, int width) {
+    const uint8_t* top = rows[0];
+    const uint8_t* bottom = rows[1];
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+        uint16x8_t low = vpadalq_u8(vpaddlq_u8(vld1q_u8(top + 2 * x)), vld1q_u8(bottom + 2 * x));
+        uint16x8_t high = vpadalq_u8(vpaddlq_u8(vld1q_u8(top + 2 * x + 16)), vld1q_u8(bottom + 2 * x + 16));
+        vst1q_u8(dst + x, vcombine_u8(vrshrn_n_u16(low, 2), vrshrn_n_u16(high, 2)));
+    }
+    if (x < width) {
+        const uint8_t* tail[2] = {top + 2 * x, bottom + 2 * x};
+        box2Row(tail, factor, dst + x, width - x);
+    }
+}
+
+#endif
+
+// Fastest 2:1 kernel this CPU runs
+Scaler::RowKernel pickBox2Kernel(const char*& name) {
+#ifdef SCALER_X86
+    if (__builtin_cpu_supports("avx2")) {
+        name = "box2-avx2";
+        return box2RowAvx2;
+    }
+    if (__builtin_cpu_supports("sse4.1")) {
+        name = "box2-sse4.1";
+        return box2RowSse41;
+    }
+#endif
+#ifdef SCALER_NEON
+    name = "box2-neon";
+    return box2RowNeon;
+#endif
+    name = "box2";
+    return box2Row;
+}
+
+// 8-bit planar YUV or gray, the layouts the box kernels understand
+bool isPlanar8Bit(const AVPixFmtDescriptor* desc) {
+    const uint64_t unsupported = AV_PIX_FMT_FLAG_RGB | AV_PIX_FMT_FLAG_PAL |
+                                 AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_BITSTREAM;
+    if (!desc || (desc->flags & unsupported)) {
+        return false;
+    }
+    if (desc->nb_components > 1 && !(desc->flags & AV_PIX_FMT_FLAG_PLANAR)) {
+        return false;
+    }
+    for (int i = 0; i < desc->nb_components; i++) {
+        if (desc->comp[i].depth != 8 || desc->comp[i].step != 1) {
+            return false;
+        }
+    }
+    return true;
+}
+
+} // namespace
+
+const char* scaleQualityName(ScaleQuality quality) {
+    switch (quality) {
+        case ScaleQuality::Fast: return "fast";
+        case ScaleQuality::Bilinear: return "bilinear";
+        case ScaleQuality::Lanczos: return "lanczos";
+    }
+    return "unknown";
+}
+
+bool parseScaleQuality(const std::string& name, ScaleQuality& quality) {
+    for (ScaleQuality candidate : {ScaleQuality::Fast, ScaleQuality::Bilinear, ScaleQuality::Lanczos}) {
+        if (name == scaleQualityName(candidate)) {
+            quality = candidate;
+            return true;
+        }
+    }
+    return false;
+}
+
+Scaler::~Scaler() {
+    reset();
+}
+
+void Scaler::reset() {
+    stopWorkers();
+    if (swsContext) {
+        sws_freeContext(swsContext);
+        swsContext = nullptr;
+    }
+    boxFactor = 0;
+    rowKernel = nullptr;
+    planeCount = 0;
+    kernel = "none";
+}
+
+void Scaler::stopWorkers() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    workers.clear();
+    stopping = false;
+    generation = 0;
+}
+
+bool Scaler::init(int srcWidth, int srcHeight, int srcFormat, int dstWidth, int dstHeight, int dstFormat,
+                  ScaleQuality quality, int sliceThreads) {
+    reset();
+    
+    // A 2:1 box is exactly bilinear sampling at the output pixel centres;
+    // wider boxes are only taken when speed was asked for
+    const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(static_cast<AVPixelFormat>(srcFormat));
+    int factor = dstWidth > 0 ? srcWidth / dstWidth : 0;
+    bool boxRatio = srcFormat == dstFormat && factor >= 2 && factor <= MAX_BOX_FACTOR &&
+                    srcWidth == dstWidth * factor && srcHeight == dstHeight * factor;
+    bool boxAllowed = quality == ScaleQuality::Fast || (quality == ScaleQuality::Bilinear && factor == 2);
+    
+    if (boxRatio && boxAllowed && isPlanar8Bit(desc)) {
+        planeCount = av_pix_fmt_count_planes(static_cast<AVPixelFormat>(srcFormat));
+        bool exact = planeCount > 0 && planeCount <= 4;
+        for (int plane = 0; exact && plane < planeCount; plane++) {
+            // Chroma planes must divide evenly too, or edge pixels would be lost
+            bool chroma = (plane == 1 || plane == 2) && desc->nb_components >= 3;
+            int shiftX = chroma ? desc->log2_chroma_w : 0;
+            int shiftY = chroma ? desc->log2_chroma_h : 0;
+            planeWidths[plane] = AV_CEIL_RSHIFT(dstWidth, shiftX);
+            planeHeights[plane] = AV_CEIL_RSHIFT(dstHeight, shiftY);
+            exact = AV_CEIL_RSHIFT(srcWidth, shiftX) == planeWidths[plane] * factor &&
+                    AV_CEIL_RSHIFT(srcHeight, shiftY) == planeHeights[plane] * factor;
+        }
+        
+        if (exact) {
+            boxFactor = factor;
+            if (factor == 2) {
+                rowKernel = pickBox2Kernel(kernel);
+            } else {
+                rowKernel = boxRow;
+                kernel = "box";
+            }
+            
+            int bands = std::max(1, std::min(sliceThreads, planeHeights[0] / MIN_BAND_ROWS));
+            pendingBands = 0;
+            for (int band = 1; band < bands; band++) {
+                workers.emplace_back(&Scaler::sliceWorker, this, band);
+            }
+            return true;
+        }
+        planeCount = 0;
+    }
+    
+    int flags = SWS_BILINEAR;
+    kernel = "swscale-bilinear";
+    if (quality == ScaleQuality::Fast) {
+        flags = SWS_FAST_BILINEAR;
+        kernel = "swscale-fast-bilinear";
+    } else if (quality == ScaleQuality::Lanczos) {
+        flags = SWS_LANCZOS;
+        kernel = "swscale-lanczos";
+    }
+#if SCALER_SWS_THREADS
+    swsContext = sws_alloc_context();
+    if (swsContext) {
+        av_opt_set_int(swsContext, "srcw", srcWidth, 0);
+        av_opt_set_int(swsContext, "srch", srcHeight, 0);
+        av_opt_set_int(swsContext, "src_format", srcFormat, 0);
+        av_opt_set_int(swsContext, "dstw", dstWidth, 0);
+        av_opt_set_int(swsContext, "dsth", dstHeight, 0);
+        av_opt_set_int(swsContext, "dst_format", dstFormat, 0);
+        av_opt_set_int(swsContext, "sws_flags", flags, 0);
+        av_opt_set_int(swsContext, "threads", std::max(1, sliceThreads), 0);
+        if (sws_init_context(swsContext, nullptr, nullptr) < 0) {
+            sws_freeContext(swsContext);
+            swsContext = nullptr;
+        }
+    }
+#else
+    swsContext = sws_getContext(srcWidth, srcHeight, static_cast<AVPixelFormat>(srcFormat),
+                                dstWidth, dstHeight, static_cast<AVPixelFormat>(dstFormat),
+                                flags, nullptr, nullptr, nullptr);
+#endif
+    if (!swsContext) {
+        std::cerr << "Could not initialize scaling context" << std::endl;
+        kernel = "none";
+        return false;
+    }
+    return true;
+}
+
+bool Scaler::scale(const AVFrame* src, AVFrame* dst) {
+    if (swsContext) {
+#if SCALER_SWS_THREADS
+        return sws_scale_frame(swsContext, dst, src) >= 0;
+#else
+        sws_scale(swsContext, src->data, src->linesize, 0, src->height, dst->data, dst->linesize);
+        return true;
+#endif
+    }
+    if (!boxFactor) {
+        return false;
+    }
+    
+    if (workers.empty()) {
+        currentSrc = src;
+        currentDst = dst;
+        scaleBand(0);
+        return true;
+    }
+    
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        currentSrc = src;
+        currentDst = dst;
+        pendingBands = static_cast<int>(workers.size());
+        generation++;
+    }
+    wake.notify_all();
+    scaleBand(0);
+    
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [this] { return pendingBands == 0; });
+    return true;
+}
+
+void Scaler::scaleBand(int band) {
+    int bands = static_cast<int>(workers.size()) + 1;
+    const uint8_t* rows[MAX_BOX_FACTOR];
+    for (int plane = 0; plane < planeCount; plane++) {
+        int height = planeHeights[plane];
+        int firstRow = height * band / bands;
+        int lastRow = height * (band + 1) / bands;
+        const uint8_t* srcPlane = currentSrc->data[plane];
+        int srcStride = currentSrc->linesize[plane];
+        for (int y = firstRow; y < lastRow; y++) {
+            for (int i = 0; i < boxFactor; i++) {
+                rows[i] = srcPlane + static_cast<ptrdiff_t>(y * boxFactor + i) * srcStride;
+            }
+            rowKernel(rows, boxFactor, currentDst->data[plane] + static_cast<ptrdiff_t>(y) * currentDst->linesize[plane],
+                      planeWidths[plane]);
+        }
+    }
+}
+
+void Scaler::sliceWorker(int band) {
+    uint64_t seen = 0;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [&] { return stopping || generation != seen; });
+            if (stopping) {
+                return;
+            }
+            seen = generation;
+        }
+        
+        scaleBand(band);
+        
+        std::lock_guard<std::mutex> lock(mutex);
+        if (--pendingBands == 0) {
+            done.notify_one();
+        }
+    }
+}
@@ -0,0 +1,125 @@
+#include "scene_analysis.hpp"
+#include <cstddef>
+#include <cstdlib>
+
+extern "C" {
+#include <libavutil/frame.h>
+}
+
+namespace {
+
+// Weight of the newest frame in the scene's smoothed motion and detail
+constexpr double SMOOTHING = 0.1;
+
+double smooth(double average, double value) {
+    return average < 0.0 ? value : average + (value - average) * SMOOTHING;
+}
+
+// Mean difference between horizontally and vertically neighbouring samples
+double detail(const std::vector<uint8_t>& samples, int width, int height) {
+    int64_t sum = 0;
+    int64_t count = 0;
+    for (int y = 0; y < height; y++) {
+        const uint8_t* row = samples.data() + static_cast<size_t>(y) * width;
+        const uint8_t* below = y + 1 < height ? row + width : nullptr;
+        for (int x = 0; x < width; x++) {
+            if (x + 1 < width) {
+                sum += std::abs(row[x] - row[x + 1]);
+                count++;
+            }
+            if (below) {
+                sum += std::abs(row[x] - below[x]);
+                count++;
+            }
+        }
+    }
+    return count > 0 ? static_cast<double>(sum) / count : 0.0;
+}
+
+} // namespace
+
+void SceneAnalyzer::reset() {
+    previous.clear();
+    kept.clear();
+    sampleWidth = 0;
+    sampleHeight = 0;
+    motion = -1.0;
+    complexity = 0.0;
+    sceneFrames = 0;
+    keptSeconds = 0.0;
+    crfOffset = 0;
+}
+
+bool SceneAnalyzer::sample(const AVFrame* frame) {
+    int width = (frame->width + SAMPLE_STEP - 1) / SAMPLE_STEP;
+    int height = (frame->height + SAMPLE_STEP - 1) / SAMPLE_STEP;
+    bool sameGeometry = width == sampleWidth && height == sampleHeight;
+    sampleWidth = width;
+    sampleHeight = height;
+    current.resize(static_cast<size_t>(width) * height);
+    
+    uint8_t* out = current.data();
+    for (int y = 0; y < frame->height; y += SAMPLE_STEP) {
+        const uint8_t* row = frame->data[0] + static_cast<ptrdiff_t>(y) * frame->linesize[0];
+        for (int x = 0; x < frame->width; x += SAMPLE_STEP) {
+            *out++ = row[x];
+        }
+    }
+    return sameGeometry;
+}
+
+SceneDecision SceneAnalyzer::analyze(const AVFrame* frame, double ptsSeconds) {
+    SceneDecision decision;
+    
+    if (!sample(frame) || previous.empty()) {
+        // First frame of the job, or the picture size changed: a new scene
+        decision.sceneCut = true;
+    } else {
+        int64_t difference = 0;
+        bool changed = false;
+        for (size_t i = 0; i < current.size(); i++) {
+            difference += std::abs(current[i] - previous[i]);
+            changed = changed || std::abs(current[i] - kept[i]) > NOISE_LEVEL;
+        }
+        double meanDifference = static_cast<double>(difference) / current.size();
+        
+        decision.sceneCut = sceneFrames >= MIN_SCENE_FRAMES && meanDifference > CUT_DIFFERENCE &&
+                            (motion < 0.0 || meanDifference > CUT_MOTION_RATIO * motion);
+        if (!decision.sceneCut) {
+            motion = smooth(motion, meanDifference);
+            decision.drop = !changed && ptsSeconds >= 0.0 && ptsSeconds - keptSeconds < MAX_HOLD_SECONDS;
+        }
+    }
+    
+    double frameDetail = detail(current, sampleWidth, sampleHeight);
+    if (decision.sceneCut) {
+        // Motion of the new scene is unknown until it has a few frames
+        motion = -1.0;
+        complexity = frameDetail;
+        sceneFrames = 0;
+        crfOffset = 0;
+    } else {
+        complexity = smooth(complexity, frameDetail);
+    }
+    sceneFrames++;
+    
+    // Settle on the scene's CRF once it has MIN_SCENE_FRAMES frames, then
+    // revisit it at the same spacing, so the rate control is not thrashed
+    if (sceneFrames % MIN_SCENE_FRAMES == 0 && motion >= 0.0) {
+        if (motion < STATIC_MOTION && complexity < DETAILED_COMPLEXITY) {
+            crfOffset = STATIC_CRF_OFFSET;
+        } else if (motion > HIGH_MOTION) {
+            crfOffset = HIGH_MOTION_CRF_OFFSET;
+        } else {
+            crfOffset = 0;
+        }
+    }
+    decision.crfOffset = crfOffset;
+    
+    if (!decision.drop) {
+        kept = current;
+        keptSeconds = ptsSeconds;
+    }
+    previous.swap(current);
+    return decision;
+}
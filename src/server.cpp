@@ -1,92 +1,1054 @@
 #include <httplib.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <ctime>
 #include <iostream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <filesystem>
+#include <fstream>
+#include <set>
+#include <sstream>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include "cluster.hpp"
+#include "content_cache.hpp"
+#include "file_cache.hpp"
+#include "job_journal.hpp"
+#include "job_scheduler.hpp"
+#include "stream_input.hpp"
+#include "transcode_metrics.hpp"
 #include "video_processor.hpp"
 
 namespace fs = std::filesystem;
 
-int main() {
+namespace {
+
+std::string jsonEscape(const std::string& value) {
+    std::string escaped;
+    for (char c : value) {
+        switch (c) {
+            case '"': escaped += "\\\""; break;
+            case '\\': escaped += "\\\\"; break;
+            case '\n': escaped += "\\n"; break;
+            case '\r': escaped += "\\r"; break;
+            case '\t': escaped += "\\t"; break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20) {
+                    char buffer[8];
+                    snprintf(buffer, sizeof(buffer), "\\u%04x", c);
+                    escaped += buffer;
+                } else {
+                    escaped += c;
+                }
+        }
+    }
+    return escaped;
+}
+
+std::string jobStatusJson(const JobStatus& status) {
+    std::ostringstream json;
+    json << "{\"id\":\"" << jsonEscape(status.id) << "\""
+         << ",\"status\":\"" << jobStateName(status.state) << "\""
+         << ",\"priority\":\"" << jobPriorityName(status.priority) << "\""
+         << ",\"preemptions\":" << status.preemptions
+         << ",\"output\":\"" << jsonEscape(status.outputPath) << "\""
+         << ",\"queued_seconds\":" << status.queuedSeconds
+         << ",\"run_seconds\":" << status.runSeconds
+         << ",\"frames\":" << status.framesEncoded;
+    // Unknown for uploads still arriving, which have no duration yet
+    json << ",\"progress\":";
+    if (status.progress >= 0.0) {
+        json << status.progress;
+    } else {
+        json << "null";
+    }
+    json << ",\"eta_seconds\":";
+    if (status.etaSeconds >= 0.0) {
+        json << status.etaSeconds;
+    } else {
+        json << "null";
+    }
+    json << "}";
+    return json.str();
+}
+
+bool jobFinished(const JobStatus& status) {
+    return status.state != JobState::Queued && status.state != JobState::Running;
+}
+
+// Default sprite of a job, made as soon as a seekable copy of the video exists
+std::string spritePath(const std::string& jobId) {
+    return "thumbnails/" + jobId + ".jpg";
+}
+
+bool writeFile(const std::string& path, const std::string& data) {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write(data.data(), data.size());
+    return out.good();
+}
+
+void logJobFinished(const JobStatus& status) {
+    std::cout << "Job " << status.id << " " << jobStateName(status.state)
+              << " in " << status.runSeconds << "s" << std::endl;
+}
+
+std::string mediaInfoJson(const MediaInfo& info) {
+    std::ostringstream json;
+    json << "{\"container\":\"" << jsonEscape(info.container) << "\""
+         << ",\"duration_seconds\":" << info.durationSeconds
+         << ",\"bit_rate\":" << info.bitRate
+         << ",\"video\":{\"codec\":\"" << jsonEscape(info.videoCodec) << "\""
+         << ",\"width\":" << info.width
+         << ",\"height\":" << info.height
+         << ",\"frame_rate\":" << info.frameRate
+         << ",\"pixel_format\":\"" << jsonEscape(info.pixelFormat) << "\"}";
+    json << ",\"audio\":";
+    if (info.audioCodec.empty()) {
+        json << "null";
+    } else {
+        json << "{\"codec\":\"" << jsonEscape(info.audioCodec) << "\""
+             << ",\"sample_rate\":" << info.sampleRate
+             << ",\"channels\":" << info.channels << "}";
+    }
+    json << "}";
+    return json.str();
+}
+
+// Every processor in the server probes fast and shares what it found, so
+// an upload is probed once for its thumbnails, its transcode and its segments
+void configureProbing(VideoProcessor& processor) {
+    static ProbeCache probes;
+    processor.setFastProbe(true);
+    processor.setProbeCache(&probes);
+}
+
+// Cache key of an upload, known only once the whole body has been hashed.
+// Shared with the job so a finished output can be moved into the cache.
+class PendingCacheKey {
+public:
+    void set(const std::string& value) {
+        std::lock_guard<std::mutex> lock(mutex);
+        key = value;
+    }
+    
+    std::string get() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return key;
+    }
+
+private:
+    mutable std::mutex mutex;
+    std::string key;
+};
+
+// Segment length for spilled uploads, the most a restart can lose of one.
+// Also the most a bulk job runs on once an interactive job wants its worker.
+constexpr int CHECKPOINT_SECONDS = 60;
+
+// Uploads announced larger than this are bulk work unless ?priority= says otherwise
+constexpr uint64_t BULK_UPLOAD_BYTES = 512ULL * 1024 * 1024;
+
+// Transcode of an upload spilled to disk, also used for jobs recovered
+// from the journal. With a coordinator, its segments are shared with the
+// cluster workers connected when it starts.
+JobScheduler::Task spilledUploadTask(std::string upload, std::string work, ScaleQuality quality,
+                                     bool sceneAdaptive, Coordinator* coordinator) {
+    return [upload, work, quality, sceneAdaptive, coordinator](VideoProcessor& processor) {
+        processor.setScaleQuality(quality);
+        processor.setFragmentedOutput(true);
+        processor.setSceneAdaptive(sceneAdaptive);
+        configureProbing(processor);
+        processor.setCheckpointInterval(CHECKPOINT_SECONDS);
+        if (coordinator) {
+            processor.setSegmentRunner(coordinator->segmentRunner(), coordinator->capacity());
+        }
+        bool processed = processor.processVideo(upload, work);
+        // Workers reuse their processor
+        processor.setCheckpointInterval(0);
+        processor.setSegmentRunner(nullptr, 0);
+        return processed;
+    };
+}
+
+// The work file plus any segments and plan kept next to it
+void removeWorkFiles(const std::string& work) {
+    std::string prefix = fs::path(work).filename().string();
+    std::error_code error;
+    for (const auto& entry : fs::directory_iterator(fs::path(work).parent_path(), error)) {
+        if (entry.path().filename().string().rfind(prefix, 0) == 0) {
+            fs::remove(entry.path(), error);
+        }
+    }
+}
+
+// Outputs are written to a private work path and only enter the cache,
+// under their content key, once complete
+JobScheduler::CompletionCallback completionHandler(ResultCache& resultCache, JobJournal& journal,
+                                                   std::shared_ptr<PendingCacheKey> key, std::string work) {
+    return [&resultCache, &journal, key, work](const JobStatus& status) {
+        logJobFinished(status);
+        // Clean up input file
+        if (!status.inputPath.empty()) {
+            fs::remove(status.inputPath);
+        }
+        
+        std::string cacheKey = key->get();
+        bool cached = status.state == JobState::Succeeded && !cacheKey.empty() &&
+                      resultCache.insert(cacheKey, work);
+        removeWorkFiles(work);
+        // Only spilled uploads are journaled
+        if (!status.inputPath.empty()) {
+            journal.recordFinished(status.id);
+        }
+        if (!cached) {
+            return;
+        }
+        
+        // Streamed uploads could not be sought during ingest; use the output
+        if (!fs::exists(spritePath(status.id))) {
+            std::string sprite;
+            VideoProcessor thumbnailer;
+            configureProbing(thumbnailer);
+            if (thumbnailer.extractThumbnails(resultCache.pathFor(cacheKey), ThumbnailOptions(), sprite)) {
+                writeFile(spritePath(status.id), sprite);
+            }
+        }
+    };
+}
+
+// Removes what jobs that will never run again left behind: uploads, work
+// files, segments and sprites no resumed job refers to. Returns the highest
+// upload number still in use, so new uploads are numbered past it.
+unsigned long long removeOrphans(const std::vector<JournaledJob>& resumed) {
+    std::set<std::string> uploads;
+    std::set<std::string> sprites;
+    std::vector<std::string> workPrefixes;
+    for (const JournaledJob& job : resumed) {
+        uploads.insert(fs::path(job.inputPath).filename().string());
+        sprites.insert(fs::path(spritePath(job.id)).filename().string());
+        workPrefixes.push_back(fs::path(job.workPath).filename().string());
+    }
+    
+    unsigned long long highest = 0;
+    std::error_code error;
+    for (const char* directory : {"uploads", "processing", "thumbnails"}) {
+        for (const auto& entry : fs::directory_iterator(directory, error)) {
+            std::string name = entry.path().filename().string();
+            bool kept;
+            if (directory == std::string("uploads")) {
+                kept = uploads.count(name) > 0;
+            } else if (directory == std::string("thumbnails")) {
+                kept = sprites.count(name) > 0;
+            } else {
+                kept = std::any_of(workPrefixes.begin(), workPrefixes.end(),
+                                   [&name](const std::string& prefix) { return name.rfind(prefix, 0) == 0; });
+            }
+            if (!kept) {
+                fs::remove_all(entry.path(), error);
+            } else if (directory != std::string("thumbnails")) {
+                highest = std::max(highest, std::strtoull(name.c_str(), nullptr, 10));
+            }
+        }
+    }
+    return highest;
+}
+
+// Routes an upload body as it arrives. Containers that can be read front to
+// back are transcoded straight from the request body through a StreamInput
+// when a worker is free; files that need seeking (moov at the end), and
+// uploads that would have to wait for a worker, are spilled to disk and
+// queued once complete. The body is hashed on the way through so identical uploads
+// are answered from the result cache.
+class UploadIngest {
+public:
+    UploadIngest(JobScheduler& scheduler, ResultCache& cache, JobJournal& journal, Coordinator* coordinator,
+                 std::string outputSignature, ScaleQuality scaleQuality, bool sceneAdaptive,
+                 JobOptions jobOptions, std::string inputPath, std::string workPath)
+        : scheduler(scheduler), cache(cache), journal(journal), coordinator(coordinator),
+          outputSignature(std::move(outputSignature)), scaleQuality(scaleQuality), sceneAdaptive(sceneAdaptive),
+          jobOptions(jobOptions), inputPath(std::move(inputPath)), workPath(std::move(workPath)),
+          cacheKey(std::make_shared<PendingCacheKey>()) {}
+    
+    // Returns false to stop reading the body
+    bool write(const char* data, size_t size) {
+        hasher.update(data, size);
+        switch (mode) {
+            case Mode::Sniffing: {
+                head.append(data, size);
+                StreamLayout layout = classifyStreamHead(head.data(), head.size());
+                if (layout == StreamLayout::Sequential) {
+                    return startStreaming();
+                }
+                if (layout == StreamLayout::NeedsSeeking || head.size() >= MAX_SNIFF_BYTES) {
+                    return startSpilling();
+                }
+                return true;
+            }
+            case Mode::Streaming:
+                return input->write(data, size);
+            case Mode::Spilling:
+                spill.write(data, size);
+                return spill.good();
+        }
+        return false;
+    }
+    
+    // Called once the body has been read. Returns false if the upload was
+    // neither queued nor answered from the cache.
+    bool finish(bool uploadComplete) {
+        if (mode == Mode::Sniffing) {
+            // Small upload that never showed its layout
+            if (head.empty() || !startSpilling()) {
+                return false;
+            }
+        }
+        
+        std::string key = ResultCache::makeKey(hasher.finishHex(), outputSignature);
+        if (uploadComplete && cache.lookup(key, cachedOutput)) {
+            // Identical upload already transcoded: stop any work started for this one
+            if (mode == Mode::Streaming) {
+                input->fail();
+            } else {
+                spill.close();
+                fs::remove(inputPath);
+            }
+            return true;
+        }
+        cacheKey->set(key);
+        
+        if (mode == Mode::Streaming) {
+            if (uploadComplete) {
+                scheduler.setOutputPath(jobId, cache.pathFor(key));
+                input->finish();
+            } else {
+                // The client went away mid-upload; nobody will collect the output
+                input->fail();
+                scheduler.cancel(jobId);
+            }
+            return true;
+        }
+        
+        spill.close();
+        if (!uploadComplete) {
+            fs::remove(inputPath);
+            return false;
+        }
+        
+        // Thumbnails take milliseconds, so they are ready long before the
+        // transcode, which deletes the upload when it finishes
+        std::string sprite;
+        VideoProcessor thumbnailer;
+        configureProbing(thumbnailer);
+        thumbnailer.extractThumbnails(inputPath, ThumbnailOptions(), sprite);
+        
+        // Checkpointed, so it can give its worker up between segments
+        JobOptions options = jobOptions;
+        options.preemptible = true;
+        // The upload is on disk, so the job can be run again after a crash.
+        // Journaled before a worker can take it, so a crash right after
+        // admission is recovered and a quick finish is never logged first.
+        JournaledJob record{"", inputPath, workPath, key, scaleQualityName(scaleQuality),
+                            jobPriorityName(jobOptions.priority), sceneAdaptive ? "1" : "0"};
+        jobId = scheduler.submit(inputPath, cache.pathFor(key),
+                                 spilledUploadTask(inputPath, workPath, scaleQuality, sceneAdaptive, coordinator),
+                                 completionHandler(cache, journal, cacheKey, workPath), options,
+                                 [this, &record](const std::string& id) {
+                                     scheduler.setWorkPath(id, workPath);
+                                     record.id = id;
+                                     journal.recordQueued(record);
+                                 });
+        if (jobId.empty()) {
+            rejected = true;
+            fs::remove(inputPath);
+            return false;
+        }
+        if (!sprite.empty()) {
+            writeFile(spritePath(jobId), sprite);
+        }
+        return true;
+    }
+    
+    const std::string& id() const { return jobId; }
+    bool wasRejected() const { return rejected; }
+    bool isStreaming() const { return mode == Mode::Streaming; }
+    bool wasCached() const { return !cachedOutput.empty(); }
+    const std::string& cachedOutputPath() const { return cachedOutput; }
+
+private:
+    enum class Mode { Sniffing, Streaming, Spilling };
+    
+    // Give up on sniffing and spill to disk past this much buffered head
+    static constexpr size_t MAX_SNIFF_BYTES = 1024 * 1024;
+    
+    bool startStreaming() {
+        mode = Mode::Streaming;
+        input = std::make_shared<StreamInput>();
+        
+        // The ring buffer only drains while the transcode runs, so a queued
+        // job would stall the upload. Without a free worker, spill instead.
+        JobOptions options = jobOptions;
+        options.startNow = true;
+        std::shared_ptr<StreamInput> streamInput = input;
+        std::string work = workPath;
+        ScaleQuality quality = scaleQuality;
+        bool adaptive = sceneAdaptive;
+        jobId = scheduler.submit("", work,
+            [streamInput, work, quality, adaptive](VideoProcessor& processor) {
+                processor.setScaleQuality(quality);
+                processor.setFragmentedOutput(true);
+                processor.setSceneAdaptive(adaptive);
+                configureProbing(processor);
+                bool processed = processor.processStream(*streamInput, work);
+                // Unblock the upload if the transcode stopped early
+                streamInput->abort();
+                return processed;
+            },
+            completionHandler(cache, journal, cacheKey, workPath), options);
+        if (jobId.empty()) {
+            input.reset();
+            return startSpilling();
+        }
+        scheduler.setWorkPath(jobId, workPath);
+        
+        bool written = input->write(head.data(), head.size());
+        head.clear();
+        return written;
+    }
+    
+    bool startSpilling() {
+        mode = Mode::Spilling;
+        spill.open(inputPath, std::ios::binary);
+        spill.write(head.data(), head.size());
+        head.clear();
+        return spill.good();
+    }
+    
+    JobScheduler& scheduler;
+    ResultCache& cache;
+    JobJournal& journal;
+    Coordinator* coordinator;
+    std::string outputSignature;
+    ScaleQuality scaleQuality;
+    bool sceneAdaptive;
+    JobOptions jobOptions;
+    std::string inputPath;
+    std::string workPath;
+    std::shared_ptr<PendingCacheKey> cacheKey;
+    ContentHasher hasher;
+    Mode mode = Mode::Sniffing;
+    std::string head;
+    std::shared_ptr<StreamInput> input;
+    std::ofstream spill;
+    std::string jobId;
+    std::string cachedOutput;
+    bool rejected = false;
+};
+
+// Bytes handed to the socket per provider call when serving downloads
+constexpr size_t DOWNLOAD_CHUNK_SIZE = 1024 * 1024;
+
+// Interval between status lines streamed to clients waiting on a job
+constexpr std::chrono::seconds PROGRESS_INTERVAL(1);
+
+// Wait between looks at a growing output that had nothing new
+constexpr std::chrono::milliseconds TAIL_INTERVAL(200);
+
+// Follows a job's output while it is muxed, for a chunked response. The
+// descriptor stays valid when the finished file is moved into the cache,
+// so reading carries on to the end without a gap.
+class OutputTail {
+public:
+    OutputTail(JobScheduler& scheduler, std::string jobId)
+        : scheduler(scheduler), jobId(std::move(jobId)), buffer(DOWNLOAD_CHUNK_SIZE) {}
+    
+    ~OutputTail() {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+    
+    OutputTail(const OutputTail&) = delete;
+    OutputTail& operator=(const OutputTail&) = delete;
+    
+    // One provider call: sends what is new or waits a little. Returns false
+    // to abort the response, so a failed job never looks like a short file.
+    bool next(httplib::DataSink& sink) {
+        // Status before reading: once the job has ended, everything is on disk
+        JobStatus status;
+        if (!scheduler.getStatus(jobId, status)) {
+            return false;
+        }
+        bool finished = jobFinished(status);
+        bool succeeded = status.state == JobState::Succeeded;
+        if (finished && !succeeded && fd < 0) {
+            return false;
+        }
+        
+        if (fd < 0) {
+            // Not created while the job is queued; a job that finished in
+            // the meantime is read from the cache instead
+            std::string path = succeeded ? status.outputPath : status.workPath;
+            fd = open(path.c_str(), O_RDONLY);
+            if (fd < 0) {
+                if (finished) {
+                    return false;
+                }
+                std::this_thread::sleep_for(TAIL_INTERVAL);
+                return true;
+            }
+        }
+        
+        ssize_t n = pread(fd, buffer.data(), buffer.size(), offset);
+        if (n < 0) {
+            return false;
+        }
+        if (n > 0) {
+            offset += n;
+            return sink.write(buffer.data(), static_cast<size_t>(n));
+        }
+        if (finished) {
+            if (!succeeded) {
+                return false;
+            }
+            sink.done();
+            return true;
+        }
+        std::this_thread::sleep_for(TAIL_INTERVAL);
+        return true;
+    }
+
+private:
+    JobScheduler& scheduler;
+    std::string jobId;
+    std::vector<char> buffer;
+    int fd = -1;
+    off_t offset = 0;
+};
+
+// IMF-fixdate as used by Last-Modified
+std::string httpDate(int64_t seconds) {
+    time_t time = static_cast<time_t>(seconds);
+    struct tm utc;
+    gmtime_r(&time, &utc);
+    char buffer[64];
+    strftime(buffer, sizeof(buffer), "%a, %d %b %Y %H:%M:%S GMT", &utc);
+    return buffer;
+}
+
+// If-None-Match holds "*" or a comma separated list of tags, possibly weak
+bool etagMatches(const std::string& header, const std::string& etag) {
+    std::istringstream tags(header);
+    std::string tag;
+    while (std::getline(tags, tag, ',')) {
+        size_t begin = tag.find_first_not_of(" \t");
+        size_t end = tag.find_last_not_of(" \t");
+        if (begin == std::string::npos) {
+            continue;
+        }
+        tag = tag.substr(begin, end - begin + 1);
+        if (tag.rfind("W/", 0) == 0) {
+            tag = tag.substr(2);
+        }
+        if (tag == "*" || tag == etag) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Upper bound on tiles in one requested sprite
+constexpr int MAX_THUMBNAILS = 100;
+
+// Finished outputs kept before least recently used ones are evicted
+constexpr uint64_t RESULT_CACHE_MAX_BYTES = 50ULL * 1024 * 1024 * 1024;
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    // --coordinator [host:]port: cluster workers (video_processor_cli --worker
+    // host:port) connecting there take segments of spilled uploads
+    std::unique_ptr<Coordinator> coordinator;
+    for (int i = 1; i + 1 < argc; i++) {
+        if (std::string(argv[i]) == "--coordinator") {
+            coordinator = std::make_unique<Coordinator>();
+            if (!coordinator->start(argv[++i], clusterToken())) {
+                return 1;
+            }
+        }
+    }
+    
     httplib::Server server;
-    VideoProcessor processor;
     
+    // Each worker owns a processor; admit only as many jobs as the workers can pick up next
+    int workers = JobScheduler::defaultWorkerCount(ThreadingPolicy::TYPICAL_JOB_THREADS);
+    JobScheduler scheduler(workers, workers);
+    
+    // Per-job timing from each worker's processor, aggregated for /metrics
+    MetricsRegistry metrics;
+    scheduler.setJobObserver([&metrics](const JobStatus& status, const VideoProcessor& processor) {
+        metrics.recordJob(status.state == JobState::Succeeded, status.queuedSeconds,
+                          status.runSeconds, processor.getMetrics());
+    });
+
     // Create uploads directory if it doesn't exist
     fs::create_directories("uploads");
     fs::create_directories("processed");
+    fs::create_directories("processing");
+    fs::create_directories("thumbnails");
+    
+    // Outputs are stored as processed/<key>.mp4, keyed by input content and output settings
+    ResultCache cache("processed", "cache_index.tsv", RESULT_CACHE_MAX_BYTES);
+    // Workers reuse their processor, so every job sets its own scale quality
+    // and scene-adaptive mode
+    std::map<std::pair<ScaleQuality, bool>, std::string> outputSignatures;
+    for (ScaleQuality quality : {ScaleQuality::Fast, ScaleQuality::Bilinear, ScaleQuality::Lanczos}) {
+        for (bool adaptive : {false, true}) {
+            VideoProcessor signer;
+            signer.setScaleQuality(quality);
+            signer.setFragmentedOutput(true);
+            signer.setSceneAdaptive(adaptive);
+            outputSignatures[{quality, adaptive}] = signer.outputSignature();
+        }
+    }
+    
+    // Spilled uploads accepted before a crash or restart run again under
+    // their old ids, resuming from their last finished segment
+    JobJournal journal("jobs.journal");
+    std::vector<JournaledJob> resumed;
+    for (const JournaledJob& job : journal.recover()) {
+        ScaleQuality quality;
+        std::error_code error;
+        if (!fs::exists(job.inputPath, error) || !parseScaleQuality(job.scaleQuality, quality)) {
+            journal.recordFinished(job.id);
+            continue;
+        }
+        bool sceneAdaptive = job.sceneAdaptive == "1";
+        // Deadlines were relative to the lost submission and are not kept
+        JobOptions options;
+        options.preemptible = true;
+        parseJobPriority(job.priority, options.priority);
+        auto key = std::make_shared<PendingCacheKey>();
+        key->set(job.cacheKey);
+        scheduler.resume(job.id, job.inputPath, cache.pathFor(job.cacheKey),
+                         spilledUploadTask(job.inputPath, job.workPath, quality, sceneAdaptive, coordinator.get()),
+                         completionHandler(cache, journal, key, job.workPath), options);
+        scheduler.setWorkPath(job.id, job.workPath);
+        std::cout << "Resuming job " << job.id << std::endl;
+        resumed.push_back(job);
+    }
+    // Concurrent uploads may share a file name, so each gets a number
+    std::atomic<unsigned long long> uploadCounter(removeOrphans(resumed));
     
-    // Handle video upload and processing
-    server.Post("/process", [&](const httplib::Request& req, httplib::Response& res) {
+    // Handle video upload and queue it for processing. The body is read
+    // incrementally rather than buffered, so transcoding can start during the upload.
+    server.Post("/process", [&](const httplib::Request& req, httplib::Response& res,
+                                const httplib::ContentReader& content_reader) {
         std::cout << "\nReceived video upload request..." << std::endl;
         
-        if (!req.has_file("video")) {
+        // Resize filter, ?quality=fast|bilinear|lanczos
+        ScaleQuality scaleQuality = ScaleQuality::Bilinear;
+        if (req.has_param("quality") && !parseScaleQuality(req.get_param_value("quality"), scaleQuality)) {
+            res.status = 400;
+            res.set_content("Unknown quality, expected fast, bilinear or lanczos", "text/plain");
+            return;
+        }
+        
+        // Scene cuts as keyframes, repeated frames dropped and CRF per scene, ?adaptive=1
+        bool sceneAdaptive = false;
+        if (req.has_param("adaptive")) {
+            std::string adaptive = req.get_param_value("adaptive");
+            if (adaptive != "0" && adaptive != "1") {
+                res.status = 400;
+                res.set_content("Unknown adaptive, expected 0 or 1", "text/plain");
+                return;
+            }
+            sceneAdaptive = adaptive == "1";
+        }
+        
+        // ?priority=interactive|bulk, else bulk for large uploads; ?deadline=<s> orders jobs of a priority
+        JobOptions jobOptions;
+        uint64_t announcedBytes = std::strtoull(req.get_header_value("Content-Length").c_str(), nullptr, 10);
+        if (announcedBytes > BULK_UPLOAD_BYTES) {
+            jobOptions.priority = JobPriority::Bulk;
+        }
+        if (req.has_param("priority") && !parseJobPriority(req.get_param_value("priority"), jobOptions.priority)) {
+            res.status = 400;
+            res.set_content("Unknown priority, expected interactive or bulk", "text/plain");
+            return;
+        }
+        if (req.has_param("deadline")) {
+            jobOptions.deadlineSeconds = std::atof(req.get_param_value("deadline").c_str());
+        }
+        
+        std::unique_ptr<UploadIngest> ingest;
+        auto startIngest = [&](const std::string& uploadName) {
+            std::string filename = fs::path(uploadName).filename().string();
+            if (filename.empty()) {
+                filename = "upload";
+            }
+            
+            // Concurrent uploads may share a file name
+            std::string upload_id = std::to_string(++uploadCounter);
+            std::string input_path = "uploads/" + upload_id + "_" + filename;
+            std::string work_path = "processing/" + upload_id + ".mp4";
+            
+            std::cout << "Processing video: " << filename << std::endl;
+            ingest = std::make_unique<UploadIngest>(scheduler, cache, journal, coordinator.get(),
+                                                    outputSignatures[{scaleQuality, sceneAdaptive}], scaleQuality,
+                                                    sceneAdaptive, jobOptions, input_path, work_path);
+        };
+        
+        bool complete;
+        if (req.is_multipart_form_data()) {
+            bool inVideoField = false;
+            complete = content_reader(
+                [&](const httplib::MultipartFormData& field) {
+                    inVideoField = field.name == "video" && !ingest;
+                    if (inVideoField) {
+                        startIngest(field.filename);
+                    }
+                    return true;
+                },
+                [&](const char* data, size_t length) {
+                    return !inVideoField || ingest->write(data, length);
+                });
+        } else {
+            // Raw body, e.g. curl --data-binary, named by ?filename=
+            startIngest(req.has_param("filename") ? req.get_param_value("filename") : "upload");
+            complete = content_reader([&](const char* data, size_t length) {
+                return ingest->write(data, length);
+            });
+        }
+        
+        if (!ingest) {
             std::cout << "Error: No video file in request" << std::endl;
             res.status = 400;
             res.set_content("No video file uploaded", "text/plain");
             return;
         }
         
-        const auto& file = req.get_file_value("video");
-        std::string input_path = "uploads/" + file.filename;
-        std::string output_path = "processed/" + fs::path(file.filename).stem().string() + "_processed.mp4";
+        bool queued = ingest->finish(complete);
+        if (ingest->wasCached()) {
+            std::cout << "Serving cached output: " << ingest->cachedOutputPath() << std::endl;
+            res.set_content("{\"status\":\"cached\",\"output\":\"" +
+                            jsonEscape(ingest->cachedOutputPath()) + "\"}", "application/json");
+            return;
+        }
+        if (ingest->wasRejected()) {
+            std::cout << "Job queue full, rejecting upload" << std::endl;
+            res.status = 503;
+            res.set_header("Retry-After", std::to_string(scheduler.retryAfterSeconds()));
+            res.set_content("Server busy, retry later", "text/plain");
+            return;
+        }
+        if (!queued) {
+            std::cout << "Error: Upload incomplete" << std::endl;
+            res.status = 400;
+            res.set_content("Upload incomplete", "text/plain");
+            return;
+        }
         
-        std::cout << "Processing video: " << file.filename << std::endl;
-        std::cout << "Input path: " << input_path << std::endl;
-        std::cout << "Output path: " << output_path << std::endl;
+        std::cout << "Queued job " << ingest->id()
+                  << (ingest->isStreaming() ? " (streamed)" : " (spilled to disk)") << std::endl;
         
-        // Save uploaded file
-        std::ofstream ofs(input_path, std::ios::binary);
-        ofs.write(file.content.c_str(), file.content.size());
-        ofs.close();
+        std::string id = ingest->id();
+        res.set_header("Location", "/jobs/" + id);
         
-        // Process video
-        if (processor.processVideo(input_path, output_path)) {
-            std::cout << "Video processed successfully" << std::endl;
-            res.set_content("Video processed successfully. Output: " + output_path, "text/plain");
-        } else {
-            std::cout << "Error processing video" << std::endl;
+        // ?wait=1 keeps the connection and streams a status line per second
+        // until the job ends. Hanging up cancels the job.
+        if (req.has_param("wait")) {
+            res.set_chunked_content_provider("application/x-ndjson",
+                [&scheduler, id](size_t, httplib::DataSink& sink) {
+                    JobStatus status;
+                    if (!scheduler.getStatus(id, status)) {
+                        sink.done();
+                        return true;
+                    }
+                    std::string line = jobStatusJson(status) + "\n";
+                    if (!sink.write(line.data(), line.size())) {
+                        return false;
+                    }
+                    if (jobFinished(status)) {
+                        sink.done();
+                    } else {
+                        std::this_thread::sleep_for(PROGRESS_INTERVAL);
+                    }
+                    return true;
+                },
+                [&scheduler, id](bool success) {
+                    if (!success) {
+                        std::cout << "Client of job " << id << " disconnected, cancelling" << std::endl;
+                        scheduler.cancel(id);
+                    }
+                });
+            return;
+        }
+        
+        JobStatus status;
+        scheduler.getStatus(id, status);
+        res.status = 202;
+        res.set_content(jobStatusJson(status), "application/json");
+    });
+    
+    // Report job status
+    server.Get("/jobs/([0-9]+)", [&](const httplib::Request& req, httplib::Response& res) {
+        JobStatus status;
+        if (!scheduler.getStatus(req.matches[1].str(), status)) {
+            res.status = 404;
+            res.set_content("Unknown job", "text/plain");
+            return;
+        }
+        res.set_content(jobStatusJson(status), "application/json");
+    });
+    
+    // The job's output as it is muxed. Outputs are fragmented mp4, so the
+    // bytes written so far are already playable and the client can start
+    // long before the transcode ends. Finished jobs redirect to the download.
+    server.Get("/jobs/([0-9]+)/output", [&](const httplib::Request& req, httplib::Response& res) {
+        std::string id = req.matches[1].str();
+        JobStatus status;
+        if (!scheduler.getStatus(id, status)) {
+            res.status = 404;
+            res.set_content("Unknown job", "text/plain");
+            return;
+        }
+        if (status.state == JobState::Succeeded) {
+            res.set_redirect("/" + status.outputPath, 303);
+            return;
+        }
+        if (jobFinished(status) || status.workPath.empty()) {
+            res.status = jobFinished(status) ? 410 : 409;
+            res.set_content(jobStatusJson(status), "application/json");
+            return;
+        }
+        
+        auto tail = std::make_shared<OutputTail>(scheduler, id);
+        res.set_chunked_content_provider("video/mp4",
+            [tail](size_t, httplib::DataSink& sink) {
+                return tail->next(sink);
+            });
+    });
+    
+    // Sprite of preview frames. Without parameters this is the sprite made
+    // at ingest; ?count=N, ?t=1.5,60,600 (seconds), ?width= and
+    // ?format=jpeg|webp render a new one from the input or output on disk.
+    server.Get("/thumbnails/([0-9]+)", [&](const httplib::Request& req, httplib::Response& res) {
+        std::string id = req.matches[1].str();
+        JobStatus status;
+        if (!scheduler.getStatus(id, status)) {
+            res.status = 404;
+            res.set_content("Unknown job", "text/plain");
+            return;
+        }
+        
+        bool custom = req.has_param("count") || req.has_param("t") ||
+                      req.has_param("width") || req.has_param("format");
+        std::string image;
+        if (!custom) {
+            std::ifstream sprite(spritePath(id), std::ios::binary);
+            if (sprite) {
+                image.assign(std::istreambuf_iterator<char>(sprite), std::istreambuf_iterator<char>());
+                res.set_content(image, "image/jpeg");
+                return;
+            }
+        }
+        
+        ThumbnailOptions options;
+        if (req.has_param("count")) {
+            options.count = std::clamp(std::atoi(req.get_param_value("count").c_str()), 1, MAX_THUMBNAILS);
+        }
+        if (req.has_param("width")) {
+            options.width = std::clamp(std::atoi(req.get_param_value("width").c_str()), 16, 1920);
+        }
+        if (req.has_param("t")) {
+            std::istringstream times(req.get_param_value("t"));
+            std::string time;
+            while (std::getline(times, time, ',') && options.timestamps.size() < MAX_THUMBNAILS) {
+                options.timestamps.push_back(std::max(0.0, std::atof(time.c_str())));
+            }
+        }
+        if (req.has_param("format")) {
+            std::string format = req.get_param_value("format");
+            if (format == "webp") {
+                options.format = ThumbnailFormat::WebP;
+            } else if (format != "jpeg" && format != "jpg") {
+                res.status = 400;
+                res.set_content("Unknown format, expected jpeg or webp", "text/plain");
+                return;
+            }
+        }
+        
+        // The upload until the transcode is done, then the output
+        std::string source;
+        std::error_code error;
+        if (status.state == JobState::Succeeded) {
+            source = status.outputPath;
+        } else if (!status.inputPath.empty() && fs::exists(status.inputPath, error)) {
+            source = status.inputPath;
+        }
+        if (source.empty()) {
+            res.status = jobFinished(status) ? 410 : 409;
+            res.set_content("No seekable copy of this video yet", "text/plain");
+            return;
+        }
+        
+        VideoProcessor thumbnailer;
+        configureProbing(thumbnailer);
+        if (!thumbnailer.extractThumbnails(source, options, image)) {
             res.status = 500;
-            res.set_content("Error processing video", "text/plain");
+            res.set_content("Could not extract thumbnails", "text/plain");
+            return;
+        }
+        res.set_content(image, VideoProcessor::thumbnailMimeType(options.format));
+    });
+    
+    // Stream info without transcoding, from a job's upload while it is on
+    // disk, else its output (?job=ID), or from a processed file (?file=NAME).
+    // Probing at upload fills the cache, so this rarely reads the file.
+    server.Get("/probe", [&](const httplib::Request& req, httplib::Response& res) {
+        std::string path;
+        if (req.has_param("job")) {
+            JobStatus status;
+            if (!scheduler.getStatus(req.get_param_value("job"), status)) {
+                res.status = 404;
+                res.set_content("Unknown job", "text/plain");
+                return;
+            }
+            std::error_code error;
+            if (!status.inputPath.empty() && fs::exists(status.inputPath, error)) {
+                path = status.inputPath;
+            } else if (status.state == JobState::Succeeded) {
+                path = status.outputPath;
+            } else {
+                res.status = jobFinished(status) ? 410 : 409;
+                res.set_content("No seekable copy of this video yet", "text/plain");
+                return;
+            }
+        } else if (req.has_param("file")) {
+            // Only plain names inside processed/
+            std::string filename = req.get_param_value("file");
+            if (filename.empty() || fs::path(filename).filename() != filename ||
+                filename == "." || filename == "..") {
+                res.status = 404;
+                return;
+            }
+            path = "processed/" + filename;
+        } else {
+            res.status = 400;
+            res.set_content("Expected ?job= or ?file=", "text/plain");
+            return;
         }
         
-        // Clean up input file
-        fs::remove(input_path);
+        VideoProcessor prober;
+        configureProbing(prober);
+        MediaInfo info;
+        if (!prober.probe(path, info)) {
+            res.status = 422;
+            res.set_content("Could not probe video", "text/plain");
+            return;
+        }
+        res.set_content(mediaInfoJson(info), "application/json");
+    });
+    
+    // Cancel a queued or running job
+    server.Delete("/jobs/([0-9]+)", [&](const httplib::Request& req, httplib::Response& res) {
+        std::string id = req.matches[1].str();
+        JobStatus status;
+        if (!scheduler.getStatus(id, status)) {
+            res.status = 404;
+            res.set_content("Unknown job", "text/plain");
+            return;
+        }
+        if (!scheduler.cancel(id)) {
+            res.status = 409;
+            res.set_content(jobStatusJson(status), "application/json");
+            return;
+        }
+        
+        std::cout << "Cancelling job " << id << std::endl;
+        scheduler.getStatus(id, status);
+        res.status = 202;
+        res.set_content(jobStatusJson(status), "application/json");
     });
     
-    // Serve processed videos
-    server.Get("/processed/(.*)", [](const httplib::Request& req, httplib::Response& res) {
-        std::string filepath = std::string("processed/") + req.matches[1].str();
+    // Serve processed videos straight from mapped memory. Range requests are
+    // answered with 206 by httplib calling the provider for just that span.
+    MappedFileCache downloads;
+    server.Get("/processed/(.*)", [&](const httplib::Request& req, httplib::Response& res) {
+        std::string filename = req.matches[1].str();
+        std::string filepath = "processed/" + filename;
         std::cout << "\nReceived request to download: " << filepath << std::endl;
         
-        if (fs::exists(filepath)) {
-            std::cout << "File found, starting download..." << std::endl;
-            res.set_content_provider(
-                fs::file_size(filepath),
-                "video/mp4",
-                [filepath](size_t offset, size_t length, httplib::DataSink& sink) {
-                    std::ifstream file(filepath, std::ios::binary);
-                    file.seekg(offset);
-                    char buffer[4096];
-                    size_t remaining = length;
-                    while (remaining > 0 && !file.eof()) {
-                        size_t batch_size = std::min(remaining, sizeof(buffer));
-                        file.read(buffer, batch_size);
-                        sink.write(buffer, file.gcount());
-                        remaining -= file.gcount();
-                    }
-                    return true;
-                }
-            );
-        } else {
+        // Only plain names inside processed/
+        if (filename.empty() || fs::path(filename).filename() != filename ||
+            filename == "." || filename == "..") {
+            res.status = 404;
+            return;
+        }
+        
+        std::shared_ptr<const MappedFile> file = downloads.open(filepath);
+        if (!file) {
             std::cout << "File not found: " << filepath << std::endl;
             res.status = 404;
+            return;
         }
+        
+        res.set_header("ETag", file->etag());
+        res.set_header("Last-Modified", httpDate(file->modifiedTime()));
+        res.set_header("Accept-Ranges", "bytes");
+        if (req.has_header("If-None-Match") &&
+            etagMatches(req.get_header_value("If-None-Match"), file->etag())) {
+            res.status = 304;
+            return;
+        }
+        
+        std::cout << "File found, starting download..." << std::endl;
+        res.set_content_provider(
+            file->size(),
+            "video/mp4",
+            [file](size_t offset, size_t length, httplib::DataSink& sink) {
+                // One large write per call; httplib calls again for the rest
+                size_t batch_size = std::min(length, DOWNLOAD_CHUNK_SIZE);
+                return sink.write(file->data() + offset, batch_size);
+            }
+        );
+    });
+    
+    // Prometheus scrape endpoint
+    server.Get("/metrics", [&](const httplib::Request&, httplib::Response& res) {
+        std::ostringstream out;
+        out.precision(9);
+        metrics.render(out);
+        MetricsRegistry::writeGauge(out, "transcode_jobs_running", "Jobs being transcoded",
+                                    scheduler.runningJobs());
+        MetricsRegistry::writeGauge(out, "transcode_jobs_queued", "Jobs waiting for a worker",
+                                    static_cast<double>(scheduler.queuedJobs()));
+        MetricsRegistry::writeGauge(out, "transcode_interactive_jobs_queued", "Interactive jobs waiting for a worker",
+                                    static_cast<double>(scheduler.queuedJobs(JobPriority::Interactive)));
+        MetricsRegistry::writeCounter(out, "transcode_preemptions_total", "Bulk jobs that yielded their worker",
+                                      scheduler.preemptions());
+        MetricsRegistry::writeGauge(out, "transcode_workers", "Transcode workers", scheduler.workerCount());
+        MetricsRegistry::writeGauge(out, "cluster_worker_slots", "Slots of connected cluster workers",
+                                    coordinator ? coordinator->capacity() : 0);
+        MetricsRegistry::writeGauge(out, "result_cache_bytes", "Bytes of outputs in the result cache",
+                                    static_cast<double>(cache.totalBytes()));
+        res.set_content(out.str(), "text/plain; version=0.0.4");
     });
     
     std::cout << "\n=== Video Processing Server ===" << std::endl;
     std::cout << "Server starting on port 8999..." << std::endl;
+    std::cout << "Transcode workers: " << scheduler.workerCount() << std::endl;
     std::cout << "Press Ctrl+C to stop the server" << std::endl;
     std::cout << "================================\n" << std::endl;
     
     server.listen("localhost", 8999);
     
     return 0;
-} 
\ No newline at end of file
+}
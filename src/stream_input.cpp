@@ -0,0 +1,128 @@
+#include "stream_input.hpp"
+#include <algorithm>
+#include <cstring>
+
+namespace {
+
+uint64_t readBigEndian(const unsigned char* data, int bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++) {
+        value = (value << 8) | data[i];
+    }
+    return value;
+}
+
+bool isTopLevelBox(const char* type) {
+    static const char* const boxes[] = {
+        "ftyp", "free", "skip", "wide", "pdin", "uuid", "moov", "mdat", "styp", "moof", "sidx"
+    };
+    for (const char* box : boxes) {
+        if (std::memcmp(type, box, 4) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+} // namespace
+
+StreamLayout classifyStreamHead(const char* data, size_t size) {
+    const auto* bytes = reinterpret_cast<const unsigned char*>(data);
+    
+    // Walk the ISO BMFF top-level boxes until we meet moov or mdat
+    uint64_t offset = 0;
+    while (offset + 8 <= size) {
+        uint64_t boxSize = readBigEndian(bytes + offset, 4);
+        const char* type = data + offset + 4;
+        
+        if (!isTopLevelBox(type)) {
+            // Not MOV/MP4 (or not at a box boundary): MXF, MKV, TS etc. read front to back
+            return offset == 0 ? StreamLayout::Sequential : StreamLayout::NeedsSeeking;
+        }
+        if (std::memcmp(type, "moov", 4) == 0 || std::memcmp(type, "moof", 4) == 0) {
+            return StreamLayout::Sequential;
+        }
+        if (std::memcmp(type, "mdat", 4) == 0) {
+            // Sample data before the index: the demuxer would have to seek back
+            return StreamLayout::NeedsSeeking;
+        }
+        
+        if (boxSize == 1) {
+            if (offset + 16 > size) {
+                return StreamLayout::Undetermined;
+            }
+            boxSize = readBigEndian(bytes + offset + 8, 8);
+        }
+        if (boxSize < 8) {
+            // Box runs to the end of the file, or is malformed
+            return StreamLayout::NeedsSeeking;
+        }
+        offset += boxSize;
+    }
+    return StreamLayout::Undetermined;
+}
+
+StreamInput::StreamInput(size_t capacity)
+    : buffer(std::max<size_t>(capacity, 1)) {}
+
+bool StreamInput::write(const char* data, size_t size) {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (size > 0) {
+        spaceAvailable.wait(lock, [this] { return used < buffer.size() || aborted; });
+        if (aborted) {
+            return false;
+        }
+        
+        size_t writePos = (readPos + used) % buffer.size();
+        size_t chunk = std::min({size, buffer.size() - used, buffer.size() - writePos});
+        std::memcpy(buffer.data() + writePos, data, chunk);
+        used += chunk;
+        totalWritten += chunk;
+        data += chunk;
+        size -= chunk;
+        dataAvailable.notify_one();
+    }
+    return true;
+}
+
+void StreamInput::finish() {
+    std::lock_guard<std::mutex> lock(mutex);
+    finished = true;
+    dataAvailable.notify_all();
+}
+
+void StreamInput::fail() {
+    std::lock_guard<std::mutex> lock(mutex);
+    failed = true;
+    dataAvailable.notify_all();
+}
+
+int StreamInput::read(uint8_t* out, int size) {
+    std::unique_lock<std::mutex> lock(mutex);
+    dataAvailable.wait(lock, [this] { return used > 0 || finished || failed || aborted; });
+    if (failed || aborted) {
+        return -1;
+    }
+    if (used == 0) {
+        return 0;
+    }
+    
+    size_t chunk = std::min({static_cast<size_t>(size), used, buffer.size() - readPos});
+    std::memcpy(out, buffer.data() + readPos, chunk);
+    readPos = (readPos + chunk) % buffer.size();
+    used -= chunk;
+    spaceAvailable.notify_one();
+    return static_cast<int>(chunk);
+}
+
+void StreamInput::abort() {
+    std::lock_guard<std::mutex> lock(mutex);
+    aborted = true;
+    spaceAvailable.notify_all();
+    dataAvailable.notify_all();
+}
+
+size_t StreamInput::bytesWritten() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return totalWritten;
+}
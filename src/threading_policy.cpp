@@ -0,0 +1,39 @@
+#include "threading_policy.hpp"
+#include <algorithm>
+#include <thread>
+
+namespace {
+
+// Frame threads past this add latency and memory but no throughput
+constexpr int MAX_DECODER_THREADS = 16;
+// Row bands get too thin to pay for the hand-off
+constexpr int MAX_SCALER_THREADS = 8;
+
+} // namespace
+
+int ThreadingPolicy::hostCores() {
+    int cores = static_cast<int>(std::thread::hardware_concurrency());
+    return cores > 0 ? cores : 1;
+}
+
+ThreadingPolicy ThreadingPolicy::forHost(int concurrentJobs) {
+    return forCores(hostCores() / std::max(1, concurrentJobs));
+}
+
+ThreadingPolicy ThreadingPolicy::forCores(int cores) {
+    cores = std::max(1, cores);
+    ThreadingPolicy policy;
+    policy.decoderThreads = std::min(cores, MAX_DECODER_THREADS);
+    policy.scalerThreads = std::min(cores, MAX_SCALER_THREADS);
+    policy.encoderThreads = cores;
+    return policy;
+}
+
+ThreadingPolicy ThreadingPolicy::divided(int parts) const {
+    parts = std::max(1, parts);
+    ThreadingPolicy share;
+    share.decoderThreads = std::max(1, decoderThreads / parts);
+    share.scalerThreads = std::max(1, scalerThreads / parts);
+    share.encoderThreads = std::max(1, encoderThreads / parts);
+    return share;
+}
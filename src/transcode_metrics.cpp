@@ -0,0 +1,157 @@
+#include "transcode_metrics.hpp"
+#include <algorithm>
+#include <cmath>
+
+namespace {
+
+constexpr double FIRST_BUCKET_SECONDS = 0.0001;
+
+void atomicMax(std::atomic<uint64_t>& target, uint64_t value) {
+    uint64_t current = target.load();
+    while (current < value && !target.compare_exchange_weak(current, value)) {
+    }
+}
+
+} // namespace
+
+double LatencyHistogram::upperBound(int bucket) {
+    return FIRST_BUCKET_SECONDS * std::ldexp(1.0, bucket);
+}
+
+double LatencyHistogram::secondsSince(Clock::time_point start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+void LatencyHistogram::observe(double seconds) {
+    int bucket = 0;
+    while (bucket < BUCKET_COUNT && seconds > upperBound(bucket)) {
+        bucket++;
+    }
+    buckets[bucket]++;
+    total++;
+    sumNanos += static_cast<uint64_t>(std::max(0.0, seconds) * 1e9);
+}
+
+void LatencyHistogram::merge(const LatencyHistogram& other) {
+    for (int i = 0; i <= BUCKET_COUNT; i++) {
+        buckets[i] += other.buckets[i].load();
+    }
+    total += other.total.load();
+    sumNanos += other.sumNanos.load();
+}
+
+void LatencyHistogram::reset() {
+    for (auto& bucket : buckets) {
+        bucket = 0;
+    }
+    total = 0;
+    sumNanos = 0;
+}
+
+void TranscodeMetrics::observeQueueDepth(size_t depth) {
+    queueDepthSum += depth;
+    queueDepthSamples++;
+    atomicMax(queueDepthMax, depth);
+}
+
+void TranscodeMetrics::recordPool(uint64_t requests, uint64_t allocations, uint64_t bytes) {
+    poolRequests += requests;
+    poolAllocations += allocations;
+    poolAllocatedBytes += bytes;
+}
+
+void TranscodeMetrics::merge(const TranscodeMetrics& other) {
+    open.merge(other.open);
+    decode.merge(other.decode);
+    scale.merge(other.scale);
+    encode.merge(other.encode);
+    bytesIn += other.bytesIn.load();
+    bytesOut += other.bytesOut.load();
+    framesDropped += other.framesDropped.load();
+    sceneCuts += other.sceneCuts.load();
+    queueDepthSum += other.queueDepthSum.load();
+    queueDepthSamples += other.queueDepthSamples.load();
+    atomicMax(queueDepthMax, other.queueDepthMax.load());
+    recordPool(other.poolRequests.load(), other.poolAllocations.load(), other.poolAllocatedBytes.load());
+}
+
+void TranscodeMetrics::reset() {
+    open.reset();
+    decode.reset();
+    scale.reset();
+    encode.reset();
+    bytesIn = 0;
+    bytesOut = 0;
+    framesDropped = 0;
+    sceneCuts = 0;
+    queueDepthSum = 0;
+    queueDepthSamples = 0;
+    queueDepthMax = 0;
+    poolRequests = 0;
+    poolAllocations = 0;
+    poolAllocatedBytes = 0;
+}
+
+void MetricsRegistry::recordJob(bool succeeded, double queuedSeconds, double runSeconds,
+                                const TranscodeMetrics& metrics) {
+    (succeeded ? jobsSucceeded : jobsFailed)++;
+    jobQueued.observe(queuedSeconds);
+    jobRun.observe(runSeconds);
+    totals.merge(metrics);
+}
+
+void MetricsRegistry::render(std::ostream& out) const {
+    writeCounter(out, "transcode_jobs_succeeded_total", "Jobs that finished successfully", jobsSucceeded.load());
+    writeCounter(out, "transcode_jobs_failed_total", "Jobs that failed", jobsFailed.load());
+    writeHistogram(out, "transcode_job_queued_seconds", "Time jobs waited for a worker", jobQueued);
+    writeHistogram(out, "transcode_job_run_seconds", "Time jobs spent transcoding", jobRun);
+    writeHistogram(out, "transcode_open_seconds", "Time to open and probe inputs", totals.open);
+    writeHistogram(out, "transcode_decode_frame_seconds", "Decode time per frame", totals.decode);
+    writeHistogram(out, "transcode_scale_frame_seconds", "Scale time per frame", totals.scale);
+    writeHistogram(out, "transcode_encode_frame_seconds", "Encode and mux time per frame", totals.encode);
+    writeCounter(out, "transcode_input_bytes_total", "Bytes read from inputs", totals.bytesIn.load());
+    writeCounter(out, "transcode_output_bytes_total", "Encoded bytes written to outputs", totals.bytesOut.load());
+    writeCounter(out, "transcode_frames_dropped_total", "Repeated frames left out of outputs",
+                 totals.framesDropped.load());
+    writeCounter(out, "transcode_scene_cuts_total", "Keyframes forced at scene starts", totals.sceneCuts.load());
+    writeCounter(out, "transcode_queue_depth_sum", "Sum of sampled pipeline queue depths",
+                 totals.queueDepthSum.load());
+    writeCounter(out, "transcode_queue_depth_samples_total", "Pipeline queue depth samples",
+                 totals.queueDepthSamples.load());
+    writeGauge(out, "transcode_queue_depth_max", "Deepest pipeline queue seen", totals.queueDepthMax.load());
+    writeCounter(out, "transcode_pool_requests_total", "Packets, frames and pictures taken from pools",
+                 totals.poolRequests.load());
+    writeCounter(out, "transcode_pool_allocations_total", "Pool requests that had to allocate",
+                 totals.poolAllocations.load());
+    writeCounter(out, "transcode_pool_allocated_bytes_total", "Bytes allocated by pools",
+                 totals.poolAllocatedBytes.load());
+}
+
+void MetricsRegistry::writeGauge(std::ostream& out, const char* name, const char* help, double value) {
+    out << "# HELP " << name << " " << help << "\n"
+        << "# TYPE " << name << " gauge\n"
+        << name << " " << value << "\n";
+}
+
+void MetricsRegistry::writeCounter(std::ostream& out, const char* name, const char* help, uint64_t value) {
+    out << "# HELP " << name << " " << help << "\n"
+        << "# TYPE " << name << " counter\n"
+        << name << " " << value << "\n";
+}
+
+void MetricsRegistry::writeHistogram(std::ostream& out, const char* name, const char* help,
+                                     const LatencyHistogram& histogram) {
+    out << "# HELP " << name << " " << help << "\n"
+        << "# TYPE " << name << " histogram\n";
+    
+    // Prometheus buckets are cumulative
+    uint64_t cumulative = 0;
+    for (int i = 0; i < LatencyHistogram::BUCKET_COUNT; i++) {
+        cumulative += histogram.bucketCount(i);
+        out << name << "_bucket{le=\"" << LatencyHistogram::upperBound(i) << "\"} " << cumulative << "\n";
+    }
+    cumulative += histogram.bucketCount(LatencyHistogram::BUCKET_COUNT);
+    out << name << "_bucket{le=\"+Inf\"} " << cumulative << "\n"
+        << name << "_sum " << histogram.sumSeconds() << "\n"
+        << name << "_count " << histogram.count() << "\n";
+}
@@ -0,0 +1,265 @@
+#include "video_processor.hpp"
+#include <algorithm>
+#include <iostream>
+#include <limits>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/imgutils.h>
+}
+
+namespace {
+
+void freeSample(std::vector<AVFrame*>& sample) {
+    for (AVFrame*& frame : sample) {
+        av_frame_free(&frame);
+    }
+    sample.clear();
+}
+
+AVRational sampleFrameRate(const AVStream* stream) {
+    AVRational frameRate = stream->avg_frame_rate;
+    if (frameRate.num <= 0 || frameRate.den <= 0) {
+        frameRate = AVRational{25, 1};
+    }
+    return frameRate;
+}
+
+} // namespace
+
+bool VideoProcessor::tuneEncoder() {
+    if (encoderTuned) {
+        return true;
+    }
+    encoderTuned = true;
+    jobEncoderSettings = encoderSettings;
+    if (!autotuneEnabled) {
+        return true;
+    }
+    
+    int outWidth, outHeight;
+    calculateOutputDimensions(inputVideoCodecContext->width, inputVideoCodecContext->height,
+                              outWidth, outHeight);
+    AVStream* inStream = inputFormatContext->streams[videoStreamIndex];
+    double frameRate = av_q2d(sampleFrameRate(inStream));
+    
+    double realtimeFactor = autotuneTarget.realtimeFactor;
+    if (autotuneTarget.deadlineSeconds > 0.0 && inputFormatContext->duration > 0) {
+        double duration = static_cast<double>(inputFormatContext->duration) / AV_TIME_BASE;
+        realtimeFactor = std::max(realtimeFactor, duration / autotuneTarget.deadlineSeconds);
+    }
+    if (realtimeFactor <= 0.0) {
+        realtimeFactor = 1.0;
+    }
+    
+    std::string key = EncoderTuningCache::makeKey(encoderSettings.codec, encoderSettings.crf,
+                                                  inputVideoCodecContext->height, outHeight, frameRate,
+                                                  threading.encoderThreads, realtimeFactor);
+    if (tuningCache && tuningCache->lookup(key, jobEncoderSettings)) {
+        return true;
+    }
+    
+    // Sampling reads ahead and seeks back, which an upload arriving through
+    // a StreamInput cannot do; it keeps the configured settings
+    if (inputIOContext || !inputFormatContext->pb || !(inputFormatContext->pb->seekable & AVIO_SEEKABLE_NORMAL)) {
+        return true;
+    }
+    
+    std::vector<AVFrame*> sample;
+    double decodeSeconds = 0.0;
+    bool sampled = decodeTuningSample(sample, outWidth, outHeight, decodeSeconds);
+    
+    // Back to the start for the real transcode, whatever the sample did
+    avcodec_flush_buffers(inputVideoCodecContext);
+    if (avformat_seek_file(inputFormatContext, -1, std::numeric_limits<int64_t>::min(), 0,
+                           std::numeric_limits<int64_t>::max(), 0) < 0) {
+        std::cerr << "Could not rewind input after encoder tuning" << std::endl;
+        freeSample(sample);
+        return false;
+    }
+    if (!sampled || sample.empty()) {
+        freeSample(sample);
+        return true;
+    }
+    
+    // Each frame may take this long end to end. Pipelined stages overlap,
+    // so there only the encoder has to fit; serially decode and scale share it.
+    double budget = 1.0 / (realtimeFactor * frameRate);
+    double encodeBudget = pipelineMode ? budget : budget - decodeSeconds;
+    
+    // Presets get slower down the list; stop at the first one too slow.
+    // A slower preset is only worth it if it actually saves bytes.
+    std::vector<EncoderSettings> candidates = tuningCandidates(encoderSettings.codec, encoderSettings.crf);
+    EncoderSettings chosen = candidates.front();
+    double chosenBytes = 0.0;
+    for (size_t i = 0; i < candidates.size(); i++) {
+        double encodeSeconds, bytesPerFrame;
+        if (cancelRequested() || !trialEncode(candidates[i], sample, encodeSeconds, bytesPerFrame) ||
+            encodeSeconds > encodeBudget) {
+            break;
+        }
+        if (i == 0 || bytesPerFrame < chosenBytes * (1.0 - TUNING_MIN_SAVING)) {
+            chosen = candidates[i];
+            chosenBytes = bytesPerFrame;
+        }
+    }
+    freeSample(sample);
+    
+    jobEncoderSettings = chosen;
+    if (tuningCache) {
+        tuningCache->store(key, chosen);
+    }
+    return true;
+}
+
+bool VideoProcessor::decodeTuningSample(std::vector<AVFrame*>& sample, int width, int height,
+                                        double& secondsPerFrame) {
+    // Sample from a third of the way in; openings are often titles or black
+    if (inputFormatContext->duration > 0) {
+        int64_t start = inputFormatContext->start_time != AV_NOPTS_VALUE ? inputFormatContext->start_time : 0;
+        int64_t target = start + inputFormatContext->duration / 3;
+        if (avformat_seek_file(inputFormatContext, -1, std::numeric_limits<int64_t>::min(), target,
+                               target, 0) < 0) {
+            std::cerr << "Could not seek for encoder tuning sample" << std::endl;
+            return false;
+        }
+    }
+    
+    Scaler sampleScaler;
+    bool scaled = width != inputVideoCodecContext->width || height != inputVideoCodecContext->height ||
+                  inputVideoCodecContext->pix_fmt != AV_PIX_FMT_YUV420P;
+    if (scaled && !sampleScaler.init(inputVideoCodecContext->width, inputVideoCodecContext->height,
+                                     inputVideoCodecContext->pix_fmt, width, height, AV_PIX_FMT_YUV420P,
+                                     scaleQuality, threading.scalerThreads)) {
+        return false;
+    }
+    
+    // Bounded by memory as well: every picture is kept for the trial encodes
+    int pictureBytes = av_image_get_buffer_size(AV_PIX_FMT_YUV420P, width, height, 1);
+    size_t maxFrames = TUNING_SAMPLE_FRAMES;
+    if (pictureBytes > 0) {
+        maxFrames = std::max<size_t>(8, std::min<size_t>(maxFrames, TUNING_SAMPLE_BYTES / pictureBytes));
+    }
+    
+    AVPacket* packet = av_packet_alloc();
+    AVFrame* frame = av_frame_alloc();
+    if (!packet || !frame) {
+        std::cerr << "Could not allocate tuning sample buffers" << std::endl;
+        av_packet_free(&packet);
+        av_frame_free(&frame);
+        return false;
+    }
+    
+    bool ok = true;
+    double seconds = 0.0;
+    bool draining = false;
+    while (ok && sample.size() < maxFrames) {
+        auto start = LatencyHistogram::Clock::now();
+        int ret = avcodec_receive_frame(inputVideoCodecContext, frame);
+        if (ret == AVERROR(EAGAIN)) {
+            if (av_read_frame(inputFormatContext, packet) < 0) {
+                // End of input: take the frames still in the decoder
+                draining = true;
+                avcodec_send_packet(inputVideoCodecContext, nullptr);
+            } else {
+                if (packet->stream_index == videoStreamIndex) {
+                    avcodec_send_packet(inputVideoCodecContext, packet);
+                }
+                av_packet_unref(packet);
+            }
+            seconds += LatencyHistogram::secondsSince(start);
+            continue;
+        } else if (ret < 0) {
+            ok = ret == AVERROR_EOF && draining;
+            break;
+        }
+        
+        AVFrame* picture = nullptr;
+        if (scaled) {
+            picture = av_frame_alloc();
+            if (picture) {
+                picture->format = AV_PIX_FMT_YUV420P;
+                picture->width = width;
+                picture->height = height;
+            }
+            if (!picture || av_frame_get_buffer(picture, 0) < 0 || !sampleScaler.scale(frame, picture)) {
+                av_frame_free(&picture);
+                ok = false;
+            }
+        } else {
+            picture = av_frame_clone(frame);
+            ok = picture != nullptr;
+        }
+        av_frame_unref(frame);
+        seconds += LatencyHistogram::secondsSince(start);
+        
+        if (picture) {
+            // Trial encoders count in frames
+            picture->pts = static_cast<int64_t>(sample.size());
+            picture->pict_type = AV_PICTURE_TYPE_NONE;
+            sample.push_back(picture);
+        }
+    }
+    
+    av_packet_free(&packet);
+    av_frame_free(&frame);
+    secondsPerFrame = sample.empty() ? 0.0 : seconds / sample.size();
+    return ok;
+}
+
+bool VideoProcessor::trialEncode(const EncoderSettings& settings, const std::vector<AVFrame*>& sample,
+                                 double& secondsPerFrame, double& bytesPerFrame) {
+    const AVCodec* videoEncoder = avcodec_find_encoder_by_name(settings.codec.c_str());
+    if (!videoEncoder) {
+        return false;
+    }
+    AVCodecContext* encoder = avcodec_alloc_context3(videoEncoder);
+    AVPacket* packet = av_packet_alloc();
+    if (!encoder || !packet) {
+        avcodec_free_context(&encoder);
+        av_packet_free(&packet);
+        return false;
+    }
+    
+    // As the real encoder is set up, minus the container
+    AVRational frameRate = sampleFrameRate(inputFormatContext->streams[videoStreamIndex]);
+    encoder->width = sample.front()->width;
+    encoder->height = sample.front()->height;
+    encoder->sample_aspect_ratio = inputVideoCodecContext->sample_aspect_ratio;
+    encoder->pix_fmt = AV_PIX_FMT_YUV420P;
+    encoder->time_base = av_inv_q(frameRate);
+    encoder->framerate = frameRate;
+    encoder->thread_count = threading.encoderThreads;
+    encoder->bit_rate = 0;
+    applyEncoderSettings(encoder, settings);
+    
+    auto start = LatencyHistogram::Clock::now();
+    bool ok = avcodec_open2(encoder, videoEncoder, nullptr) >= 0;
+    int64_t bytes = 0;
+    for (size_t i = 0; ok && i <= sample.size(); i++) {
+        // The last round flushes the frames held for lookahead
+        ok = avcodec_send_frame(encoder, i < sample.size() ? sample[i] : nullptr) >= 0;
+        while (ok) {
+            int ret = avcodec_receive_packet(encoder, packet);
+            if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+                break;
+            }
+            ok = ret >= 0;
+            bytes += ok ? packet->size : 0;
+            av_packet_unref(packet);
+        }
+    }
+    double seconds = LatencyHistogram::secondsSince(start);
+    
+    avcodec_free_context(&encoder);
+    av_packet_free(&packet);
+    if (!ok) {
+        std::cerr << "Trial encode with " << settings.codec << " preset " << settings.preset << " failed" << std::endl;
+        return false;
+    }
+    
+    secondsPerFrame = seconds / sample.size();
+    bytesPerFrame = static_cast<double>(bytes) / sample.size();
+    return true;
+}
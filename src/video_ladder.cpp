@@ -0,0 +1,413 @@
+#include "video_processor.hpp"
+#include "bounded_queue.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <thread>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/dict.h>
+#include <libavutil/opt.h>
+}
+
+namespace fs = std::filesystem;
+
+namespace {
+
+void freeFrame(AVFrame*& frame) {
+    av_frame_free(&frame);
+}
+
+// Scaler, encoder and frame queue of one rendition. Each one runs on its own
+// thread and only shares the muxer with the others.
+struct LadderEncoder {
+    int width = 0;
+    int height = 0;
+    int64_t maxBitrate = 0;
+    int streamIndex = -1;
+    AVCodecContext* encoder = nullptr;
+    Scaler scaler;
+    FramePool pictures;   // scaled pictures at this rendition's size
+    std::unique_ptr<BoundedQueue<AVFrame*>> frames;
+    
+    ~LadderEncoder() {
+        if (encoder) {
+            avcodec_free_context(&encoder);
+        }
+    }
+};
+
+} // namespace
+
+std::vector<Rendition> VideoProcessor::defaultLadder() {
+    return {
+        {1920, 1080, 5000000},
+        {1280, 720, 3000000},
+        {854, 480, 1200000},
+        {640, 360, 800000},
+    };
+}
+
+bool VideoProcessor::processLadder(const std::string& inputPath, const std::string& outputDirectory,
+                                   const std::vector<Rendition>& renditions) {
+    try {
+        metrics.reset();
+        auto openStart = LatencyHistogram::Clock::now();
+        bool opened = openInputFile(inputPath);
+        metrics.open.observeSince(openStart);
+        
+        bool processed = opened && transcodeLadder(outputDirectory, renditions);
+        
+        cleanup();
+        return processed;
+    } catch (const std::exception& e) {
+        std::cerr << "Error processing ladder: " << e.what() << std::endl;
+        cleanup();
+        return false;
+    }
+}
+
+bool VideoProcessor::transcodeLadder(const std::string& outputDirectory, const std::vector<Rendition>& renditions) {
+    std::error_code error;
+    fs::create_directories(outputDirectory, error);
+    if (error) {
+        std::cerr << "Could not create ladder directory: " << error.message() << std::endl;
+        return false;
+    }
+    
+    // The dash muxer writes the fMP4 segments, manifest.mpd and, with
+    // hls_playlist, master.m3u8 plus one media playlist per stream
+    std::string manifestPath = outputDirectory + "/manifest.mpd";
+    avformat_alloc_output_context2(&outputFormatContext, nullptr, "dash", manifestPath.c_str());
+    if (!outputFormatContext) {
+        std::cerr << "Could not create ladder output context" << std::endl;
+        return false;
+    }
+    
+    // x264 whatever the configured encoder: the keyframe and rate options
+    // below are x264's
+    EncoderSettings ladderSettings;
+    const AVCodec* videoEncoder = avcodec_find_encoder_by_name(ladderSettings.codec.c_str());
+    if (!videoEncoder) {
+        std::cerr << "Could not find H.264 encoder" << std::endl;
+        return false;
+    }
+    
+    AVStream* inStream = inputFormatContext->streams[videoStreamIndex];
+    AVRational frameRate = inStream->avg_frame_rate;
+    
+    // Same GOP length everywhere; keyframes are also forced at segment
+    // boundaries below, so every rendition switches at the same frames
+    int gopSize = 250;
+    if (frameRate.num > 0 && frameRate.den > 0) {
+        gopSize = static_cast<int>(std::lround(av_q2d(frameRate) * LADDER_SEGMENT_SECONDS));
+    }
+    
+    std::vector<std::unique_ptr<LadderEncoder>> encoders;
+    for (const Rendition& rendition : renditions) {
+        int width, height;
+        fitDimensions(inputVideoCodecContext->width, inputVideoCodecContext->height,
+                      rendition.maxWidth, rendition.maxHeight, width, height);
+        
+        // Small sources collapse several rungs onto the same size; keep the first
+        bool duplicate = false;
+        for (const auto& existing : encoders) {
+            duplicate = duplicate || (existing->width == width && existing->height == height);
+        }
+        if (duplicate) {
+            continue;
+        }
+        
+        auto ladderEncoder = std::make_unique<LadderEncoder>();
+        ladderEncoder->width = width;
+        ladderEncoder->height = height;
+        ladderEncoder->maxBitrate = rendition.maxBitrate;
+        encoders.push_back(std::move(ladderEncoder));
+    }
+    if (encoders.empty()) {
+        std::cerr << "No renditions to encode" << std::endl;
+        return false;
+    }
+    
+    // Renditions encode in parallel and share the job's encoder threads
+    ThreadingPolicy renditionThreading = threading.divided(static_cast<int>(encoders.size()));
+    
+    for (auto& ladderEncoder : encoders) {
+        AVStream* outStream = avformat_new_stream(outputFormatContext, nullptr);
+        if (!outStream) {
+            std::cerr << "Could not create rendition stream" << std::endl;
+            return false;
+        }
+        ladderEncoder->streamIndex = outStream->index;
+        
+        AVCodecContext* encoder = avcodec_alloc_context3(videoEncoder);
+        if (!encoder) {
+            std::cerr << "Could not allocate rendition encoder context" << std::endl;
+            return false;
+        }
+        ladderEncoder->encoder = encoder;
+        
+        encoder->width = ladderEncoder->width;
+        encoder->height = ladderEncoder->height;
+        encoder->sample_aspect_ratio = inputVideoCodecContext->sample_aspect_ratio;
+        encoder->pix_fmt = AV_PIX_FMT_YUV420P;
+        encoder->time_base = inStream->time_base;
+        encoder->framerate = frameRate;
+        encoder->gop_size = gopSize;
+        encoder->keyint_min = gopSize;
+        encoder->thread_count = renditionThreading.encoderThreads;
+        encoder->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+        
+        // Capped CRF: quality target, with the rung's bitrate as ceiling
+        encoder->bit_rate = 0;
+        encoder->rc_max_rate = ladderEncoder->maxBitrate;
+        encoder->rc_buffer_size = static_cast<int>(ladderEncoder->maxBitrate * 2);
+        applyEncoderSettings(encoder, ladderSettings);
+        av_opt_set_int(encoder->priv_data, "forced-idr", 1, 0);
+        // Scene cuts would add keyframes at different frames per rendition
+        av_opt_set(encoder->priv_data, "x264-params", "scenecut=0", 0);
+        
+        if (avcodec_open2(encoder, videoEncoder, nullptr) < 0) {
+            std::cerr << "Could not open rendition encoder" << std::endl;
+            return false;
+        }
+        
+        if (avcodec_parameters_from_context(outStream->codecpar, encoder) < 0) {
+            std::cerr << "Could not copy rendition encoder parameters" << std::endl;
+            return false;
+        }
+        // Advertised as the rendition's bandwidth in the manifests
+        outStream->codecpar->bit_rate = ladderEncoder->maxBitrate;
+        outStream->time_base = encoder->time_base;
+        
+        if (encoder->width != inputVideoCodecContext->width ||
+            encoder->height != inputVideoCodecContext->height ||
+            encoder->pix_fmt != inputVideoCodecContext->pix_fmt) {
+            if (!ladderEncoder->scaler.init(inputVideoCodecContext->width,
+                                            inputVideoCodecContext->height,
+                                            inputVideoCodecContext->pix_fmt,
+                                            encoder->width, encoder->height, encoder->pix_fmt,
+                                            scaleQuality, renditionThreading.scalerThreads)) {
+                std::cerr << "Could not initialize rendition scaler" << std::endl;
+                return false;
+            }
+            if (!ladderEncoder->pictures.configure(encoder->width, encoder->height, encoder->pix_fmt)) {
+                return false;
+            }
+        }
+        
+        ladderEncoder->frames = std::make_unique<BoundedQueue<AVFrame*>>(pipelineQueueDepth, freeFrame);
+    }
+    
+    // One audio stream shared by all renditions
+    if (audioStreamIndex >= 0) {
+        AVStream* outAudioStream = avformat_new_stream(outputFormatContext, nullptr);
+        if (!outAudioStream) {
+            std::cerr << "Could not create output audio stream" << std::endl;
+            return false;
+        }
+        audioOutputStreamIndex = outAudioStream->index;
+        
+        // The dash muxer cannot be asked which codecs it takes; AAC always fits
+        audioStreamCopy = inputFormatContext->streams[audioStreamIndex]->codecpar->codec_id == AV_CODEC_ID_AAC;
+        if (audioStreamCopy) {
+            if (!setupStreamCopy(audioStreamIndex, outAudioStream)) {
+                return false;
+            }
+        } else if (!setupAudioEncoder(outAudioStream)) {
+            return false;
+        }
+    }
+    
+    AVDictionary* options = nullptr;
+    av_dict_set(&options, "seg_duration", std::to_string(LADDER_SEGMENT_SECONDS).c_str(), 0);
+    av_dict_set(&options, "use_template", "1", 0);
+    av_dict_set(&options, "use_timeline", "1", 0);
+    av_dict_set(&options, "hls_playlist", "1", 0);
+    av_dict_set(&options, "adaptation_sets",
+                audioStreamIndex >= 0 ? "id=0,streams=v id=1,streams=a" : "id=0,streams=v", 0);
+    int ret = avformat_write_header(outputFormatContext, &options);
+    av_dict_free(&options);
+    if (ret < 0) {
+        std::cerr << "Could not write ladder header" << std::endl;
+        return false;
+    }
+    
+    BoundedQueue<AVFrame*> decodedFrames(pipelineQueueDepth, freeFrame);
+    
+    // Any thread failing aborts every queue, which unblocks and stops the others
+    std::atomic<bool> failed(false);
+    auto fail = [&]() {
+        failed = true;
+        decodedFrames.abort();
+        for (auto& ladderEncoder : encoders) {
+            ladderEncoder->frames->abort();
+        }
+    };
+    
+    auto encodeRendition = [&](LadderEncoder& ladderEncoder, const AVFrame* frame) {
+        auto start = LatencyHistogram::Clock::now();
+        
+        // A null frame flushes the encoder
+        if (avcodec_send_frame(ladderEncoder.encoder, frame) < 0) {
+            std::cerr << "Error sending frame for rendition encoding" << std::endl;
+            return false;
+        }
+        
+        AVPacket* outPacket = packetPool.acquire();
+        if (!outPacket) {
+            std::cerr << "Could not allocate packet" << std::endl;
+            return false;
+        }
+        
+        bool ok = true;
+        while (ok) {
+            int ret = avcodec_receive_packet(ladderEncoder.encoder, outPacket);
+            if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+                break;
+            } else if (ret < 0) {
+                std::cerr << "Error receiving packet from rendition encoder" << std::endl;
+                ok = false;
+                break;
+            }
+            
+            outPacket->stream_index = ladderEncoder.streamIndex;
+            av_packet_rescale_ts(outPacket, ladderEncoder.encoder->time_base,
+                                 outputFormatContext->streams[ladderEncoder.streamIndex]->time_base);
+            
+            ok = writePacket(outPacket);
+            av_packet_unref(outPacket);
+            if (!ok) {
+                std::cerr << "Error writing rendition packet" << std::endl;
+            }
+        }
+        packetPool.release(outPacket);
+        
+        if (ok && frame) {
+            metrics.encode.observeSince(start);
+        }
+        return ok;
+    };
+    
+    auto runRendition = [&](LadderEncoder& ladderEncoder) {
+        AVFrame* frame = nullptr;
+        while (ladderEncoder.frames->pop(frame)) {
+            metrics.observeQueueDepth(ladderEncoder.frames->size());
+            AVFrame* scaledFrame = nullptr;
+            if (ladderEncoder.scaler.active()) {
+                auto scaleStart = LatencyHistogram::Clock::now();
+                scaledFrame = ladderEncoder.pictures.acquirePicture();
+                if (!scaledFrame) {
+                    std::cerr << "Could not allocate rendition frame" << std::endl;
+                    framePool.release(frame);
+                    return false;
+                }
+                if (!ladderEncoder.scaler.scale(frame, scaledFrame)) {
+                    std::cerr << "Error scaling rendition frame" << std::endl;
+                    ladderEncoder.pictures.release(scaledFrame);
+                    framePool.release(frame);
+                    return false;
+                }
+                scaledFrame->pts = frame->pts;
+                scaledFrame->pict_type = frame->pict_type;
+                metrics.scale.observeSince(scaleStart);
+            }
+            
+            bool encoded = encodeRendition(ladderEncoder, scaledFrame ? scaledFrame : frame);
+            ladderEncoder.pictures.release(scaledFrame);
+            framePool.release(frame);
+            if (!encoded) {
+                return false;
+            }
+        }
+        
+        if (ladderEncoder.frames->aborted()) {
+            return false;
+        }
+        return encodeRendition(ladderEncoder, nullptr);
+    };
+    
+    std::vector<std::thread> threads;
+    PipelineStageStats decodeStats;
+    threads.emplace_back([&]() {
+        if (!runDecodeStage(decodedFrames, decodeStats)) {
+            fail();
+        }
+    });
+    for (auto& ladderEncoder : encoders) {
+        LadderEncoder& target = *ladderEncoder;
+        threads.emplace_back([&target, &runRendition, &fail]() {
+            if (!runRendition(target)) {
+                fail();
+            }
+        });
+    }
+    
+    // Fan every decoded frame out to all renditions on the calling thread.
+    // The clones share the decoded picture, only the references are copied.
+    int64_t segmentTicks = av_rescale_q(LADDER_SEGMENT_SECONDS, AVRational{1, 1}, inStream->time_base);
+    int64_t firstPts = AV_NOPTS_VALUE;
+    int64_t lastSegment = -1;
+    AVFrame* frame = nullptr;
+    while (decodedFrames.pop(frame)) {
+        frame->pts = frame->best_effort_timestamp;
+        if (firstPts == AV_NOPTS_VALUE) {
+            firstPts = frame->pts;
+        }
+        
+        // Start every segment with a keyframe in all renditions
+        int64_t segment = segmentTicks > 0 ? (frame->pts - firstPts) / segmentTicks : 0;
+        frame->pict_type = segment > lastSegment ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+        lastSegment = std::max(lastSegment, segment);
+        
+        bool queued = true;
+        for (auto& ladderEncoder : encoders) {
+            AVFrame* clone = framePool.acquire();
+            if (!clone || av_frame_ref(clone, frame) < 0) {
+                framePool.release(clone);
+                queued = false;
+                break;
+            }
+            if (!ladderEncoder->frames->push(clone)) {
+                queued = false;
+                break;
+            }
+        }
+        framePool.release(frame);
+        if (!queued) {
+            fail();
+            break;
+        }
+    }
+    
+    if (decodedFrames.aborted()) {
+        fail();
+    }
+    for (auto& ladderEncoder : encoders) {
+        ladderEncoder->frames->close();
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    
+    for (auto& ladderEncoder : encoders) {
+        PoolStats stats = ladderEncoder->pictures.collectStats();
+        metrics.recordPool(stats.requests, stats.allocations, stats.bytes);
+    }
+    
+    if (failed) {
+        return false;
+    }
+    
+    if (!finishAudio() || av_write_trailer(outputFormatContext) < 0) {
+        std::cerr << "Error writing ladder trailer" << std::endl;
+        return false;
+    }
+    
+    return true;
+}
@@ -0,0 +1,215 @@
+#include "video_processor.hpp"
+#include "bounded_queue.hpp"
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <thread>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+}
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+double secondsSince(Clock::time_point start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+void freeFrame(AVFrame*& frame) {
+    av_frame_free(&frame);
+}
+
+// Queue operations that count the time spent blocked as stall time
+bool timedPush(BoundedQueue<AVFrame*>& queue, AVFrame* frame, PipelineStageStats& stats) {
+    auto start = Clock::now();
+    bool pushed = queue.push(frame);
+    stats.stallSeconds += secondsSince(start);
+    return pushed;
+}
+
+bool timedPop(BoundedQueue<AVFrame*>& queue, AVFrame*& frame, PipelineStageStats& stats) {
+    auto start = Clock::now();
+    bool popped = queue.pop(frame);
+    stats.stallSeconds += secondsSince(start);
+    return popped;
+}
+
+} // namespace
+
+bool VideoProcessor::runDecodeStage(BoundedQueue<AVFrame*>& output, PipelineStageStats& stats) {
+    AVPacket* packet = av_packet_alloc();
+    AVFrame* frame = av_frame_alloc();
+    if (!packet || !frame) {
+        std::cerr << "Could not allocate packet/frame" << std::endl;
+        av_packet_free(&packet);
+        av_frame_free(&frame);
+        return false;
+    }
+    
+    // Hand every frame the decoder has ready to the scale stage
+    auto drainDecoder = [&]() {
+        while (true) {
+            int ret = receiveDecoderFrame(frame);
+            if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+                return true;
+            } else if (ret < 0) {
+                std::cerr << "Error receiving frame" << std::endl;
+                return false;
+            }
+            
+            AVFrame* decoded = framePool.acquire();
+            if (!decoded) {
+                std::cerr << "Could not allocate frame" << std::endl;
+                return false;
+            }
+            av_frame_move_ref(decoded, frame);
+            stats.frames++;
+            if (!timedPush(output, decoded, stats)) {
+                return false;
+            }
+        }
+    };
+    
+    bool ok = true;
+    int readResult = 0;
+    while (ok && (readResult = readInputPacket(packet)) >= 0) {
+        if (packet->stream_index == videoStreamIndex) {
+            if (sendDecoderPacket(packet) < 0) {
+                std::cerr << "Error sending packet for decoding" << std::endl;
+                ok = false;
+            } else {
+                ok = drainDecoder();
+            }
+        } else if (packet->stream_index == audioStreamIndex && audioStreamIndex >= 0) {
+            ok = writeAudioPacket(packet);
+        }
+        
+        av_packet_unref(packet);
+    }
+    ok = ok && readResult != AVERROR_EXIT;
+    
+    if (ok) {
+        sendDecoderPacket(nullptr);
+        ok = drainDecoder();
+    }
+    
+    av_frame_free(&frame);
+    av_packet_free(&packet);
+    
+    if (ok) {
+        output.close();
+    }
+    return ok;
+}
+
+bool VideoProcessor::runScaleStage(BoundedQueue<AVFrame*>& input, BoundedQueue<AVFrame*>& output,
+                                   PipelineStageStats& stats) {
+    AVFrame* frame = nullptr;
+    while (timedPop(input, frame, stats)) {
+        metrics.observeQueueDepth(input.size());
+        AVFrame* outputFrame = frame;
+        if (scaler.active()) {
+            // Each scaled frame is queued, so it needs its own buffer
+            outputFrame = allocScaledFrame();
+            bool scaled = outputFrame && scaleFrame(frame, outputFrame);
+            framePool.release(frame);
+            if (!scaled) {
+                framePool.release(outputFrame);
+                return false;
+            }
+        } else {
+            // Let the encoder pick its own frame types
+            outputFrame->pict_type = AV_PICTURE_TYPE_NONE;
+        }
+        
+        stats.frames++;
+        if (!timedPush(output, outputFrame, stats)) {
+            return false;
+        }
+    }
+    
+    if (input.aborted()) {
+        return false;
+    }
+    output.close();
+    return true;
+}
+
+bool VideoProcessor::runEncodeStage(BoundedQueue<AVFrame*>& input, PipelineStageStats& stats) {
+    AVFrame* frame = nullptr;
+    while (timedPop(input, frame, stats)) {
+        metrics.observeQueueDepth(input.size());
+        bool encoded = encodeAnalyzedFrame(frame);
+        framePool.release(frame);
+        if (!encoded) {
+            return false;
+        }
+        stats.frames++;
+    }
+    
+    if (input.aborted()) {
+        return false;
+    }
+    return encodeAnalyzedFrame(nullptr);
+}
+
+bool VideoProcessor::processFramesPipelined() {
+    pipelineStats = PipelineStats();
+    
+    if (!initScaler()) {
+        return false;
+    }
+    
+    BoundedQueue<AVFrame*> decodedFrames(pipelineQueueDepth, freeFrame);
+    BoundedQueue<AVFrame*> scaledFrames(pipelineQueueDepth, freeFrame);
+    
+    // Any stage failing aborts both queues, which unblocks and stops the others
+    std::atomic<bool> failed(false);
+    auto fail = [&]() {
+        failed = true;
+        decodedFrames.abort();
+        scaledFrames.abort();
+    };
+    
+    // Run a stage, charging whatever it did not spend blocked as busy time
+    auto runStage = [&](PipelineStageStats& stats, auto&& stage) {
+        auto start = Clock::now();
+        if (!stage()) {
+            fail();
+        }
+        stats.busySeconds = secondsSince(start) - stats.stallSeconds;
+    };
+    
+    std::thread decodeThread([&]() {
+        runStage(pipelineStats.decode, [&]() {
+            return runDecodeStage(decodedFrames, pipelineStats.decode);
+        });
+    });
+    std::thread scaleThread([&]() {
+        runStage(pipelineStats.scale, [&]() {
+            return runScaleStage(decodedFrames, scaledFrames, pipelineStats.scale);
+        });
+    });
+    
+    // The encoder runs on the calling thread
+    runStage(pipelineStats.encode, [&]() {
+        return runEncodeStage(scaledFrames, pipelineStats.encode);
+    });
+    
+    decodeThread.join();
+    scaleThread.join();
+    
+    if (failed) {
+        return false;
+    }
+    
+    if (!finishAudio() || av_write_trailer(outputFormatContext) < 0) {
+        std::cerr << "Error writing trailer" << std::endl;
+        return false;
+    }
+    
+    return true;
+}
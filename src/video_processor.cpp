@@ -1,6 +1,12 @@
 #include "video_processor.hpp"
+#include "stream_input.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <stdexcept>
 #include <iostream>
+#include <sstream>
 
 extern "C" {
 #include <libavcodec/avcodec.h>
@@ -8,20 +14,66 @@ extern "C" {
 #include <libavutil/imgutils.h>
 #include <libavutil/opt.h>
 #include <libavutil/channel_layout.h>
-#include <libswscale/swscale.h>
 }
 
+namespace {
+
+// AVIO read callback for uploads streamed through a StreamInput
+int readStreamInput(void* opaque, uint8_t* buffer, int size) {
+    int bytes = static_cast<StreamInput*>(opaque)->read(buffer, size);
+    if (bytes == 0) {
+        return AVERROR_EOF;
+    }
+    return bytes < 0 ? AVERROR(EIO) : bytes;
+}
+
+// The input's rate if the encoder takes it, else the closest one it does
+int encoderSampleRate(const AVCodec* codec, int inputRate) {
+    if (!codec->supported_samplerates) {
+        return inputRate;
+    }
+    int best = 0;
+    for (const int* rate = codec->supported_samplerates; *rate != 0; rate++) {
+        if (best == 0 || std::abs(*rate - inputRate) < std::abs(best - inputRate)) {
+            best = *rate;
+        }
+    }
+    return best;
+}
+
+// 8-bit 4:2:0, the same as what the encode path writes. The pixel format
+// alone misses streams whose profile players reject even at 8 bits.
+bool copyableVideoFormat(const AVCodecParameters* codecpar) {
+    if (codecpar->format != AV_PIX_FMT_YUV420P && codecpar->format != AV_PIX_FMT_YUVJ420P) {
+        return false;
+    }
+    if (codecpar->codec_id == AV_CODEC_ID_HEVC) {
+        return codecpar->profile == AV_PROFILE_HEVC_MAIN;
+    }
+    // Constrained Baseline is Baseline with a flag; the intra profiles are all 10-bit or more
+    switch (codecpar->profile & ~AV_PROFILE_H264_CONSTRAINED) {
+        case AV_PROFILE_H264_BASELINE:
+        case AV_PROFILE_H264_MAIN:
+        case AV_PROFILE_H264_EXTENDED:
+        case AV_PROFILE_H264_HIGH:
+            return true;
+    }
+    return false;
+}
+
+} // namespace
+
 VideoProcessor::VideoProcessor() {}
 
 VideoProcessor::~VideoProcessor() {
     cleanup();
+    av_frame_free(&heldFrame);
 }
 
 void VideoProcessor::cleanup() {
-    if (swsContext) {
-        sws_freeContext(swsContext);
-        swsContext = nullptr;
-    }
+    scaler.reset();
+    // Its thread uses the audio codec contexts
+    audioTranscoder.reset();
     
     if (inputVideoCodecContext) {
         avcodec_free_context(&inputVideoCodecContext);
@@ -37,25 +89,63 @@ void VideoProcessor::cleanup() {
     }
     
     if (inputFormatContext) {
+        if (inputFormatContext->pb) {
+            metrics.bytesIn += inputFormatContext->pb->bytes_read;
+        }
         avformat_close_input(&inputFormatContext);
     }
+    if (inputIOContext) {
+        // Custom IO is not freed by avformat_close_input
+        av_freep(&inputIOContext->buffer);
+        avio_context_free(&inputIOContext);
+    }
+    inputFile.close();
     if (outputFormatContext) {
+        closeOutput();
         if (outputFormatContext->pb) {
             avio_closep(&outputFormatContext->pb);
         }
         avformat_free_context(outputFormatContext);
+        outputFormatContext = nullptr;
+    }
+    
+    // Pools stay warm for the next job; only their counters are handed over
+    PoolStats packetStats = packetPool.collectStats();
+    PoolStats frameStats = framePool.collectStats();
+    metrics.recordPool(packetStats.requests + frameStats.requests,
+                       packetStats.allocations + frameStats.allocations,
+                       packetStats.bytes + frameStats.bytes);
+    
+    // Reset so the same processor can take the next job
+    videoStreamIndex = -1;
+    audioStreamIndex = -1;
+    audioOutputStreamIndex = 1;
+    videoStreamCopy = false;
+    audioStreamCopy = false;
+    pendingDecodeSeconds = 0.0;
+    encoderTuned = false;
+    probeResult.reset();
+    sceneAnalyzer.reset();
+    sceneCrf = -1;
+    if (heldFrame) {
+        av_frame_unref(heldFrame);
     }
 }
 
 void VideoProcessor::calculateOutputDimensions(int inputWidth, int inputHeight, int& outWidth, int& outHeight) {
-    if (inputWidth <= targetWidth && inputHeight <= targetHeight) {
+    fitDimensions(inputWidth, inputHeight, targetWidth, targetHeight, outWidth, outHeight);
+}
+
+void VideoProcessor::fitDimensions(int inputWidth, int inputHeight, int maxWidth, int maxHeight,
+                                   int& outWidth, int& outHeight) {
+    if (inputWidth <= maxWidth && inputHeight <= maxHeight) {
         outWidth = inputWidth;
         outHeight = inputHeight;
         return;
     }
     
-    double widthRatio = static_cast<double>(targetWidth) / inputWidth;
-    double heightRatio = static_cast<double>(targetHeight) / inputHeight;
+    double widthRatio = static_cast<double>(maxWidth) / inputWidth;
+    double heightRatio = static_cast<double>(maxHeight) / inputHeight;
     
     double ratio = std::min(widthRatio, heightRatio);
     
@@ -68,16 +158,96 @@ void VideoProcessor::calculateOutputDimensions(int inputWidth, int inputHeight,
 }
 
 bool VideoProcessor::openInputFile(const std::string& inputPath) {
+    return openInputContainer(inputPath) && openDecoders();
+}
+
+bool VideoProcessor::openInputContainer(const std::string& inputPath) {
+    // Own IO with a large buffer and kernel read-ahead instead of the
+    // file protocol's small synchronous reads
+    if (!inputFile.open(inputPath)) {
+        std::cerr << "Could not open input file: " << inputPath << std::endl;
+        return false;
+    }
+    inputFormatContext = avformat_alloc_context();
+    if (!inputFormatContext) {
+        std::cerr << "Could not allocate input format context" << std::endl;
+        return false;
+    }
+    inputFormatContext->pb = inputFile.context();
+    
+    // The path still names the input for format probing
     if (avformat_open_input(&inputFormatContext, inputPath.c_str(), nullptr, nullptr) < 0) {
         std::cerr << "Could not open input file: " << inputPath << std::endl;
         return false;
     }
     
+    return findStreamInfo(probeCache ? ProbeCache::fileKey(inputPath) : "");
+}
+
+bool VideoProcessor::findStreamInfo(const std::string& cacheKey) {
+    if (!cacheKey.empty()) {
+        std::shared_ptr<const ProbeResult> cached = probeCache->lookup(cacheKey);
+        if (cached && applyProbeResult(*cached, inputFormatContext)) {
+            probeResult = cached;
+            return true;
+        }
+    }
+    
+    if (fastProbe) {
+        inputFormatContext->probesize = FAST_PROBE_BYTES;
+        inputFormatContext->max_analyze_duration = FAST_PROBE_DURATION;
+        // These store the frame rate in their header; no need to measure it
+        std::string container = inputFormatContext->iformat->name;
+        if (container.find("mp4") != std::string::npos || container.find("matroska") != std::string::npos ||
+            container == "mxf") {
+            inputFormatContext->fps_probe_size = 0;
+        }
+    }
+    
     if (avformat_find_stream_info(inputFormatContext, nullptr) < 0) {
         std::cerr << "Could not find stream information" << std::endl;
         return false;
     }
     
+    probeResult = captureProbeResult(inputFormatContext);
+    if (!cacheKey.empty() && probeResult) {
+        probeCache->store(cacheKey, probeResult);
+    }
+    return true;
+}
+
+bool VideoProcessor::openInputStream(StreamInput& input) {
+    unsigned char* buffer = static_cast<unsigned char*>(av_malloc(STREAM_IO_BUFFER_SIZE));
+    if (!buffer) {
+        std::cerr << "Could not allocate input stream buffer" << std::endl;
+        return false;
+    }
+    
+    // Non-seekable: the demuxer reads the upload front to back as it arrives
+    inputIOContext = avio_alloc_context(buffer, STREAM_IO_BUFFER_SIZE, 0, &input,
+                                        readStreamInput, nullptr, nullptr);
+    if (!inputIOContext) {
+        std::cerr << "Could not allocate input stream context" << std::endl;
+        av_free(buffer);
+        return false;
+    }
+    
+    inputFormatContext = avformat_alloc_context();
+    if (!inputFormatContext) {
+        std::cerr << "Could not allocate input format context" << std::endl;
+        return false;
+    }
+    inputFormatContext->pb = inputIOContext;
+    
+    if (avformat_open_input(&inputFormatContext, "", nullptr, nullptr) < 0) {
+        std::cerr << "Could not open input stream" << std::endl;
+        return false;
+    }
+    
+    return findStreamInfo("") && openDecoders();
+}
+
+bool VideoProcessor::openDecoders() {
     // Find video and audio streams
     for (unsigned int i = 0; i < inputFormatContext->nb_streams; i++) {
         if (inputFormatContext->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO && videoStreamIndex < 0) {
@@ -92,6 +262,15 @@ bool VideoProcessor::openInputFile(const std::string& inputPath) {
         return false;
     }
     
+    // Progress counts from the first video timestamp
+    AVStream* videoStream = inputFormatContext->streams[videoStreamIndex];
+    progressStart = videoStream->start_time != AV_NOPTS_VALUE
+        ? av_rescale_q(videoStream->start_time, videoStream->time_base, AVRational{1, AV_TIME_BASE})
+        : 0;
+    progressDuration = std::max<int64_t>(0, inputFormatContext->duration);
+    progressPosition = 0;
+    progressFrames = 0;
+    
     // Open video decoder
     const AVCodec* videoDecoder = avcodec_find_decoder(inputFormatContext->streams[videoStreamIndex]->codecpar->codec_id);
     if (!videoDecoder) {
@@ -111,6 +290,10 @@ bool VideoProcessor::openInputFile(const std::string& inputPath) {
         return false;
     }
     
+    // Frame threads where the codec supports them, slice threads otherwise
+    inputVideoCodecContext->thread_count = threading.decoderThreads;
+    inputVideoCodecContext->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+    
     if (avcodec_open2(inputVideoCodecContext, videoDecoder, nullptr) < 0) {
         std::cerr << "Could not open video decoder" << std::endl;
         return false;
@@ -145,6 +328,23 @@ bool VideoProcessor::openInputFile(const std::string& inputPath) {
     return true;
 }
 
+int VideoProcessor::readInputPacket(AVPacket* packet) {
+    if (cancelRequested()) {
+        return AVERROR_EXIT;
+    }
+    
+    int ret = av_read_frame(inputFormatContext, packet);
+    if (ret >= 0 && packet->stream_index == videoStreamIndex && packet->pts != AV_NOPTS_VALUE) {
+        AVStream* stream = inputFormatContext->streams[videoStreamIndex];
+        int64_t position = av_rescale_q(packet->pts, stream->time_base, AVRational{1, AV_TIME_BASE}) - progressStart;
+        // Packets come in decode order, so only ever move forward
+        if (position > progressPosition) {
+            progressPosition = position;
+        }
+    }
+    return ret;
+}
+
 bool VideoProcessor::setupOutputFile(const std::string& outputPath) {
     // Create output context
     avformat_alloc_output_context2(&outputFormatContext, nullptr, nullptr, outputPath.c_str());
@@ -154,18 +354,145 @@ bool VideoProcessor::setupOutputFile(const std::string& outputPath) {
     }
     
     // Setup video stream
-    const AVCodec* videoEncoder = avcodec_find_encoder_by_name("libx264");
-    if (!videoEncoder) {
-        std::cerr << "Could not find H.264 encoder" << std::endl;
-        return false;
-    }
-    
     AVStream* outVideoStream = avformat_new_stream(outputFormatContext, nullptr);
     if (!outVideoStream) {
         std::cerr << "Could not create output video stream" << std::endl;
         return false;
     }
     
+    // Remux video that already fits instead of re-encoding it
+    videoStreamCopy = canStreamCopy(videoStreamIndex);
+    if (videoStreamCopy) {
+        if (!setupStreamCopy(videoStreamIndex, outVideoStream)) {
+            return false;
+        }
+    } else if (!setupVideoEncoder(outVideoStream)) {
+        return false;
+    }
+    
+    // Setup audio stream if present
+    if (audioStreamIndex >= 0) {
+        AVStream* outAudioStream = avformat_new_stream(outputFormatContext, nullptr);
+        if (!outAudioStream) {
+            std::cerr << "Could not create output audio stream" << std::endl;
+            return false;
+        }
+        
+        audioStreamCopy = canStreamCopy(audioStreamIndex);
+        if (audioStreamCopy) {
+            if (!setupStreamCopy(audioStreamIndex, outAudioStream)) {
+                return false;
+            }
+        } else if (!setupAudioEncoder(outAudioStream)) {
+            return false;
+        }
+    }
+    
+    // Open output file. Muxed bytes go to a writer thread, so a slow
+    // volume holds up the encoder only once all its buffers are full.
+    if (!(outputFormatContext->oformat->flags & AVFMT_NOFILE)) {
+        if (!outputWriter.open(outputPath)) {
+            std::cerr << "Could not open output file" << std::endl;
+            return false;
+        }
+        outputFormatContext->pb = outputWriter.context();
+    }
+    
+    // The mp4 muxer flushes at each fragment boundary, so readers of the
+    // growing file only ever wait for the fragment being written
+    AVDictionary* options = nullptr;
+    const char* muxer = outputFormatContext->oformat->name;
+    if (fragmentedOutput && (strcmp(muxer, "mp4") == 0 || strcmp(muxer, "mov") == 0)) {
+        av_dict_set(&options, "movflags", "frag_keyframe+empty_moov+default_base_moof", 0);
+    }
+    
+    // Write header
+    int ret = avformat_write_header(outputFormatContext, &options);
+    av_dict_free(&options);
+    if (ret < 0) {
+        std::cerr << "Could not write output header" << std::endl;
+        return false;
+    }
+    
+    return true;
+}
+
+bool VideoProcessor::closeOutput() {
+    if (!outputWriter.isOpen()) {
+        return true;
+    }
+    // The context goes with the writer
+    if (outputFormatContext) {
+        outputFormatContext->pb = nullptr;
+    }
+    if (!outputWriter.close()) {
+        std::cerr << "Error writing output file" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool VideoProcessor::canStreamCopy(int inputStreamIndex) {
+    const AVCodecParameters* codecpar = inputFormatContext->streams[inputStreamIndex]->codecpar;
+    if (avformat_query_codec(outputFormatContext->oformat, codecpar->codec_id, FF_COMPLIANCE_NORMAL) != 1) {
+        return false;
+    }
+    
+    // AAC is what the audio would be encoded to anyway, so it is always copied
+    if (codecpar->codec_type == AVMEDIA_TYPE_AUDIO) {
+        return codecpar->codec_id == AV_CODEC_ID_AAC;
+    }
+    if (!streamCopyEnabled) {
+        return false;
+    }
+    
+    if (codecpar->codec_id != AV_CODEC_ID_H264 && codecpar->codec_id != AV_CODEC_ID_HEVC) {
+        return false;
+    }
+    
+    // Only video the selected encoder would produce, and only when nothing
+    // asked for the encode itself: a tuned preset or per-scene keyframes and CRF
+    const AVCodec* videoEncoder = avcodec_find_encoder_by_name(jobEncoderSettings.codec.c_str());
+    if (!videoEncoder || videoEncoder->id != codecpar->codec_id || autotuneEnabled || sceneAdaptive) {
+        return false;
+    }
+    if (!copyableVideoFormat(codecpar)) {
+        return false;
+    }
+    
+    // Only when no resize is needed
+    int outWidth, outHeight;
+    calculateOutputDimensions(codecpar->width, codecpar->height, outWidth, outHeight);
+    return outWidth == codecpar->width && outHeight == codecpar->height;
+}
+
+bool VideoProcessor::setupStreamCopy(int inputStreamIndex, AVStream* outStream) {
+    AVStream* inStream = inputFormatContext->streams[inputStreamIndex];
+    if (avcodec_parameters_copy(outStream->codecpar, inStream->codecpar) < 0) {
+        std::cerr << "Could not copy stream parameters" << std::endl;
+        return false;
+    }
+    
+    // Keep hvc1 (required by Apple players), let the muxer choose any other tag
+    if (outStream->codecpar->codec_tag != MKTAG('h', 'v', 'c', '1')) {
+        outStream->codecpar->codec_tag = 0;
+    }
+    outStream->time_base = inStream->time_base;
+    outStream->sample_aspect_ratio = inStream->sample_aspect_ratio;
+    return true;
+}
+
+bool VideoProcessor::setupVideoEncoder(AVStream* outVideoStream) {
+    if (!tuneEncoder()) {
+        return false;
+    }
+    
+    const AVCodec* videoEncoder = avcodec_find_encoder_by_name(jobEncoderSettings.codec.c_str());
+    if (!videoEncoder) {
+        std::cerr << "Could not find video encoder " << jobEncoderSettings.codec << std::endl;
+        return false;
+    }
+    
     outputVideoCodecContext = avcodec_alloc_context3(videoEncoder);
     if (!outputVideoCodecContext) {
         std::cerr << "Could not allocate video encoder context" << std::endl;
@@ -185,18 +512,15 @@ bool VideoProcessor::setupOutputFile(const std::string& outputPath) {
     outputVideoCodecContext->time_base = inputFormatContext->streams[videoStreamIndex]->time_base;
     outputVideoCodecContext->framerate = inputFormatContext->streams[videoStreamIndex]->avg_frame_rate;
     
-    // Set H.264 specific parameters
-    av_opt_set(outputVideoCodecContext->priv_data, "preset", "ultrafast", 0);
-    av_opt_set(outputVideoCodecContext->priv_data, "tune", "zerolatency", 0);
-    outputVideoCodecContext->thread_count = THREAD_COUNT;
+    // Preset, tune and CRF
+    applyEncoderSettings(outputVideoCodecContext, jobEncoderSettings);
+    outputVideoCodecContext->thread_count = threading.encoderThreads;
     
     if (outputFormatContext->oformat->flags & AVFMT_GLOBALHEADER) {
         outputVideoCodecContext->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
     }
     
-    // Set quality (CRF)
     outputVideoCodecContext->bit_rate = 0;  // Use CRF instead of bitrate
-    av_opt_set_int(outputVideoCodecContext->priv_data, "crf", CRF, 0);
     
     if (avcodec_open2(outputVideoCodecContext, videoEncoder, nullptr) < 0) {
         std::cerr << "Could not open video encoder" << std::endl;
@@ -208,78 +532,332 @@ bool VideoProcessor::setupOutputFile(const std::string& outputPath) {
         return false;
     }
     
+    // hvc1 rather than hev1, which Apple players refuse
+    if (outputVideoCodecContext->codec_id == AV_CODEC_ID_HEVC) {
+        outVideoStream->codecpar->codec_tag = MKTAG('h', 'v', 'c', '1');
+    }
     outVideoStream->time_base = outputVideoCodecContext->time_base;
+    return true;
+}
+
+bool VideoProcessor::setupAudioEncoder(AVStream* outAudioStream) {
+    const AVCodec* audioEncoder = avcodec_find_encoder(AV_CODEC_ID_AAC);
+    if (!audioEncoder) {
+        std::cerr << "Could not find AAC encoder" << std::endl;
+        return false;
+    }
     
-    // Setup audio stream if present
-    if (audioStreamIndex >= 0) {
-        const AVCodec* audioEncoder = avcodec_find_encoder(AV_CODEC_ID_AAC);
-        if (!audioEncoder) {
-            std::cerr << "Could not find AAC encoder" << std::endl;
-            return false;
+    outputAudioCodecContext = avcodec_alloc_context3(audioEncoder);
+    if (!outputAudioCodecContext) {
+        std::cerr << "Could not allocate audio encoder context" << std::endl;
+        return false;
+    }
+    
+    // Set audio encoding parameters; the audio stage resamples to them
+    outputAudioCodecContext->sample_fmt = audioEncoder->sample_fmts[0];
+    outputAudioCodecContext->bit_rate = AUDIO_BITRATE;
+    outputAudioCodecContext->sample_rate = encoderSampleRate(audioEncoder, inputAudioCodecContext->sample_rate);
+    
+    // Inputs that only give a channel count get the usual layout for it
+    if (inputAudioCodecContext->ch_layout.order == AV_CHANNEL_ORDER_UNSPEC) {
+        av_channel_layout_default(&outputAudioCodecContext->ch_layout, inputAudioCodecContext->ch_layout.nb_channels);
+    } else {
+        av_channel_layout_copy(&outputAudioCodecContext->ch_layout, &inputAudioCodecContext->ch_layout);
+    }
+    
+    outputAudioCodecContext->time_base = (AVRational){1, outputAudioCodecContext->sample_rate};
+    
+    if (outputFormatContext->oformat->flags & AVFMT_GLOBALHEADER) {
+        outputAudioCodecContext->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    }
+    
+    if (avcodec_open2(outputAudioCodecContext, audioEncoder, nullptr) < 0) {
+        std::cerr << "Could not open audio encoder" << std::endl;
+        return false;
+    }
+    
+    if (avcodec_parameters_from_context(outAudioStream->codecpar, outputAudioCodecContext) < 0) {
+        std::cerr << "Could not copy audio encoder parameters" << std::endl;
+        return false;
+    }
+    
+    outAudioStream->time_base = outputAudioCodecContext->time_base;
+    return true;
+}
+
+bool VideoProcessor::initScaler() {
+    // Scale if the size changes or the decoder output is not what the encoder takes
+    if (outputVideoCodecContext->width == inputVideoCodecContext->width &&
+        outputVideoCodecContext->height == inputVideoCodecContext->height &&
+        outputVideoCodecContext->pix_fmt == inputVideoCodecContext->pix_fmt) {
+        return true;
+    }
+    
+    if (!scaler.init(inputVideoCodecContext->width,
+                     inputVideoCodecContext->height,
+                     inputVideoCodecContext->pix_fmt,
+                     outputVideoCodecContext->width,
+                     outputVideoCodecContext->height,
+                     outputVideoCodecContext->pix_fmt,
+                     scaleQuality, threading.scalerThreads)) {
+        return false;
+    }
+    
+    // Scaled pictures come from a pool sized for this output
+    return framePool.configure(outputVideoCodecContext->width,
+                               outputVideoCodecContext->height,
+                               outputVideoCodecContext->pix_fmt);
+}
+
+AVFrame* VideoProcessor::allocScaledFrame() {
+    // A fresh pooled picture per frame: the encoder can keep a reference to
+    // the previous one without forcing a copy before the next scale
+    AVFrame* scaledFrame = framePool.acquirePicture();
+    if (!scaledFrame) {
+        std::cerr << "Could not allocate scaling frame" << std::endl;
+        return nullptr;
+    }
+    
+    return scaledFrame;
+}
+
+bool VideoProcessor::scaleFrame(const AVFrame* frame, AVFrame* scaledFrame) {
+    auto start = LatencyHistogram::Clock::now();
+    if (av_frame_make_writable(scaledFrame) < 0) {
+        std::cerr << "Could not make scaling frame writable" << std::endl;
+        return false;
+    }
+    
+    if (!scaler.scale(frame, scaledFrame)) {
+        std::cerr << "Error scaling frame" << std::endl;
+        return false;
+    }
+    scaledFrame->pts = frame->pts;
+    metrics.scale.observeSince(start);
+    return true;
+}
+
+int VideoProcessor::sendDecoderPacket(const AVPacket* packet) {
+    // Charged to the next frame the decoder returns
+    auto start = LatencyHistogram::Clock::now();
+    int ret = avcodec_send_packet(inputVideoCodecContext, packet);
+    pendingDecodeSeconds += LatencyHistogram::secondsSince(start);
+    return ret;
+}
+
+int VideoProcessor::receiveDecoderFrame(AVFrame* frame) {
+    auto start = LatencyHistogram::Clock::now();
+    int ret = avcodec_receive_frame(inputVideoCodecContext, frame);
+    if (ret >= 0) {
+        metrics.decode.observe(pendingDecodeSeconds + LatencyHistogram::secondsSince(start));
+        pendingDecodeSeconds = 0.0;
+    }
+    return ret;
+}
+
+bool VideoProcessor::writePacket(AVPacket* packet) {
+    if (packetSink) {
+        return packetSink(packet);
+    }
+    
+    metrics.bytesOut += packet->size;
+    std::lock_guard<std::mutex> lock(muxMutex);
+    // Encoded audio due before this packet goes first, so both streams reach the muxer in dts order
+    if (audioTranscoder.active() && packet->stream_index != audioOutputStreamIndex && !writeEncodedAudio(packet)) {
+        return false;
+    }
+    return av_interleaved_write_frame(outputFormatContext, packet) >= 0;
+}
+
+bool VideoProcessor::writeEncodedAudio(const AVPacket* until) {
+    AVPacket* packet = packetPool.acquire();
+    if (!packet) {
+        std::cerr << "Could not allocate packet" << std::endl;
+        return false;
+    }
+    
+    AVStream* outAudioStream = outputFormatContext->streams[audioOutputStreamIndex];
+    int64_t dts = until ? until->dts : AV_NOPTS_VALUE;
+    AVRational timeBase = until ? outputFormatContext->streams[until->stream_index]->time_base : AVRational{1, 1};
+    bool ok = true;
+    while (ok && audioTranscoder.pop(packet, dts, timeBase)) {
+        packet->stream_index = audioOutputStreamIndex;
+        av_packet_rescale_ts(packet, outputAudioCodecContext->time_base, outAudioStream->time_base);
+        metrics.bytesOut += packet->size;
+        ok = av_interleaved_write_frame(outputFormatContext, packet) >= 0;
+        av_packet_unref(packet);
+    }
+    packetPool.release(packet);
+    if (!ok) {
+        std::cerr << "Error writing audio packet" << std::endl;
+    }
+    return ok;
+}
+
+bool VideoProcessor::finishAudio() {
+    if (!outputAudioCodecContext) {
+        return true;
+    }
+    if (!audioTranscoder.finish()) {
+        std::cerr << "Error transcoding audio" << std::endl;
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(muxMutex);
+    return writeEncodedAudio(nullptr);
+}
+
+bool VideoProcessor::encodeFrame(const AVFrame* frame) {
+    auto start = LatencyHistogram::Clock::now();
+    
+    // A null frame flushes the encoder
+    int ret = avcodec_send_frame(outputVideoCodecContext, frame);
+    if (ret < 0) {
+        std::cerr << "Error sending frame for encoding" << std::endl;
+        return false;
+    }
+    
+    AVPacket* outPacket = packetPool.acquire();
+    if (!outPacket) {
+        std::cerr << "Could not allocate packet" << std::endl;
+        return false;
+    }
+    
+    bool ok = true;
+    while (ok) {
+        ret = avcodec_receive_packet(outputVideoCodecContext, outPacket);
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+            break;
+        } else if (ret < 0) {
+            std::cerr << "Error receiving packet from encoder" << std::endl;
+            ok = false;
+            break;
         }
         
-        AVStream* outAudioStream = avformat_new_stream(outputFormatContext, nullptr);
-        if (!outAudioStream) {
-            std::cerr << "Could not create output audio stream" << std::endl;
-            return false;
-        }
+        outPacket->stream_index = 0;
+        av_packet_rescale_ts(outPacket,
+                           outputVideoCodecContext->time_base,
+                           outputFormatContext->streams[0]->time_base);
         
-        outputAudioCodecContext = avcodec_alloc_context3(audioEncoder);
-        if (!outputAudioCodecContext) {
-            std::cerr << "Could not allocate audio encoder context" << std::endl;
-            return false;
+        ok = writePacket(outPacket);
+        av_packet_unref(outPacket);
+        if (!ok) {
+            std::cerr << "Error writing frame" << std::endl;
         }
-        
-        // Set audio encoding parameters
-        outputAudioCodecContext->sample_fmt = audioEncoder->sample_fmts[0];
-        outputAudioCodecContext->bit_rate = AUDIO_BITRATE;
-        outputAudioCodecContext->sample_rate = inputAudioCodecContext->sample_rate;
-        
-        // Update channel layout handling for newer FFmpeg
-        AVChannelLayout out_ch_layout;
-        av_channel_layout_copy(&out_ch_layout, &inputAudioCodecContext->ch_layout);
-        av_channel_layout_copy(&outputAudioCodecContext->ch_layout, &out_ch_layout);
-        
-        outputAudioCodecContext->time_base = (AVRational){1, outputAudioCodecContext->sample_rate};
-        
-        if (outputFormatContext->oformat->flags & AVFMT_GLOBALHEADER) {
-            outputAudioCodecContext->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    }
+    packetPool.release(outPacket);
+    if (!ok) {
+        return false;
+    }
+    
+    if (frame) {
+        metrics.encode.observeSince(start);
+        progressFrames++;
+    }
+    return true;
+}
+
+bool VideoProcessor::encodeAnalyzedFrame(AVFrame* frame) {
+    if (!sceneAdaptive) {
+        return encodeFrame(frame);
+    }
+    
+    bool holding = heldFrame && heldFrame->buf[0];
+    if (!frame) {
+        // The last repeat ends the output at the input's duration
+        if (holding) {
+            heldFrame->pict_type = AV_PICTURE_TYPE_NONE;
+            bool encoded = encodeFrame(heldFrame);
+            av_frame_unref(heldFrame);
+            if (!encoded) {
+                return false;
+            }
         }
-        
-        if (avcodec_open2(outputAudioCodecContext, audioEncoder, nullptr) < 0) {
-            std::cerr << "Could not open audio encoder" << std::endl;
-            return false;
+        return encodeFrame(nullptr);
+    }
+    
+    double seconds = frame->pts != AV_NOPTS_VALUE ? frame->pts * av_q2d(outputVideoCodecContext->time_base) : -1.0;
+    SceneDecision decision = sceneAnalyzer.analyze(frame, seconds);
+    if (decision.drop) {
+        if (!heldFrame) {
+            heldFrame = av_frame_alloc();
         }
-        
-        if (avcodec_parameters_from_context(outAudioStream->codecpar, outputAudioCodecContext) < 0) {
-            std::cerr << "Could not copy audio encoder parameters" << std::endl;
-            return false;
+        if (heldFrame) {
+            av_frame_unref(heldFrame);
+            if (av_frame_ref(heldFrame, frame) >= 0) {
+                if (holding) {
+                    metrics.framesDropped++;
+                }
+                return true;
+            }
         }
-        
-        outAudioStream->time_base = outputAudioCodecContext->time_base;
+        // Could not keep a reference: encode it after all
+    } else if (holding) {
+        av_frame_unref(heldFrame);
+        metrics.framesDropped++;
     }
     
-    // Open output file
-    if (!(outputFormatContext->oformat->flags & AVFMT_NOFILE)) {
-        if (avio_open(&outputFormatContext->pb, outputPath.c_str(), AVIO_FLAG_WRITE) < 0) {
-            std::cerr << "Could not open output file" << std::endl;
-            return false;
+    frame->pict_type = decision.sceneCut ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+    if (decision.sceneCut) {
+        metrics.sceneCuts++;
+    }
+    
+    // libx264 picks up a changed CRF before its next frame; the other
+    // wrappers only read it when the encoder is opened
+    if (jobEncoderSettings.codec == "libx264") {
+        int crf = std::min(51, std::max(0, jobEncoderSettings.crf + decision.crfOffset));
+        if (crf != sceneCrf) {
+            av_opt_set_int(outputVideoCodecContext->priv_data, "crf", crf, 0);
+            sceneCrf = crf;
         }
     }
+    return encodeFrame(frame);
+}
+
+bool VideoProcessor::remuxPacket(const AVPacket* packet, int outputStreamIndex) {
+    AVPacket* outPacket = packetPool.acquire();
+    if (!outPacket || av_packet_ref(outPacket, packet) < 0) {
+        std::cerr << "Could not reference packet" << std::endl;
+        packetPool.release(outPacket);
+        return false;
+    }
     
-    // Write header
-    if (avformat_write_header(outputFormatContext, nullptr) < 0) {
-        std::cerr << "Could not write output header" << std::endl;
+    outPacket->stream_index = outputStreamIndex;
+    outPacket->pos = -1;
+    av_packet_rescale_ts(outPacket,
+                       inputFormatContext->streams[packet->stream_index]->time_base,
+                       outputFormatContext->streams[outputStreamIndex]->time_base);
+    
+    bool written = writePacket(outPacket);
+    packetPool.release(outPacket);
+    if (!written) {
+        std::cerr << "Error writing remuxed packet" << std::endl;
         return false;
     }
+    return true;
+}
+
+bool VideoProcessor::writeAudioPacket(const AVPacket* packet) {
+    if (audioStreamCopy) {
+        return remuxPacket(packet, audioOutputStreamIndex);
+    }
     
+    // Decoded, resampled and encoded on the audio thread; writePacket
+    // interleaves the results with the video
+    if (!audioTranscoder.active() &&
+        !audioTranscoder.start(inputAudioCodecContext, outputAudioCodecContext,
+                               inputFormatContext->streams[audioStreamIndex]->time_base)) {
+        return false;
+    }
+    if (!audioTranscoder.push(packet)) {
+        std::cerr << "Error transcoding audio" << std::endl;
+        return false;
+    }
     return true;
 }
 
 bool VideoProcessor::processFrames() {
     AVPacket* packet = av_packet_alloc();
     AVFrame* frame = av_frame_alloc();
-    AVFrame* swsFrame = nullptr;
     
     if (!packet || !frame) {
         std::cerr << "Could not allocate packet/frame" << std::endl;
@@ -287,183 +865,255 @@ bool VideoProcessor::processFrames() {
     }
     
     // Initialize scaling context if needed
-    if (outputVideoCodecContext->width != inputVideoCodecContext->width ||
-        outputVideoCodecContext->height != inputVideoCodecContext->height) {
-        swsFrame = av_frame_alloc();
-        if (!swsFrame) {
-            std::cerr << "Could not allocate scaling frame" << std::endl;
-            return false;
-        }
-        
-        swsFrame->format = outputVideoCodecContext->pix_fmt;
-        swsFrame->width = outputVideoCodecContext->width;
-        swsFrame->height = outputVideoCodecContext->height;
-        
-        if (av_frame_get_buffer(swsFrame, 0) < 0) {
-            std::cerr << "Could not allocate scaling frame buffer" << std::endl;
-            return false;
-        }
-        
-        swsContext = sws_getContext(inputVideoCodecContext->width,
-                                  inputVideoCodecContext->height,
-                                  inputVideoCodecContext->pix_fmt,
-                                  outputVideoCodecContext->width,
-                                  outputVideoCodecContext->height,
-                                  outputVideoCodecContext->pix_fmt,
-                                  SWS_BILINEAR, nullptr, nullptr, nullptr);
-        if (!swsContext) {
-            std::cerr << "Could not initialize scaling context" << std::endl;
-            return false;
-        }
+    if (!videoStreamCopy && !initScaler()) {
+        return false;
     }
     
-    while (av_read_frame(inputFormatContext, packet) >= 0) {
-        if (packet->stream_index == videoStreamIndex) {
-            // Decode video
-            int ret = avcodec_send_packet(inputVideoCodecContext, packet);
-            if (ret < 0) {
-                std::cerr << "Error sending packet for decoding" << std::endl;
+    // Decode and encode everything the decoder has ready
+    auto drainDecoder = [&]() {
+        while (true) {
+            int ret = receiveDecoderFrame(frame);
+            if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+                return true;
+            } else if (ret < 0) {
+                std::cerr << "Error receiving frame" << std::endl;
                 return false;
             }
             
-            while (ret >= 0) {
-                ret = avcodec_receive_frame(inputVideoCodecContext, frame);
-                if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
-                    break;
-                } else if (ret < 0) {
-                    std::cerr << "Error receiving frame" << std::endl;
-                    return false;
-                }
-                
-                // Scale if needed
-                AVFrame* encodeFrame = frame;
-                if (swsContext) {
-                    sws_scale(swsContext, frame->data, frame->linesize, 0,
-                             frame->height, swsFrame->data, swsFrame->linesize);
-                    swsFrame->pts = frame->pts;
-                    encodeFrame = swsFrame;
-                }
-                
-                // Encode video
-                ret = avcodec_send_frame(outputVideoCodecContext, encodeFrame);
-                if (ret < 0) {
-                    std::cerr << "Error sending frame for encoding" << std::endl;
+            // Scale if needed
+            AVFrame* scaledFrame = nullptr;
+            if (scaler.active()) {
+                scaledFrame = allocScaledFrame();
+                bool scaled = scaledFrame && scaleFrame(frame, scaledFrame);
+                if (!scaled) {
+                    framePool.release(scaledFrame);
+                    av_frame_unref(frame);
                     return false;
                 }
-                
-                while (ret >= 0) {
-                    AVPacket* outPacket = av_packet_alloc();
-                    ret = avcodec_receive_packet(outputVideoCodecContext, outPacket);
-                    if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
-                        av_packet_free(&outPacket);
-                        break;
-                    } else if (ret < 0) {
-                        std::cerr << "Error receiving packet from encoder" << std::endl;
-                        av_packet_free(&outPacket);
-                        return false;
-                    }
-                    
-                    outPacket->stream_index = 0;
-                    av_packet_rescale_ts(outPacket,
-                                       outputVideoCodecContext->time_base,
-                                       outputFormatContext->streams[0]->time_base);
-                    
-                    ret = av_interleaved_write_frame(outputFormatContext, outPacket);
-                    av_packet_free(&outPacket);
-                    if (ret < 0) {
-                        std::cerr << "Error writing frame" << std::endl;
-                        return false;
-                    }
-                }
+            } else {
+                // Let the encoder pick its own frame types
+                frame->pict_type = AV_PICTURE_TYPE_NONE;
             }
-        } else if (packet->stream_index == audioStreamIndex && audioStreamIndex >= 0) {
-            // Process audio similarly (simplified for brevity)
-            AVPacket* outPacket = av_packet_alloc();
-            av_packet_copy_props(outPacket, packet);
-            outPacket->stream_index = 1;
-            
-            av_packet_rescale_ts(outPacket,
-                               inputFormatContext->streams[audioStreamIndex]->time_base,
-                               outputFormatContext->streams[1]->time_base);
             
-            if (av_interleaved_write_frame(outputFormatContext, outPacket) < 0) {
-                std::cerr << "Error writing audio frame" << std::endl;
-                av_packet_free(&outPacket);
+            bool encoded = encodeAnalyzedFrame(scaledFrame ? scaledFrame : frame);
+            framePool.release(scaledFrame);
+            av_frame_unref(frame);
+            if (!encoded) {
                 return false;
             }
-            av_packet_free(&outPacket);
+        }
+    };
+    
+    bool ok = true;
+    int readResult = 0;
+    while (ok && (readResult = readInputPacket(packet)) >= 0) {
+        if (packet->stream_index == videoStreamIndex && videoStreamCopy) {
+            ok = remuxPacket(packet, 0);
+        } else if (packet->stream_index == videoStreamIndex) {
+            // Decode video
+            if (sendDecoderPacket(packet) < 0) {
+                std::cerr << "Error sending packet for decoding" << std::endl;
+                ok = false;
+            } else {
+                ok = drainDecoder();
+            }
+        } else if (packet->stream_index == audioStreamIndex && audioStreamIndex >= 0) {
+            ok = writeAudioPacket(packet);
         }
         
         av_packet_unref(packet);
     }
+    // Cancelled: stop without flushing or finishing the file
+    ok = ok && readResult != AVERROR_EXIT;
     
-    // Flush encoders
-    avcodec_send_frame(outputVideoCodecContext, nullptr);
-    while (true) {
-        AVPacket* outPacket = av_packet_alloc();
-        int ret = avcodec_receive_packet(outputVideoCodecContext, outPacket);
-        if (ret == AVERROR_EOF) {
-            av_packet_free(&outPacket);
-            break;
-        }
-        if (ret < 0) {
-            std::cerr << "Error flushing video encoder" << std::endl;
-            av_packet_free(&outPacket);
-            return false;
-        }
-        
-        outPacket->stream_index = 0;
-        av_packet_rescale_ts(outPacket,
-                           outputVideoCodecContext->time_base,
-                           outputFormatContext->streams[0]->time_base);
-        
-        ret = av_interleaved_write_frame(outputFormatContext, outPacket);
-        av_packet_free(&outPacket);
-        if (ret < 0) {
-            std::cerr << "Error writing frame during flush" << std::endl;
-            return false;
-        }
+    // Flush decoder, then encoder
+    if (ok && !videoStreamCopy) {
+        sendDecoderPacket(nullptr);
+        ok = drainDecoder() && encodeAnalyzedFrame(nullptr);
     }
     
-    // Write trailer
-    if (av_write_trailer(outputFormatContext) < 0) {
-        std::cerr << "Error writing trailer" << std::endl;
+    av_frame_free(&frame);
+    av_packet_free(&packet);
+    
+    if (!ok) {
         return false;
     }
     
-    av_frame_free(&frame);
-    if (swsFrame) {
-        av_frame_free(&swsFrame);
+    // Write trailer
+    if (!finishAudio() || av_write_trailer(outputFormatContext) < 0) {
+        std::cerr << "Error writing trailer" << std::endl;
+        return false;
     }
-    av_packet_free(&packet);
     
     return true;
 }
 
 bool VideoProcessor::processVideo(const std::string& inputPath, const std::string& outputPath) {
+    yieldedLast = false;
     try {
-        if (!openInputFile(inputPath)) {
-            return false;
-        }
+        metrics.reset();
+        auto openStart = LatencyHistogram::Clock::now();
+        bool opened = openInputFile(inputPath);
+        metrics.open.observeSince(openStart);
         
-        if (!setupOutputFile(outputPath)) {
-            return false;
-        }
+        bool segmented = segmentCountSetting > 1 || checkpointSeconds > 0;
+        bool processed = opened &&
+                         (segmented ? transcodeSegmented(inputPath, outputPath)
+                                    : transcodeOpenedInput(outputPath));
+        processed = closeOutput() && processed;
         
-        if (!processFrames()) {
-            return false;
+        cleanup();
+        if (!processed && cancelRequested()) {
+            std::remove(outputPath.c_str());
         }
+        return processed;
+    } catch (const std::exception& e) {
+        std::cerr << "Error processing video: " << e.what() << std::endl;
+        cleanup();
+        return false;
+    }
+}
+
+bool VideoProcessor::processStream(StreamInput& input, const std::string& outputPath) {
+    try {
+        metrics.reset();
+        auto openStart = LatencyHistogram::Clock::now();
+        bool opened = openInputStream(input);
+        metrics.open.observeSince(openStart);
+        
+        bool processed = opened && transcodeOpenedInput(outputPath);
+        processed = closeOutput() && processed;
         
         cleanup();
-        return true;
+        if (!processed && cancelRequested()) {
+            std::remove(outputPath.c_str());
+        }
+        return processed;
     } catch (const std::exception& e) {
-        std::cerr << "Error processing video: " << e.what() << std::endl;
+        std::cerr << "Error processing video stream: " << e.what() << std::endl;
         cleanup();
         return false;
     }
 }
 
+bool VideoProcessor::transcodeOpenedInput(const std::string& outputPath) {
+    if (!setupOutputFile(outputPath)) {
+        return false;
+    }
+    // A remux has no decode/scale/encode work to spread over threads
+    if (pipelineMode && !videoStreamCopy) {
+        return processFramesPipelined();
+    }
+    return processFrames();
+}
+
 void VideoProcessor::setTargetResolution(int width, int height) {
     targetWidth = width;
     targetHeight = height;
+}
+
+std::string VideoProcessor::outputSignature() const {
+    std::ostringstream signature;
+    signature << encoderSettings.codec << "/" << encoderSettings.preset
+              << "/" << (encoderSettings.tune.empty() ? "none" : encoderSettings.tune)
+              << "/crf" << encoderSettings.crf
+              << "/autotune" << (autotuneEnabled ? autotuneTarget.realtimeFactor : 0.0)
+              << "/max" << targetWidth << "x" << targetHeight
+              << "/aac" << AUDIO_BITRATE << "-resampled"
+              << "/copy" << (streamCopyEnabled ? 1 : 0)
+              << "/frag" << (fragmentedOutput ? 1 : 0)
+              << "/scene" << (sceneAdaptive ? 1 : 0)
+              << "/scale-" << scaleQualityName(scaleQuality);
+    return signature.str();
+}
+
+void VideoProcessor::setStreamCopy(bool enabled) {
+    streamCopyEnabled = enabled;
+}
+
+bool VideoProcessor::probe(const std::string& inputPath, MediaInfo& info) {
+    try {
+        bool probed = openInputContainer(inputPath) && probeResult;
+        if (probed) {
+            info = probeResult->info;
+        }
+        cleanup();
+        return probed;
+    } catch (const std::exception& e) {
+        std::cerr << "Error probing video: " << e.what() << std::endl;
+        cleanup();
+        return false;
+    }
+}
+
+void VideoProcessor::setFastProbe(bool enabled) {
+    fastProbe = enabled;
+}
+
+void VideoProcessor::setProbeCache(ProbeCache* cache) {
+    probeCache = cache;
+}
+
+void VideoProcessor::setSceneAdaptive(bool enabled) {
+    sceneAdaptive = enabled;
+}
+
+void VideoProcessor::setFragmentedOutput(bool enabled) {
+    fragmentedOutput = enabled;
+}
+
+void VideoProcessor::setScaleQuality(ScaleQuality quality) {
+    scaleQuality = quality;
+}
+
+bool VideoProcessor::setEncoder(const std::string& codec) {
+    if (!encoderAvailable(codec)) {
+        std::cerr << "Encoder " << codec << " is not available" << std::endl;
+        return false;
+    }
+    
+    // Fastest preset at the default quality, like the x264 default
+    EncoderSettings settings = tuningCandidates(codec, EncoderSettings().crf).front();
+    settings.tune = EncoderSettings().tune;
+    encoderSettings = settings;
+    jobEncoderSettings = settings;
+    return true;
+}
+
+void VideoProcessor::setAutotune(bool enabled, const AutotuneTarget& target, EncoderTuningCache* cache) {
+    autotuneEnabled = enabled;
+    autotuneTarget = target;
+    tuningCache = cache;
+}
+
+TranscodeProgress VideoProcessor::getProgress() const {
+    TranscodeProgress progress;
+    progress.mediaSeconds = static_cast<double>(progressPosition.load()) / AV_TIME_BASE;
+    progress.durationSeconds = static_cast<double>(progressDuration.load()) / AV_TIME_BASE;
+    progress.framesEncoded = progressFrames.load();
+    return progress;
+}
+
+double TranscodeProgress::fraction() const {
+    if (durationSeconds <= 0.0) {
+        return -1.0;
+    }
+    return std::min(1.0, std::max(0.0, mediaSeconds / durationSeconds));
+}
+
+void VideoProcessor::setCancelFlag(const std::atomic<bool>* flag) {
+    cancelFlag = flag;
+}
+
+void VideoProcessor::setYieldFlag(const std::atomic<bool>* flag) {
+    yieldFlag = flag;
+}
+
+void VideoProcessor::setThreadingPolicy(const ThreadingPolicy& policy) {
+    threading = policy;
+}
+
+void VideoProcessor::setPipelineMode(bool enabled, int queueDepth) {
+    pipelineMode = enabled;
+    pipelineQueueDepth = queueDepth > 0 ? queueDepth : 1;
 } 
\ No newline at end of file
@@ -0,0 +1,124 @@
+#include "video_processor.hpp"
+#include <algorithm>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <utility>
+
+namespace {
+
+// key=value pairs joined by ';'. Values are codec, preset and tune names
+// and numbers, none of which contain either separator.
+bool parseSettings(const std::string& settings, std::map<std::string, std::string>& values) {
+    std::istringstream stream(settings);
+    std::string pair;
+    while (std::getline(stream, pair, ';')) {
+        size_t equals = pair.find('=');
+        if (equals == std::string::npos) {
+            return false;
+        }
+        values[pair.substr(0, equals)] = pair.substr(equals + 1);
+    }
+    return true;
+}
+
+} // namespace
+
+void VideoProcessor::setSegmentRunner(SegmentRunner runner, int slots) {
+    segmentRunner = std::move(runner);
+    segmentRunnerSlots = segmentRunner ? std::max(0, slots) : 0;
+}
+
+std::string VideoProcessor::exportSettings() const {
+    std::ostringstream settings;
+    settings << "width=" << targetWidth
+             << ";height=" << targetHeight
+             << ";codec=" << encoderSettings.codec
+             << ";preset=" << encoderSettings.preset
+             << ";tune=" << encoderSettings.tune
+             << ";crf=" << encoderSettings.crf
+             << ";autotune=" << (autotuneEnabled ? 1 : 0)
+             << ";realtime=" << autotuneTarget.realtimeFactor
+             << ";deadline=" << autotuneTarget.deadlineSeconds
+             << ";copy=" << (streamCopyEnabled ? 1 : 0)
+             << ";frag=" << (fragmentedOutput ? 1 : 0)
+             << ";scale=" << scaleQualityName(scaleQuality)
+             << ";scene=" << (sceneAdaptive ? 1 : 0)
+             << ";fastprobe=" << (fastProbe ? 1 : 0)
+             << ";pipeline=" << (pipelineMode ? pipelineQueueDepth : 0)
+             << ";segments=" << segmentCountSetting;
+    return settings.str();
+}
+
+bool VideoProcessor::importSettings(const std::string& settings) {
+    std::map<std::string, std::string> values;
+    if (!parseSettings(settings, values)) {
+        std::cerr << "Malformed processor settings: " << settings << std::endl;
+        return false;
+    }
+    
+    // Keys this build does not know are ignored, so a newer coordinator
+    // can still hand work to older workers
+    try {
+        auto number = [&](const char* key, double fallback) {
+            auto it = values.find(key);
+            return it != values.end() ? std::stod(it->second) : fallback;
+        };
+        auto text = [&](const char* key, const std::string& fallback) {
+            auto it = values.find(key);
+            return it != values.end() ? it->second : fallback;
+        };
+        
+        targetWidth = static_cast<int>(number("width", targetWidth));
+        targetHeight = static_cast<int>(number("height", targetHeight));
+        encoderSettings.codec = text("codec", encoderSettings.codec);
+        encoderSettings.preset = text("preset", encoderSettings.preset);
+        encoderSettings.tune = text("tune", encoderSettings.tune);
+        encoderSettings.crf = static_cast<int>(number("crf", encoderSettings.crf));
+        jobEncoderSettings = encoderSettings;
+        encoderTuned = false;
+        autotuneEnabled = number("autotune", autotuneEnabled ? 1 : 0) != 0;
+        autotuneTarget.realtimeFactor = number("realtime", autotuneTarget.realtimeFactor);
+        autotuneTarget.deadlineSeconds = number("deadline", autotuneTarget.deadlineSeconds);
+        streamCopyEnabled = number("copy", streamCopyEnabled ? 1 : 0) != 0;
+        fragmentedOutput = number("frag", fragmentedOutput ? 1 : 0) != 0;
+        if (values.count("scale") && !parseScaleQuality(values["scale"], scaleQuality)) {
+            return false;
+        }
+        sceneAdaptive = number("scene", sceneAdaptive ? 1 : 0) != 0;
+        fastProbe = number("fastprobe", fastProbe ? 1 : 0) != 0;
+        int queueDepth = static_cast<int>(number("pipeline", pipelineMode ? pipelineQueueDepth : 0));
+        pipelineMode = queueDepth > 0;
+        pipelineQueueDepth = queueDepth > 0 ? queueDepth : pipelineQueueDepth;
+        segmentCountSetting = static_cast<int>(number("segments", segmentCountSetting));
+    } catch (const std::exception&) {
+        std::cerr << "Malformed processor settings: " << settings << std::endl;
+        return false;
+    }
+    
+    if (!encoderAvailable(encoderSettings.codec)) {
+        std::cerr << "Encoder " << encoderSettings.codec << " is not available" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool VideoProcessor::processSegment(const SegmentTask& task) {
+    if (!importSettings(task.settings)) {
+        return false;
+    }
+    try {
+        metrics.reset();
+        // The job's encoder settings were tuned already, if at all
+        autotuneEnabled = false;
+        streamCopyEnabled = false;
+        bool processed = transcodeSegment(task.inputPath, task.spoolPath, task.startPts, task.endPts);
+        cleanup();
+        return processed;
+    } catch (const std::exception& e) {
+        std::cerr << "Error processing segment: " << e.what() << std::endl;
+        cleanup();
+        return false;
+    }
+}
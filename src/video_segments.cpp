@@ -0,0 +1,599 @@
+#include "video_processor.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <limits>
+#include <sstream>
+#include <thread>
+#include <unistd.h>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+}
+
+namespace {
+
+// Encoded segments are spooled to disk in a minimal packet format rather than
+// a container, so timestamps come back exactly as the encoder produced them
+const char SPOOL_MAGIC[8] = {'V', 'P', 'S', 'E', 'G', '0', '0', '1'};
+
+bool writeSpoolHeader(FILE* file, AVRational timeBase) {
+    int32_t fields[2] = {timeBase.num, timeBase.den};
+    return fwrite(SPOOL_MAGIC, sizeof(SPOOL_MAGIC), 1, file) == 1 &&
+           fwrite(fields, sizeof(fields), 1, file) == 1;
+}
+
+bool readSpoolHeader(FILE* file, AVRational& timeBase) {
+    char magic[sizeof(SPOOL_MAGIC)];
+    int32_t fields[2];
+    if (fread(magic, sizeof(magic), 1, file) != 1 ||
+        std::memcmp(magic, SPOOL_MAGIC, sizeof(magic)) != 0 ||
+        fread(fields, sizeof(fields), 1, file) != 1) {
+        return false;
+    }
+    timeBase = AVRational{fields[0], fields[1]};
+    return true;
+}
+
+bool writeSpoolPacket(FILE* file, const AVPacket* packet) {
+    int64_t timestamps[3] = {packet->pts, packet->dts, packet->duration};
+    int32_t fields[2] = {packet->flags, packet->size};
+    return fwrite(timestamps, sizeof(timestamps), 1, file) == 1 &&
+           fwrite(fields, sizeof(fields), 1, file) == 1 &&
+           fwrite(packet->data, 1, packet->size, file) == static_cast<size_t>(packet->size);
+}
+
+// Returns false at the end of the spool or on a truncated packet
+bool readSpoolPacket(FILE* file, AVPacket* packet) {
+    int64_t timestamps[3];
+    int32_t fields[2];
+    if (fread(timestamps, sizeof(timestamps), 1, file) != 1 ||
+        fread(fields, sizeof(fields), 1, file) != 1 ||
+        fields[1] < 0 ||
+        av_new_packet(packet, fields[1]) < 0) {
+        return false;
+    }
+    packet->pts = timestamps[0];
+    packet->dts = timestamps[1];
+    packet->duration = timestamps[2];
+    packet->flags = fields[0];
+    return fread(packet->data, 1, packet->size, file) == static_cast<size_t>(packet->size);
+}
+
+std::string segmentPath(const std::string& outputPath, size_t index) {
+    return outputPath + ".seg" + std::to_string(index);
+}
+
+std::string planPath(const std::string& outputPath) {
+    return outputPath + ".plan";
+}
+
+std::string readFile(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+// Written next to the segments and swapped in whole, like the cache index
+bool writePlan(const std::string& path, const std::string& plan) {
+    std::string tempPath = path + ".tmp";
+    {
+        std::ofstream file(tempPath, std::ios::trunc);
+        file << plan;
+        if (!file) {
+            return false;
+        }
+    }
+    return std::rename(tempPath.c_str(), path.c_str()) == 0;
+}
+
+} // namespace
+
+void VideoProcessor::setSegmentParallelism(int segmentCount, int workerCount) {
+    segmentCountSetting = segmentCount;
+    segmentWorkerSetting = workerCount;
+}
+
+void VideoProcessor::setCheckpointInterval(int seconds) {
+    checkpointSeconds = std::max(0, seconds);
+}
+
+void VideoProcessor::copySettingsTo(VideoProcessor& other) const {
+    other.targetWidth = targetWidth;
+    other.targetHeight = targetHeight;
+    other.streamCopyEnabled = streamCopyEnabled;
+    other.scaleQuality = scaleQuality;
+    other.sceneAdaptive = sceneAdaptive;
+    // Workers encode with what this job was tuned to and never tune themselves
+    other.encoderSettings = jobEncoderSettings;
+    other.jobEncoderSettings = jobEncoderSettings;
+    other.cancelFlag = cancelFlag;
+    // Every worker opens the input again; the cache spares each the probe
+    other.fastProbe = fastProbe;
+    other.probeCache = probeCache;
+}
+
+bool VideoProcessor::probeKeyframes(std::vector<int64_t>& keyframes) {
+    // Only the video stream's packet flags are needed
+    for (unsigned int i = 0; i < inputFormatContext->nb_streams; i++) {
+        if (static_cast<int>(i) != videoStreamIndex) {
+            inputFormatContext->streams[i]->discard = AVDISCARD_ALL;
+        }
+    }
+    
+    AVPacket* packet = av_packet_alloc();
+    if (!packet) {
+        std::cerr << "Could not allocate packet" << std::endl;
+        return false;
+    }
+    while (av_read_frame(inputFormatContext, packet) >= 0) {
+        if (packet->stream_index == videoStreamIndex &&
+            (packet->flags & AV_PKT_FLAG_KEY) && packet->pts != AV_NOPTS_VALUE) {
+            keyframes.push_back(packet->pts);
+        }
+        av_packet_unref(packet);
+    }
+    av_packet_free(&packet);
+    
+    for (unsigned int i = 0; i < inputFormatContext->nb_streams; i++) {
+        inputFormatContext->streams[i]->discard = AVDISCARD_DEFAULT;
+    }
+    std::sort(keyframes.begin(), keyframes.end());
+    
+    // Back to the start for the audio that is remuxed during the join
+    if (avformat_seek_file(inputFormatContext, -1, std::numeric_limits<int64_t>::min(), 0,
+                           std::numeric_limits<int64_t>::max(), 0) < 0) {
+        std::cerr << "Could not rewind input after keyframe probe" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+std::vector<std::pair<int64_t, int64_t>> VideoProcessor::planSegments(const std::vector<int64_t>& keyframes,
+                                                                       int segmentCount) {
+    // Boundaries at the keyframes closest to evenly spaced points in time
+    std::vector<int64_t> starts;
+    if (!keyframes.empty() && segmentCount > 1) {
+        int64_t first = keyframes.front();
+        int64_t span = keyframes.back() - first;
+        for (int i = 1; i < segmentCount; i++) {
+            int64_t target = first + span / segmentCount * i;
+            auto it = std::lower_bound(keyframes.begin(), keyframes.end(), target);
+            if (it != keyframes.end() && *it > first && (starts.empty() || *it > starts.back())) {
+                starts.push_back(*it);
+            }
+        }
+    }
+    
+    // Segment i covers presentation timestamps [start, end)
+    std::vector<std::pair<int64_t, int64_t>> segments;
+    int64_t start = std::numeric_limits<int64_t>::min();
+    for (int64_t boundary : starts) {
+        segments.emplace_back(start, boundary);
+        start = boundary;
+    }
+    segments.emplace_back(start, std::numeric_limits<int64_t>::max());
+    return segments;
+}
+
+bool VideoProcessor::transcodeSegment(const std::string& inputPath, const std::string& spoolPath,
+                                      int64_t startPts, int64_t endPts) {
+    if (!openInputFile(inputPath)) {
+        return false;
+    }
+    
+    // Segments carry video only; audio is remuxed once during the join
+    if (inputAudioCodecContext) {
+        avcodec_free_context(&inputAudioCodecContext);
+    }
+    for (unsigned int i = 0; i < inputFormatContext->nb_streams; i++) {
+        if (static_cast<int>(i) != videoStreamIndex) {
+            inputFormatContext->streams[i]->discard = AVDISCARD_ALL;
+        }
+    }
+    audioStreamIndex = -1;
+    
+    // An unopened mp4 context gives the encoder the same settings the joined file uses
+    avformat_alloc_output_context2(&outputFormatContext, nullptr, "mp4", nullptr);
+    if (!outputFormatContext) {
+        std::cerr << "Could not create segment output context" << std::endl;
+        return false;
+    }
+    AVStream* outVideoStream = avformat_new_stream(outputFormatContext, nullptr);
+    if (!outVideoStream || !setupVideoEncoder(outVideoStream) || !initScaler()) {
+        return false;
+    }
+    
+    FILE* spool = fopen(spoolPath.c_str(), "wb");
+    if (!spool) {
+        std::cerr << "Could not open segment file: " << spoolPath << std::endl;
+        return false;
+    }
+    bool ok = writeSpoolHeader(spool, outputVideoCodecContext->time_base);
+    packetSink = [spool](AVPacket* packet) {
+        return writeSpoolPacket(spool, packet);
+    };
+    
+    if (ok && startPts != std::numeric_limits<int64_t>::min() &&
+        av_seek_frame(inputFormatContext, videoStreamIndex, startPts, AVSEEK_FLAG_BACKWARD) < 0) {
+        std::cerr << "Could not seek to segment start" << std::endl;
+        ok = false;
+    }
+    
+    AVPacket* packet = av_packet_alloc();
+    AVFrame* frame = av_frame_alloc();
+    if (!packet || !frame) {
+        std::cerr << "Could not allocate packet/frame" << std::endl;
+        ok = false;
+    }
+    
+    // Encode decoded frames inside [startPts, endPts). The decoder returns
+    // frames in presentation order, so the first frame at or past the end
+    // means every frame of this segment has been seen.
+    bool reachedEnd = false;
+    auto drainDecoder = [&]() {
+        while (true) {
+            int ret = receiveDecoderFrame(frame);
+            if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+                return true;
+            } else if (ret < 0) {
+                std::cerr << "Error receiving frame" << std::endl;
+                return false;
+            }
+            
+            bool encoded = true;
+            if (frame->pts != AV_NOPTS_VALUE && frame->pts >= endPts) {
+                reachedEnd = true;
+            } else if (frame->pts == AV_NOPTS_VALUE || frame->pts >= startPts) {
+                AVFrame* scaledFrame = nullptr;
+                if (scaler.active()) {
+                    scaledFrame = allocScaledFrame();
+                    encoded = scaledFrame && scaleFrame(frame, scaledFrame);
+                } else {
+                    frame->pict_type = AV_PICTURE_TYPE_NONE;
+                }
+                encoded = encoded && encodeAnalyzedFrame(scaledFrame ? scaledFrame : frame);
+                framePool.release(scaledFrame);
+            }
+            av_frame_unref(frame);
+            if (!encoded) {
+                return false;
+            }
+            if (reachedEnd) {
+                return true;
+            }
+        }
+    };
+    
+    int readResult = 0;
+    while (ok && !reachedEnd && (readResult = readInputPacket(packet)) >= 0) {
+        if (packet->stream_index == videoStreamIndex) {
+            if (sendDecoderPacket(packet) < 0) {
+                std::cerr << "Error sending packet for decoding" << std::endl;
+                ok = false;
+            } else {
+                ok = drainDecoder();
+            }
+        }
+        av_packet_unref(packet);
+    }
+    ok = ok && readResult != AVERROR_EXIT;
+    
+    if (ok && !reachedEnd) {
+        sendDecoderPacket(nullptr);
+        ok = drainDecoder();
+    }
+    ok = ok && encodeAnalyzedFrame(nullptr);
+    
+    av_frame_free(&frame);
+    av_packet_free(&packet);
+    packetSink = nullptr;
+    // A finished segment is a checkpoint, so it must survive a power cut
+    if (ok && (fflush(spool) != 0 || fsync(fileno(spool)) != 0)) {
+        ok = false;
+    }
+    if (fclose(spool) != 0) {
+        ok = false;
+    }
+    
+    cleanup();
+    return ok;
+}
+
+bool VideoProcessor::joinSegments(const std::vector<std::string>& spoolPaths,
+                                  const std::function<bool(size_t index)>& waitForSegment) {
+    AVPacket* videoPacket = av_packet_alloc();
+    AVPacket* audioPacket = av_packet_alloc();
+    if (!videoPacket || !audioPacket) {
+        std::cerr << "Could not allocate packet" << std::endl;
+        av_packet_free(&videoPacket);
+        av_packet_free(&audioPacket);
+        return false;
+    }
+    
+    AVStream* outVideoStream = outputFormatContext->streams[0];
+    AVRational spoolTimeBase = outVideoStream->time_base;
+    size_t spoolIndex = 0;
+    FILE* spool = nullptr;
+    int64_t lastDts = AV_NOPTS_VALUE;
+    bool ok = true;
+    
+    // Next video packet across the spools, in order
+    auto nextVideoPacket = [&]() {
+        while (true) {
+            if (!spool) {
+                if (spoolIndex == spoolPaths.size()) {
+                    return false;
+                }
+                // Everything before it is muxed by now, audio included
+                if (!waitForSegment(spoolIndex)) {
+                    ok = false;
+                    return false;
+                }
+                spool = fopen(spoolPaths[spoolIndex++].c_str(), "rb");
+                if (!spool || !readSpoolHeader(spool, spoolTimeBase)) {
+                    std::cerr << "Could not read segment file" << std::endl;
+                    ok = false;
+                    return false;
+                }
+            }
+            if (readSpoolPacket(spool, videoPacket)) {
+                return true;
+            }
+            av_packet_unref(videoPacket);
+            fclose(spool);
+            spool = nullptr;
+        }
+    };
+    
+    auto nextAudioPacket = [&]() {
+        if (audioStreamIndex < 0) {
+            return false;
+        }
+        while (av_read_frame(inputFormatContext, audioPacket) >= 0) {
+            if (audioPacket->stream_index == audioStreamIndex) {
+                return true;
+            }
+            av_packet_unref(audioPacket);
+        }
+        return false;
+    };
+    
+    // Only audio is read from the input here; video comes from the spools
+    inputFormatContext->streams[videoStreamIndex]->discard = AVDISCARD_ALL;
+    
+    bool haveVideo = nextVideoPacket();
+    bool haveAudio = nextAudioPacket();
+    while (ok && (haveVideo || haveAudio)) {
+        // Feed the muxer in dts order so it never has to buffer a whole stream
+        bool takeVideo = haveVideo &&
+            (!haveAudio || av_compare_ts(videoPacket->dts, spoolTimeBase, audioPacket->dts,
+                                         inputFormatContext->streams[audioStreamIndex]->time_base) <= 0);
+        if (takeVideo) {
+            // Segment encoders start their dts independently; keep them increasing
+            if (lastDts != AV_NOPTS_VALUE && videoPacket->dts <= lastDts) {
+                videoPacket->dts = lastDts + 1;
+                videoPacket->pts = std::max(videoPacket->pts, videoPacket->dts);
+            }
+            lastDts = videoPacket->dts;
+            
+            videoPacket->stream_index = 0;
+            av_packet_rescale_ts(videoPacket, spoolTimeBase, outVideoStream->time_base);
+            ok = writePacket(videoPacket);
+            if (!ok) {
+                std::cerr << "Error writing frame" << std::endl;
+            }
+            av_packet_unref(videoPacket);
+            haveVideo = ok && nextVideoPacket();
+        } else {
+            ok = writeAudioPacket(audioPacket);
+            av_packet_unref(audioPacket);
+            haveAudio = ok && nextAudioPacket();
+        }
+    }
+    
+    if (spool) {
+        fclose(spool);
+    }
+    av_packet_free(&videoPacket);
+    av_packet_free(&audioPacket);
+    return ok;
+}
+
+bool VideoProcessor::transcodeSegmented(const std::string& inputPath, const std::string& outputPath) {
+    if (!setupOutputFile(outputPath)) {
+        return false;
+    }
+    // A remux already runs at disk speed
+    if (videoStreamCopy) {
+        return processFrames();
+    }
+    
+    std::vector<int64_t> keyframes;
+    if (!probeKeyframes(keyframes)) {
+        return false;
+    }
+    // Checkpointing alone cuts one segment per interval
+    int segmentCount = segmentCountSetting;
+    if (segmentCount <= 1 && checkpointSeconds > 0 && inputFormatContext->duration > 0) {
+        double duration = static_cast<double>(inputFormatContext->duration) / AV_TIME_BASE;
+        segmentCount = static_cast<int>(std::ceil(duration / checkpointSeconds));
+    }
+    std::vector<std::pair<int64_t, int64_t>> segments = planSegments(keyframes, segmentCount);
+    if (segments.size() < 2) {
+        return processFrames();
+    }
+    
+    std::vector<std::string> spoolPaths;
+    for (size_t i = 0; i < segments.size(); i++) {
+        spoolPaths.push_back(segmentPath(outputPath, i));
+    }
+    
+    // Segments finished by an earlier run of the same plan are kept. The
+    // plan pins every boundary and encoder setting, so any change starts over.
+    std::ostringstream plan;
+    plan << outputSignature() << "|" << jobEncoderSettings.codec << "/" << jobEncoderSettings.preset
+         << "/" << jobEncoderSettings.crf << "\n";
+    for (const auto& segment : segments) {
+        plan << segment.first << " " << segment.second << "\n";
+    }
+    std::vector<size_t> pending;
+    if (checkpointSeconds > 0) {
+        std::string previousPlan = readFile(planPath(outputPath));
+        if (previousPlan != plan.str()) {
+            size_t previousCount = static_cast<size_t>(std::count(previousPlan.begin(), previousPlan.end(), '\n'));
+            for (size_t i = 0; i < std::max(previousCount, segments.size()); i++) {
+                std::remove(segmentPath(outputPath, i).c_str());
+            }
+            if (!writePlan(planPath(outputPath), plan.str())) {
+                std::cerr << "Could not write segment plan" << std::endl;
+                return false;
+            }
+        }
+    }
+    for (size_t i = 0; i < segments.size(); i++) {
+        if (checkpointSeconds > 0 && access(spoolPaths[i].c_str(), F_OK) == 0) {
+            continue;
+        }
+        pending.push_back(i);
+    }
+    if (pending.size() < segments.size()) {
+        std::cerr << "Resuming after " << segments.size() - pending.size() << " of " << segments.size()
+                  << " segments" << std::endl;
+    }
+    
+    int workerCount = segmentWorkerSetting > 0
+        ? segmentWorkerSetting
+        : std::max(1, threading.encoderThreads / ThreadingPolicy::TYPICAL_JOB_THREADS);
+    workerCount = std::max(1, std::min(workerCount, static_cast<int>(pending.size())));
+    
+    // Workers split this job's threads between them
+    ThreadingPolicy workerThreading = threading.divided(workerCount);
+    
+    // Segments for the runner are handed out by threads of their own, next
+    // to the local workers, and come back here if it has nowhere to run them
+    int remoteCount = segmentRunner ? std::min(segmentRunnerSlots, static_cast<int>(pending.size())) : 0;
+    std::string remoteSettings;
+    if (remoteCount > 0) {
+        VideoProcessor remote;
+        copySettingsTo(remote);
+        remote.streamCopyEnabled = false;
+        remoteSettings = remote.exportSettings();
+    }
+    
+    // Each worker has its own decoder, scaler and encoder
+    std::atomic<size_t> nextSegment(0);
+    std::atomic<size_t> finishedSegments(segments.size() - pending.size());
+    std::atomic<bool> failed(false);
+    std::vector<std::thread> workers;
+    
+    // Segments whose spool is complete, for the join on this thread
+    std::mutex segmentsMutex;
+    std::condition_variable segmentDone;
+    std::vector<bool> done(segments.size(), true);
+    for (size_t i : pending) {
+        done[i] = false;
+    }
+    int activeWorkers = workerCount + remoteCount;
+    // Only checkpointed jobs can pick up where they yielded
+    auto yieldRequested = [&]() {
+        return checkpointSeconds > 0 && yieldFlag && yieldFlag->load();
+    };
+    auto runSegments = [&](bool remote) {
+        VideoProcessor worker;
+        copySettingsTo(worker);
+        worker.streamCopyEnabled = false;
+        worker.threading = workerThreading;
+        for (size_t next = nextSegment++; next < pending.size() && !failed && !yieldRequested();
+             next = nextSegment++) {
+            size_t i = pending[next];
+            // Only complete segments ever carry the final name
+            std::string partialPath = spoolPaths[i] + ".part";
+            RemoteResult result = RemoteResult::Unavailable;
+            if (remote) {
+                SegmentTask task;
+                task.inputPath = inputPath;
+                task.spoolPath = partialPath;
+                task.startPts = segments[i].first;
+                task.endPts = segments[i].second;
+                task.settings = remoteSettings;
+                result = segmentRunner(task, cancelFlag);
+            }
+            bool transcoded = result == RemoteResult::Unavailable
+                ? worker.transcodeSegment(inputPath, partialPath, segments[i].first, segments[i].second)
+                : result == RemoteResult::Succeeded;
+            if (!transcoded || std::rename(partialPath.c_str(), spoolPaths[i].c_str()) != 0) {
+                std::cerr << "Segment " << i << " failed" << std::endl;
+                std::remove(partialPath.c_str());
+                failed = true;
+            } else {
+                // Segments finish out of order; report the share that is done
+                int64_t finished = static_cast<int64_t>(++finishedSegments);
+                progressPosition = progressDuration * finished / static_cast<int64_t>(segments.size());
+            }
+            progressFrames += worker.progressFrames.exchange(0);
+            {
+                std::lock_guard<std::mutex> lock(segmentsMutex);
+                done[i] = !failed;
+            }
+            segmentDone.notify_all();
+        }
+        metrics.merge(worker.metrics);
+        {
+            std::lock_guard<std::mutex> lock(segmentsMutex);
+            activeWorkers--;
+        }
+        segmentDone.notify_all();
+    };
+    // False once the segment can no longer come: a worker failed, or all of
+    // them stopped, having yielded
+    auto waitForSegment = [&](size_t index) {
+        std::unique_lock<std::mutex> lock(segmentsMutex);
+        segmentDone.wait(lock, [&]() { return done[index] || failed || activeWorkers == 0; });
+        return done[index] && !failed;
+    };
+    for (int w = 0; w < workerCount + remoteCount; w++) {
+        workers.emplace_back(runSegments, w >= workerCount);
+    }
+    // Muxed while the later segments are still being encoded, so the
+    // fragmented output grows from the first segment on
+    bool joined = joinSegments(spoolPaths, waitForSegment);
+    bool segmentFailed = failed;
+    if (!joined) {
+        // No worker starts another segment
+        failed = true;
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    
+    if (!joined && !segmentFailed && finishedSegments < segments.size() && yieldRequested()) {
+        std::cerr << "Yielding after " << finishedSegments << " of " << segments.size() << " segments" << std::endl;
+        yieldedLast = true;
+        return false;
+    }
+    bool ok = joined && !failed;
+    
+    // A checkpointed job that failed keeps its segments for the retry
+    if (ok || checkpointSeconds <= 0 || cancelRequested()) {
+        for (const auto& path : spoolPaths) {
+            std::remove(path.c_str());
+        }
+        std::remove(planPath(outputPath).c_str());
+    }
+    if (!ok) {
+        return false;
+    }
+    
+    if (!finishAudio() || av_write_trailer(outputFormatContext) < 0) {
+        std::cerr << "Error writing trailer" << std::endl;
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,249 @@
+#include "video_processor.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/opt.h>
+}
+
+namespace {
+
+// mjpeg wants full-range YUV; libwebp takes the usual limited range
+AVPixelFormat thumbnailPixelFormat(ThumbnailFormat format) {
+    return format == ThumbnailFormat::Jpeg ? AV_PIX_FMT_YUVJ420P : AV_PIX_FMT_YUV420P;
+}
+
+AVFrame* allocPicture(int width, int height, AVPixelFormat format) {
+    AVFrame* picture = av_frame_alloc();
+    if (!picture) {
+        return nullptr;
+    }
+    picture->format = format;
+    picture->width = width;
+    picture->height = height;
+    if (av_frame_get_buffer(picture, 0) < 0) {
+        av_frame_free(&picture);
+    }
+    return picture;
+}
+
+// Black in the sprite's range, so unfilled tiles of the last row stay dark
+void fillBlack(AVFrame* picture) {
+    uint8_t luma = picture->format == AV_PIX_FMT_YUVJ420P ? 0 : 16;
+    for (int plane = 0; plane < 3; plane++) {
+        int height = plane == 0 ? picture->height : (picture->height + 1) / 2;
+        int width = plane == 0 ? picture->width : (picture->width + 1) / 2;
+        for (int y = 0; y < height; y++) {
+            memset(picture->data[plane] + y * picture->linesize[plane], plane == 0 ? luma : 128, width);
+        }
+    }
+}
+
+bool encodeImage(AVFrame* picture, ThumbnailFormat format, std::string& image) {
+    const AVCodec* encoder = format == ThumbnailFormat::Jpeg ? avcodec_find_encoder(AV_CODEC_ID_MJPEG)
+                                                             : avcodec_find_encoder_by_name("libwebp");
+    if (!encoder) {
+        std::cerr << "Could not find " << (format == ThumbnailFormat::Jpeg ? "JPEG" : "WebP") << " encoder"
+                  << std::endl;
+        return false;
+    }
+    
+    AVCodecContext* context = avcodec_alloc_context3(encoder);
+    AVPacket* packet = av_packet_alloc();
+    if (!context || !packet) {
+        std::cerr << "Could not allocate image encoder" << std::endl;
+        avcodec_free_context(&context);
+        av_packet_free(&packet);
+        return false;
+    }
+    
+    context->width = picture->width;
+    context->height = picture->height;
+    context->pix_fmt = static_cast<AVPixelFormat>(picture->format);
+    context->time_base = AVRational{1, 25};
+    if (format == ThumbnailFormat::Jpeg) {
+        // Fixed quantizer instead of a bitrate; 2 is best, 31 worst
+        context->flags |= AV_CODEC_FLAG_QSCALE;
+        context->global_quality = FF_QP2LAMBDA * 4;
+    } else {
+        av_opt_set_int(context->priv_data, "quality", 80, 0);
+    }
+    
+    bool ok = avcodec_open2(context, encoder, nullptr) >= 0 &&
+              avcodec_send_frame(context, picture) >= 0 &&
+              avcodec_send_frame(context, nullptr) >= 0;
+    image.clear();
+    while (ok) {
+        int ret = avcodec_receive_packet(context, packet);
+        if (ret == AVERROR_EOF) {
+            break;
+        }
+        ok = ret >= 0;
+        if (ok) {
+            image.append(reinterpret_cast<const char*>(packet->data), packet->size);
+        }
+        av_packet_unref(packet);
+    }
+    if (!ok) {
+        std::cerr << "Error encoding thumbnail image" << std::endl;
+    }
+    
+    avcodec_free_context(&context);
+    av_packet_free(&packet);
+    return ok && !image.empty();
+}
+
+} // namespace
+
+const char* VideoProcessor::thumbnailMimeType(ThumbnailFormat format) {
+    return format == ThumbnailFormat::Jpeg ? "image/jpeg" : "image/webp";
+}
+
+bool VideoProcessor::extractThumbnails(const std::string& inputPath, const ThumbnailOptions& options,
+                                       std::string& image) {
+    try {
+        // Frame threads would hold back the one frame wanted until more
+        // packets arrive; a single keyframe decodes fastest on its own
+        ThreadingPolicy jobThreading = threading;
+        threading.decoderThreads = 1;
+        bool opened = openInputFile(inputPath);
+        threading = jobThreading;
+        
+        bool rendered = opened && renderThumbnails(options, image);
+        
+        cleanup();
+        return rendered;
+    } catch (const std::exception& e) {
+        std::cerr << "Error extracting thumbnails: " << e.what() << std::endl;
+        cleanup();
+        return false;
+    }
+}
+
+bool VideoProcessor::renderThumbnails(const ThumbnailOptions& options, std::string& image) {
+    // Only keyframe packets of the video stream are read and decoded
+    for (unsigned int i = 0; i < inputFormatContext->nb_streams; i++) {
+        if (static_cast<int>(i) != videoStreamIndex) {
+            inputFormatContext->streams[i]->discard = AVDISCARD_ALL;
+        }
+    }
+    inputVideoCodecContext->skip_frame = AVDISCARD_NONKEY;
+    
+    std::vector<double> times = options.timestamps;
+    if (times.empty()) {
+        double duration = inputFormatContext->duration > 0
+            ? static_cast<double>(inputFormatContext->duration) / AV_TIME_BASE
+            : 0.0;
+        // Without a duration only the start can be found
+        int count = duration > 0.0 ? std::max(1, options.count) : 1;
+        // Middle of each of count equal spans, so neither end is a black frame
+        for (int i = 0; i < count; i++) {
+            times.push_back(duration * (i + 0.5) / count);
+        }
+    }
+    
+    // Tile size from the display aspect ratio, even for 4:2:0 chroma
+    int sourceWidth = inputVideoCodecContext->width;
+    int sourceHeight = inputVideoCodecContext->height;
+    AVRational sar = inputVideoCodecContext->sample_aspect_ratio;
+    double displayWidth = sar.num > 0 && sar.den > 0 ? sourceWidth * av_q2d(sar) : sourceWidth;
+    int tileWidth = std::max(2, options.width & ~1);
+    int tileHeight = std::max(2, static_cast<int>(std::lround(tileWidth * sourceHeight / displayWidth)) & ~1);
+    
+    int tiles = static_cast<int>(times.size());
+    int columns = options.columns > 0 ? options.columns
+                                      : static_cast<int>(std::ceil(std::sqrt(static_cast<double>(tiles))));
+    columns = std::min(columns, tiles);
+    int rows = (tiles + columns - 1) / columns;
+    
+    AVPixelFormat pixelFormat = thumbnailPixelFormat(options.format);
+    if (!scaler.init(sourceWidth, sourceHeight, inputVideoCodecContext->pix_fmt,
+                     tileWidth, tileHeight, pixelFormat, ScaleQuality::Bilinear, 1)) {
+        std::cerr << "Could not initialize thumbnail scaler" << std::endl;
+        return false;
+    }
+    
+    AVFrame* sprite = allocPicture(tileWidth * columns, tileHeight * rows, pixelFormat);
+    AVFrame* tile = allocPicture(tileWidth, tileHeight, pixelFormat);
+    AVFrame* frame = av_frame_alloc();
+    if (!sprite || !tile || !frame) {
+        std::cerr << "Could not allocate thumbnail pictures" << std::endl;
+        av_frame_free(&sprite);
+        av_frame_free(&tile);
+        av_frame_free(&frame);
+        return false;
+    }
+    fillBlack(sprite);
+    
+    int decoded = 0;
+    for (int i = 0; i < tiles; i++) {
+        if (!decodeKeyframeAt(times[i], frame)) {
+            continue;
+        }
+        bool scaled = scaler.scale(frame, tile);
+        av_frame_unref(frame);
+        if (!scaled) {
+            continue;
+        }
+        
+        int x = (i % columns) * tileWidth;
+        int y = (i / columns) * tileHeight;
+        for (int plane = 0; plane < 3; plane++) {
+            int shift = plane == 0 ? 0 : 1;
+            uint8_t* dst = sprite->data[plane] + (y >> shift) * sprite->linesize[plane] + (x >> shift);
+            av_image_copy_plane(dst, sprite->linesize[plane], tile->data[plane], tile->linesize[plane],
+                                tileWidth >> shift, tileHeight >> shift);
+        }
+        decoded++;
+    }
+    
+    bool ok = decoded > 0 && encodeImage(sprite, options.format, image);
+    if (decoded == 0) {
+        std::cerr << "Could not decode any keyframe for thumbnails" << std::endl;
+    }
+    
+    av_frame_free(&sprite);
+    av_frame_free(&tile);
+    av_frame_free(&frame);
+    return ok;
+}
+
+bool VideoProcessor::decodeKeyframeAt(double seconds, AVFrame* frame) {
+    AVStream* stream = inputFormatContext->streams[videoStreamIndex];
+    int64_t start = stream->start_time != AV_NOPTS_VALUE ? stream->start_time : 0;
+    int64_t target = start + static_cast<int64_t>(seconds / av_q2d(stream->time_base));
+    if (av_seek_frame(inputFormatContext, videoStreamIndex, target, AVSEEK_FLAG_BACKWARD) < 0) {
+        // Inputs without an index can only be read from where they are
+        if (seconds > 0.0) {
+            return false;
+        }
+    }
+    avcodec_flush_buffers(inputVideoCodecContext);
+    
+    AVPacket* packet = av_packet_alloc();
+    if (!packet) {
+        return false;
+    }
+    
+    // Send the first keyframe, then drain so the decoder gives it back
+    // without waiting for the packets that would follow it
+    bool sent = false;
+    while (!sent && av_read_frame(inputFormatContext, packet) >= 0) {
+        if (packet->stream_index == videoStreamIndex && (packet->flags & AV_PKT_FLAG_KEY)) {
+            sent = avcodec_send_packet(inputVideoCodecContext, packet) >= 0;
+        }
+        av_packet_unref(packet);
+    }
+    av_packet_free(&packet);
+    if (!sent) {
+        return false;
+    }
+    
+    avcodec_send_packet(inputVideoCodecContext, nullptr);
+    return avcodec_receive_frame(inputVideoCodecContext, frame) >= 0;
+}